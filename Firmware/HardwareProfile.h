@@ -77,7 +77,13 @@
 #define LED 		    LATCbits.LATC4
 #define LED_TRIS		TRISCbits.RC4
 
-#define clock_delay() Nop();Nop()
+/* Delay of every clock phase, set by command 0xAB.
+   0 = no padding, 1 = two inline Nop (default), above 1 the two Nop
+   and a DelayTck() loop of about 3 cycles per count. */
+extern unsigned char _tckDelay;
+void DelayTck(void);
+#define clock_delay() do { if (_tckDelay) { Nop(); Nop(); \
+	if (_tckDelay > 1) DelayTck(); } } while (0)
 
 //ICSP Wire port definitions
 #define WIRES_ICSP 		1
@@ -19,7 +19,9 @@ echo COMPILING...
 %C18% %include18% "%MCHP_USB_PATH%\usb_device.c" -fo="objs\usb_device.o" %c18options%
 %C18% %include18% "%MCHP_USB_PATH%\HID Device Driver\usb_function_hid.c" -fo="objs\usb_function_hid.o" %c18options%
 %C18% %include18% "pic32prog.c" -fo="objs\pic32prog.o" %c18options%
+%C18% %include18% "script.c" -fo="objs\script.o" %c18options%
+%C18% %include18% "stats.c" -fo="objs\stats.o" %c18options%
 %C18% %include18% "main.c" -fo="objs\main.o" %c18options%
-%linker% /p%piccpu% /l"..\..\C18\lib" "HID%piccpu%.lkr" "objs\usb_descriptors.o" "objs\usb_device.o" "objs\usb_function_hid.o" "objs\pic32prog.o" "objs\main.o" %linkoptions%
+%linker% /p%piccpu% /l"..\..\C18\lib" "HID%piccpu%.lkr" "objs\usb_descriptors.o" "objs\usb_device.o" "objs\usb_function_hid.o" "objs\pic32prog.o" "objs\script.o" "objs\stats.o" "objs\main.o" %linkoptions%
 %lister% /p %piccpu% "%builName%.cof"
 pause
@@ -45,6 +45,8 @@ Boot Enter> MCLR/RA4	=|		   |= VUSB
 #else
 	#include "pic32prog.h"
 #endif
+#include "script.h"
+#include "stats.h"
 //Even if supported 18f2550 it is NOT raccomanded,this because he CAN'T run full speed at 3.3v 
 //so you need to add more parts on the circuit with these PICS.
 //18f14k50 can run full speed at 3.3 and the 3.3v supply can be taken from target circuit 
@@ -55,16 +57,13 @@ Boot Enter> MCLR/RA4	=|		   |= VUSB
 // Firmware global variables
 // Define the globals for the USB data in the USB RAM of the PIC18F14**50
 #pragma udata //GP1
-USB_HANDLE USBOutHandle = 0;
+USB_HANDLE USBOutHandle[2] = { 0, 0 };
 USB_HANDLE USBInHandle = 0;
+UINT8 USBOutCurrent = 0;	/* OUT buffer of the next command */
+UINT8 USBQueueMax = 0;		/* Most commands found waiting at once */
 
-#if defined(__18F2550) | defined(__18F4550)
-	#pragma udata USB_VARIABLES=0x500
-#elif defined(__18F14K50)
-	#pragma udata USB_VARS=0x280
-#endif
 /* Helpers union/structures. */
-union {
+typedef union {
   BYTE Buffer[64];
   struct {
     BYTE RequestedCommand;
@@ -82,21 +81,35 @@ union {
 	BYTE CmdNbits;
 	BYTE dummy[61];
   };
-  struct { //Raw tms_prolog_nbits, unsigned tms_prolog, unsigned tdi_nbits, unsigned long long tdi, int read_flag
-    BYTE RequestedCommand;  //63
-	BYTE TmsNbits;			//62
-	BYTE Tms;				//61
-	BYTE TdiNbits;			//60
-	WORD Tdi;				//59 58 57 56 
-	BYTE ReadFlag;		    //55
-	BYTE dummy[54];
+  struct { //Raw flags, nBits, TMS[n], TDI[n], mask[n]
+    BYTE RequestedCommand;
+	BYTE RawFlags;
+	BYTE RawNbits;
+	BYTE RawVectors[61];
   };
   struct {
 	BYTE RequestedCommand; //63
 	UINT32 DWordValue;
 	BYTE sendLength;
   };
-} USBInput;
+} USB_INPUT;
+
+/* Two OUT buffers in ping-pong: the next command is received
+   while the current one is executed. The reply has one IN buffer,
+   there is no USB RAM left for a second one. */
+#if defined(__18F2550) | defined(__18F4550)
+	#pragma udata USB_VARIABLES2=0x580
+#elif defined(__18F14K50)
+	#pragma udata USB_VARS2=0x240
+#endif
+USB_INPUT USBInput2;
+
+#if defined(__18F2550) | defined(__18F4550)
+	#pragma udata USB_VARIABLES=0x500
+#elif defined(__18F14K50)
+	#pragma udata USB_VARS=0x280
+#endif
+USB_INPUT USBInput;
 union {
   BYTE Buffer[64];
   struct {
@@ -244,9 +257,13 @@ static void initialisePic(void)
     #endif
 
    	// Initialize the variable holding the USB handle for the last transmission
-    USBOutHandle = 0;
+    USBOutHandle[0] = 0;
+    USBOutHandle[1] = 0;
     USBInHandle = 0;
     
+    // Initialise the performance counters and Timer0
+    StatsInit();
+
     // Initialise the USB device
     USBDeviceInit();
 
@@ -273,12 +290,23 @@ void processUsbCommands(void)
 	UINT8 index = 0;
 	UINT32_VAL readValue;
 	UINT8* ptrMulti; 
+	UINT8 received = FLAG_FALSE;
+	USB_INPUT* in = USBOutCurrent ? &USBInput2 : &USBInput;
     // Check if we are in the configured state; otherwise just return
     if((USBDeviceState < CONFIGURED_STATE) || (USBSuspendControl == 1)) { return; }
+	StatsMark(FLAG_FALSE);
 	
 	// Check if data was received from the host.
-    if(!HIDRxHandleBusy(USBOutHandle))
+    if(!HIDRxHandleBusy(USBOutHandle[USBOutCurrent]))
     {   
+		received = FLAG_TRUE;
+		StatsCommand(in->RequestedCommand);
+		if (!HIDRxHandleBusy(USBOutHandle[USBOutCurrent ^ 1]))
+			USBQueueMax = 2;
+		else if (USBQueueMax == 0)
+			USBQueueMax = 1;
+		// The previous reply must be gone before the buffer is reused.
+		while (HIDTxHandleBusy(USBInHandle));
 		// Clear trasmit buffer.
 		for (bufferPointer = 0; bufferPointer < 64; bufferPointer++)
 		{
@@ -286,14 +314,14 @@ void processUsbCommands(void)
 		}
 		readValue.Val = 0;
 		// Command mode 
-		switch(USBInput.RequestedCommand)
+		switch(in->RequestedCommand)
 		{
 			case 0x10: { // Get adapter info.
 				expectedData = 0;
 				dataReceivedOk = FLAG_TRUE;
 				for (bufferPointer = 1; bufferPointer < 64; bufferPointer++)
 				{
-					if (USBInput.Buffer[bufferPointer] != expectedData)
+					if (in->Buffer[bufferPointer] != expectedData)
 						dataReceivedOk = FLAG_FALSE;
 					expectedData++;
 				}
@@ -313,8 +341,8 @@ void processUsbCommands(void)
 			case 0x11: { // Get/Set Wires mode
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
-				if (USBInput.Buffer[1]) { //0 = get 
-					SetWiresMode(USBInput.Buffer[2]);	
+				if (in->Buffer[1]) { //0 = get 
+					SetWiresMode(in->Buffer[2]);	
 				}
 				USBOutput.Buffer[1] = GetWiresMode();
 				break;
@@ -322,7 +350,7 @@ void processUsbCommands(void)
 			case 0x22: { // Setup the I/O ports based on WiresMode.
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_FALSE;
-				SetupIOPorts(USBInput.Buffer[1]); //Set/Unset
+				SetupIOPorts(in->Buffer[1]); //Set/Unset
 				break;
 			}
 			case 0x20: { //SET LED(S) STATUS 
@@ -345,7 +373,7 @@ void processUsbCommands(void)
 			case 0x81: { //ReadFromAddress
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
-				readValue = ReadFromAddress(USBInput.DWordValue);
+				readValue = ReadFromAddress(in->DWordValue);
 				USBOutput.ResponseDWord = readValue;
 				break;
 			}
@@ -361,47 +389,53 @@ void processUsbCommands(void)
 				EnterPgmMode();
 				break;
 			}
+			case 0x84: { //Attach (wires mode) IDCODE, MCHP_STATUS and wires mode in SendData
+				dataReceivedOk = FLAG_TRUE;
+				needReply = FLAG_TRUE;
+				Attach(in->Buffer[1], &USBOutput.SendData[0]);
+				break;
+			}
 			case 0x85: { //Transfer Data      
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
-				XferData((unsigned char*)&USBInput.DWordValue, USBInput.sendLength,(unsigned char*) &USBOutput.SendData);
+				XferData((unsigned char*)&in->DWordValue, in->sendLength,(unsigned char*) &USBOutput.SendData);
 				break;
 			}
 			case 0x86: { //Enter Serial Execution Mode
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
 				//added MX family flag.
-				USBOutput.Buffer[1] = SerialExecutionMode(USBInput.Buffer[1]);
+				USBOutput.Buffer[1] = SerialExecutionMode(in->Buffer[1]);
 				break;
 			}
 			case 0x87: { //Wait ETap Ready       
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
-				USBOutput.Buffer[1] = WaitETAP_Ready(USBInput.Command);
+				USBOutput.Buffer[1] = WaitETAP_Ready(in->Command);
 				break;
 			}
 			case 0x88: { // SetMode (mode, ModeNbits) 
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_FALSE;
-				SetMode(USBInput.Mode,USBInput.ModeNbits);
+				SetMode(in->Mode,in->ModeNbits);
 				break;
 			}
 			case 0x99: { // SendCommand (cmd, CmdNbits) 
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_FALSE;
-				SendCommand(USBInput.Command,USBInput.CmdNbits);
+				SendCommand(in->Command,in->CmdNbits);
 				break;
 			}
 			case 0xDD: { //XferInstruction				
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
-				USBOutput.Buffer[1] = XferInstruction(USBInput.DWordValue);
+				USBOutput.Buffer[1] = XferInstruction(in->DWordValue);
 				break;
 			}
 			case 0xA0:{ //XferFastData 					
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;	
-				XferFastData((unsigned char*)&USBInput.Buffer[1], (unsigned char*) &USBOutput.SendData, (unsigned char*) &USBOutput.Buffer[5]);
+				XferFastData((unsigned char*)&in->Buffer[1], (unsigned char*) &USBOutput.SendData, (unsigned char*) &USBOutput.Buffer[5]);
 				break;
 			}
 			case 0xCC: { //GetPEResponse				
@@ -414,12 +448,66 @@ void processUsbCommands(void)
 				dataReceivedOk = FLAG_TRUE;
 				needReply = FLAG_TRUE;
 				ptrMulti = &USBOutput.SendData[0];
-				while (USBInput.Buffer[1]--){
+				while (in->Buffer[1]--){
 					GetPEResponse(ptrMulti);
 					ptrMulti+=4;
 				}
 				break;
 			}
+			case 0x40: { //Clear the script buffer
+				dataReceivedOk = FLAG_TRUE;
+				needReply = FLAG_TRUE;
+				ClearScripts();
+				break;
+			}
+			case 0x41: { //Download script (slot, length, script...)
+				needReply = FLAG_TRUE;
+				dataReceivedOk = DownloadScript(in->Buffer[1], in->Buffer[2], &in->Buffer[3]);
+				break;
+			}
+			case 0x42: { //Run script (slot, iterations, parameters...) results in SendData, length in SendData[61]
+				needReply = FLAG_TRUE;
+				dataReceivedOk = RunScript(in->Buffer[1], in->Buffer[2], &in->Buffer[3], &USBOutput.SendData[0], &USBOutput.SendData[61]);
+				break;
+			}
+			case 0xAA: { //Raw TMS/TDI vectors (flags, nbits, tms..., tdi..., mask...) TDO in SendData, count in SendData[61]
+				needReply = (in->RawFlags & (RAW_CAPTURE | RAW_MASK)) ? FLAG_TRUE : FLAG_FALSE;
+				if (in->RawNbits > ((in->RawFlags & RAW_MASK) ? RAW_MAX_MASKED : RAW_MAX_BITS)) {
+					dataReceivedOk = FLAG_FALSE;
+					break;
+				}
+				dataReceivedOk = FLAG_TRUE;
+				USBOutput.SendData[61] = RawShift(in->RawFlags, in->RawNbits, &in->RawVectors[0], &USBOutput.SendData[0]);
+				break;
+			}
+			case 0xAB: { //Set TCK/PGC phase delay (delay), 0 = no padding, 1 = default; old delay in SendData[0]
+				dataReceivedOk = FLAG_TRUE;
+				needReply = FLAG_TRUE;
+				USBOutput.SendData[0] = _tckDelay;
+				SetTckDelay(in->Buffer[1]);
+				break;
+			}
+			case 0xAE: { //Set chain position (irPre, irPost, drPre, drPost) of the selected TAP
+				dataReceivedOk = FLAG_TRUE;
+				needReply = FLAG_TRUE;
+				SetChain(in->Buffer[1], in->Buffer[2], in->Buffer[3], in->Buffer[4]);
+				break;
+			}
+			case 0xAC: { //Read performance counters (page, reset) length in SendData[61]
+				needReply = FLAG_TRUE;
+				USBOutput.SendData[61] = StatsRead(in->Buffer[1], in->Buffer[2], &USBOutput.SendData[0]);
+				dataReceivedOk = USBOutput.SendData[61] ? FLAG_TRUE : FLAG_FALSE;
+				break;
+			}
+			case 0xAD: { //Get queue info: OUT buffers, IN buffers, most commands waiting (reset)
+				dataReceivedOk = FLAG_TRUE;
+				needReply = FLAG_TRUE;
+				USBOutput.SendData[0] = 2;
+				USBOutput.SendData[1] = 1;
+				USBOutput.SendData[2] = USBQueueMax;
+				USBQueueMax = 0;
+				break;
+			}
 #if defined(PROGRAMMABLE_WITH_USB_HID_BOOTLOADER) || defined(PROGRAMMABLE_WITH_USB_MCHPUSB_BOOTLOADER)
 			case 0xFE: { // Soft RESET
 				USBSoftDetach();
@@ -433,18 +521,20 @@ void processUsbCommands(void)
 				break;
 			}
 		}
-		// Re-arm the OUT endpoint for the next packet
-	    USBOutHandle = HIDRxPacket(HID_EP,(BYTE*)&USBInput,64);
+		if (needReply) { //Trasmette una replica al commando ricevuto
+			//Primo byte esito dell'elaborazione del commando ricevuto.
+			//Ultimo byte ?la replica del codice del commando ricevuto. 
+			USBOutput.ReplyStatus = dataReceivedOk;
+			USBOutput.ReplyCommand = in->RequestedCommand;
+			USBInHandle = HIDTxPacket(HID_EP,(BYTE*)&USBOutput,64);
+			_stats.reportsOut++;
+		}
+		// Re-arm this OUT buffer, the other one is already receiving.
+	    USBOutHandle[USBOutCurrent] = HIDRxPacket(HID_EP,(BYTE*)in,64);
+		USBOutCurrent ^= 1;
   	}
-	if (needReply) { //Trasmette una replica al commando ricevuto
-		//Primo byte esito dell'elaborazione del commando ricevuto.
-		//Ultimo byte ?la replica del codice del commando ricevuto. 
-		USBOutput.ReplyStatus = dataReceivedOk;
-		USBOutput.ReplyCommand = USBInput.RequestedCommand;
-		// VOGLIO sempre trasmettere la risposta all'host quindi se ?occupato aspetto.
-		while (HIDTxHandleBusy(USBInHandle));
-		USBInHandle = HIDTxPacket(HID_EP,(BYTE*)&USBOutput,64);
-	}
+	if (received)
+		StatsMark(FLAG_TRUE);
 }
 /******************************************************************************
  Execute USB commands received
@@ -486,8 +576,10 @@ void USBCBInitEP(void)
     // Enable the HID endpoint
     USBEnableEndpoint(HID_EP,USB_IN_ENABLED|USB_OUT_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
     
-    // Re-arm the OUT endpoint for the next packet
-    USBOutHandle = HIDRxPacket(HID_EP,(BYTE*)&USBInput.Buffer,64);
+    // Arm both OUT buffers, in ping-pong order
+    USBOutCurrent = 0;
+    USBOutHandle[0] = HIDRxPacket(HID_EP,(BYTE*)&USBInput,64);
+    USBOutHandle[1] = HIDRxPacket(HID_EP,(BYTE*)&USBInput2,64);
 }
 // Send resume call-back
 void USBCBSendResume(void)
@@ -1,5 +1,6 @@
 #include "HardwareProfile.h"
 #include "pic32prog.h"
+#include "stats.h"
 #if defined(__18F14K50)
 	#include <p18f14k50.h>
 #elif defined(__18F2550)
@@ -8,6 +9,11 @@
 static UINT8 _inPgmMode = 0;
 static UINT8 _wireMode = WIRES_JTAG;
 static UINT32 _dummyRead = 0;
+UINT8 _tckDelay = 1;
+/* Bits of the other TAPs of a daisy chain, in BYPASS:
+ before (nearer TDO) and after the selected TAP.
+*/
+static UINT8 _irPre = 0, _irPost = 0, _drPre = 0, _drPost = 0;
 
 UINT8 GetWiresMode(){
 	return _wireMode;
@@ -86,6 +92,50 @@ void ExitPgmMode(void){
 	LED_OFF();
 	_inPgmMode = 0;
 }
+/* Attach(wiresMode, reply)
+ Wires mode setup, I/O init, programming mode entry, then
+ IDCODE in reply[0..3], MCHP_STATUS in reply[4], wires mode in reply[5].
+ The TAP is left with MTAP_COMMAND selected.
+*/
+void Attach(UINT8 wiresMode, UINT8* reply){
+	SetWiresMode(wiresMode);
+	SetupIOPorts(1);
+	if (!_inPgmMode)
+		EnterPgmMode();
+	GetDeviceId(reply);
+	SetMode(ETAP_RESET);
+	SendCommand(MTAP_SW_MTAP);
+	SetMode(ETAP_RESET);
+	SendCommand(MTAP_COMMAND);
+	XferData((UINT8*)MCHP_STATUS, reply + 4);
+	reply[5] = _wireMode;
+}
+/* Extra delay of a clock phase, called by clock_delay() only
+ for delays above 1: about 3 cycles per count above 1.
+*/
+void DelayTck(void){
+	UINT8 d = _tckDelay;
+	while (--d)
+		Nop();
+}
+void SetTckDelay(UINT8 delay){
+	_tckDelay = delay;
+}
+/* Position of the selected TAP in the chain, in IR bits and
+ in BYPASS bits of the other TAPs. All zero for a single TAP.
+*/
+void SetChain(UINT8 irPre, UINT8 irPost, UINT8 drPre, UINT8 drPost){
+	_irPre = irPre;
+	_irPost = irPost;
+	_drPre = drPre;
+	_drPost = drPost;
+}
+/* Pad bits for the other TAPs, TMS=1 on the last one when it ends the scan.
+*/
+static void ShiftPad(UINT8 nBits, UINT8 tdi, UINT8 last){
+	while (nBits--)
+		io_clock_bit((last && !nBits) ? 1 : 0, tdi);
+}
 /* Ciclo di Clock + lettura TDO.
  based on _wireMode do 2-4 phases or normal on phase clock.
 */
@@ -146,10 +196,16 @@ TDI->\__________________________
 TDO->----------------------------
 */
 void SetMode(UINT8 mode, UINT8 nBits){
+	UINT8 reset = (nBits == 6 && (mode & 0x3f) == 0x1f);
+	_stats.tckCycles += nBits;
 	while (nBits--)	{
 		io_clock_bit(mode,0);
 		mode >>= 1;
 	}
+	/* After a reset the other TAPs of a chain have IDCODE selected:
+	 put them in BYPASS, the selected TAP keeps IDCODE. */
+	if (reset && (_irPre || _irPost))
+		SendCommand(MTAP_IDCODE);
 }
 /* SendCommand(command)
 PAGE 14 DS60001145N
@@ -161,16 +217,20 @@ nbits command + (TMS=1 on last bit)
 TMS Footer (10)
 */
 void SendCommand(UINT8 cmd, UINT8 nCmdBits){
+	/* Counted once per scan: header, pads, command and footer. */
+	_stats.tckCycles += 6 + _irPre + nCmdBits + _irPost;
 	/*1)TMS Header (1100) 
 	    ENTER SHIFT-IR STATE */
 	io_clock_bit(1, 0);		/* SELECT-DR		*/
 	io_clock_bit(1, 0);		/* SELECT-IR		*/
 	io_clock_bit(0, 0);		/* CAPTURE-IR		*/
 	io_clock_bit(0, 0);		/* SHIFT-IR		*/
+	ShiftPad(_irPre, 1, 0);		/* BYPASS for the TAPs nearer TDO */
 	while (nCmdBits--){	
-		io_clock_bit(!nCmdBits ? 1 : 0, cmd);
+		io_clock_bit((!nCmdBits && !_irPost) ? 1 : 0, cmd);
 		cmd>>=1;
 	}
+	ShiftPad(_irPost, 1, 1);
 	/*3)TMS Footer (10) 
 	    ENTER RUN-TEST/IDLE STATE */ 
 	io_clock_bit(1, 0);		/* UPDATE-IR		*/
@@ -187,12 +247,15 @@ TSM Footer (10);
 void XferData(UINT8* data, UINT8 nBits, UINT8* response){
 	UINT8 tdoBits = 0;
 	UINT8 tdiBits = 0;
+	_stats.tckCycles += 5 + nBits + _drPost +
+		(_wireMode == WIRES_JTAG ? _drPre : 0);
 //1. TMS Header (100)  +Read.
 	io_clock_bit(1,0);
 	io_clock_bit(0,0);
 //2.a JTAG clock
 	if (_wireMode == WIRES_JTAG) {
 		io_clock_bit(0,0);
+		ShiftPad(_drPre, 0, 0);
 	} else {
 //2.b ICSP clock
 		*response = io_clock_bit(0,0);
@@ -200,7 +263,7 @@ void XferData(UINT8* data, UINT8 nBits, UINT8* response){
 	}
 //3. Send and Receive Data
 	while (nBits--){
-		*response |= io_clock_bit((!nBits)?1:0,*data)<<tdoBits;
+		*response |= io_clock_bit((!nBits && !_drPost)?1:0,*data)<<tdoBits;
 		/**data >>= 1;
 		bitsNum++;
 		if (bitsNum == 8) {
@@ -220,6 +283,7 @@ void XferData(UINT8* data, UINT8 nBits, UINT8* response){
 			data++;
 		} 
 	}
+	ShiftPad(_drPost, 0, 1);
 //4. TMS Footer (10) ICSP_SetMode(0x01,2);//TMS Footer = 10 => 01 
 	io_clock_bit(1,0);
 	io_clock_bit(0,0);
@@ -230,20 +294,25 @@ void XferFastData(UINT8* data, UINT8* response, UINT8* prAcc){
 	UINT8 nBits = 32;
 	UINT8 tdoBits = 0;
 	UINT8 tdiBits = 0;
+	_stats.tckCycles += 6 + nBits + _drPost +
+		(_wireMode == WIRES_JTAG ? _drPre : 0);
 //1. TMS Header (100)  +Read.
 	io_clock_bit(1,0);
 	io_clock_bit(0,0);
 	if (_wireMode == WIRES_JTAG) {
 		io_clock_bit(0,0);
+		ShiftPad(_drPre, 0, 0);
 	} else {
 		*response = io_clock_bit(0,0);
 		tdoBits++;
 	}
 //2. oPrAcc bit.
 	*prAcc = io_clock_bit(0,0);
+	if (!*prAcc)
+		_stats.praccFailures++;
 //3. Send and Receive Data
 	while (nBits--){
-		*response |= io_clock_bit((!nBits)?1:0,*data)<<tdoBits;
+		*response |= io_clock_bit((!nBits && !_drPost)?1:0,*data)<<tdoBits;
 		tdoBits++;
 		if (tdoBits == 8) {
 			tdoBits = 0;
@@ -256,6 +325,7 @@ void XferFastData(UINT8* data, UINT8* response, UINT8* prAcc){
 			data++;
 		} 
 	}
+	ShiftPad(_drPost, 0, 1);
 //4. TMS Footer (10) ICSP_SetMode(0x01,2);//TMS Footer = 10 => 01 
 	io_clock_bit(1,0);
 	io_clock_bit(0,0);
@@ -349,8 +419,10 @@ BYTE WaitETAP_Ready(UINT8 retryCounts){
 		XferData((UINT8*)&instrCode,32,(UINT8*)&readVal);
 		if (readVal & PIC32_ECONTROL_PRACC)
 			return 1;
+		_stats.etapRetries++;
 		DelayUs(1);
 	} while (retryCounts--);
+	_stats.etapTimeouts++;
 	return 0;
 }
 void DelayUs( int us ) {
@@ -393,4 +465,45 @@ void GetPEResponse(UINT8* response){
 	XferData((UINT8*)0,32,response);
 	SendCommand(ETAP_CONTROL);
 	XferData((UINT8*)&instrCode,32,(UINT8*)&_dummyRead);
-}
\ No newline at end of file
+}
+/* RawShift(flags, nBits, vec, tdo)
+ Clock nBits TMS/TDI pairs from packed vectors, LSB first:
+ n bytes of TMS, n bytes of TDI, then n bytes of capture mask
+ when RAW_MASK is set (n = (nBits+7)/8).
+ TDO of the captured bits is packed LSB first into tdo, which must be cleared.
+ Returns the number of captured bits.
+*/
+UINT8 RawShift(UINT8 flags, UINT8 nBits, UINT8* vec, UINT8* tdo){
+	UINT8 nBytes = (nBits + 7) >> 3;
+	UINT8* tms = vec;
+	UINT8* tdi = vec + nBytes;
+	UINT8* mask = tdi + nBytes;
+	UINT8 bit = 1;
+	UINT8 tdoBit = 1;
+	UINT8 nCaptured = 0;
+	UINT8 capture;
+	UINT8 value;
+	_stats.tckCycles += nBits;
+	while (nBits--){
+		value = io_clock_bit((*tms & bit) ? 1 : 0, (*tdi & bit) ? 1 : 0);
+		capture = (flags & RAW_MASK) ? (*mask & bit) : (flags & RAW_CAPTURE);
+		if (capture) {
+			if (value)
+				*tdo |= tdoBit;
+			nCaptured++;
+			tdoBit <<= 1;
+			if (tdoBit == 0) {
+				tdoBit = 1;
+				tdo++;
+			}
+		}
+		bit <<= 1;
+		if (bit == 0) {
+			bit = 1;
+			tms++;
+			tdi++;
+			mask++;
+		}
+	}
+	return nCaptured;
+}
@@ -60,12 +60,21 @@
 #define PE_GET_DEVICEID         0xA     /* Return the hardware ID of device */
 #define PE_CHANGE_CFG           0xB     /* Change PE settings */
 
+/*
+ * Raw TMS/TDI vectors, command 0xAA.
+ */
+#define RAW_CAPTURE		0x01	/* Return TDO of every bit */
+#define RAW_MASK		0x02	/* Return TDO of the bits set in the mask vector */
+#define RAW_MAX_BITS	240		/* Two vectors in 61 bytes */
+#define RAW_MAX_MASKED	160		/* Three vectors in 61 bytes */
+
 #include <GenericTypeDefs.h>
 UINT8 GetWiresMode(void);
 void SetWiresMode(UINT8 wiresMode);
 void SetupIOPorts(UINT8 setUnset);
 void EnterPgmMode(void);
 void ExitPgmMode(void);
+void Attach(UINT8 wiresMode, UINT8* reply);
 UINT8 io_clock_bit(UINT8 tms,UINT8 tdi); 
 //prototypes jtag...
 void SetMode(UINT8 mode, UINT8 nBits);
@@ -80,4 +89,7 @@ UINT8 SerialExecutionMode(UINT8 mx);
 UINT32_VAL ReadFromAddress(UINT32 address);
 void DelayUs( int us );
 void GetPEResponse(UINT8* response);
+UINT8 RawShift(UINT8 flags, UINT8 nBits, UINT8* vec, UINT8* tdo);
+void SetTckDelay(UINT8 delay);
+void SetChain(UINT8 irPre, UINT8 irPost, UINT8 drPre, UINT8 drPost);
 #endif
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include "HardwareProfile.h"
+#include "pic32prog.h"
+#include "script.h"
+#if defined(__18F14K50)
+	#include <p18f14k50.h>
+#elif defined(__18F2550)
+	#include <p18f2550.h>
+#endif
+#pragma udata
+static BYTE _scriptBuffer[SCRIPT_BUFFER_SIZE];
+static UINT8 _scriptStart[SCRIPT_MAX_SLOTS];
+static UINT8 _scriptLength[SCRIPT_MAX_SLOTS];
+static UINT8 _scriptUsed = 0;
+
+/* Literal operand (4 bytes, LSB first) stored in the script buffer.
+*/
+static void GetLiteral(UINT8 index, UINT32_VAL* value){
+	value->v[0] = _scriptBuffer[index];
+	value->v[1] = _scriptBuffer[index+1];
+	value->v[2] = _scriptBuffer[index+2];
+	value->v[3] = _scriptBuffer[index+3];
+}
+/* Buffer operand (size bytes, LSB first) taken from the RunScript parameters.
+	Return : 1 if ok / 0 if the parameters are exhausted
+*/
+static UINT8 GetParam(BYTE* params, UINT8* index, UINT8 size, UINT32_VAL* value){
+	UINT8 i;
+	value->Val = 0;
+	if (*index + size > SCRIPT_PARAM_SIZE)
+		return 0;
+	for (i = 0; i < size; i++){
+		value->v[i] = params[*index];
+		(*index)++;
+	}
+	return 1;
+}
+/* Remove all the scripts.
+*/
+void ClearScripts(void){
+	UINT8 i;
+	for (i = 0; i < SCRIPT_MAX_SLOTS; i++){
+		_scriptLength[i] = 0;
+	}
+	_scriptUsed = 0;
+}
+/* Store a script in the script buffer.
+   Scripts are appended: to replace one the host clears the buffer
+   and downloads all of them again.
+	Return : 1 if stored / 0 if no space left or bad slot
+*/
+UINT8 DownloadScript(UINT8 slot, UINT8 length, BYTE* script){
+	UINT8 i;
+	if (slot >= SCRIPT_MAX_SLOTS || length == 0)
+		return 0;
+	if (length > SCRIPT_BUFFER_SIZE - _scriptUsed)
+		return 0;
+	_scriptStart[slot] = _scriptUsed;
+	_scriptLength[slot] = length;
+	for (i = 0; i < length; i++){
+		_scriptBuffer[_scriptUsed++] = script[i];
+	}
+	return 1;
+}
+/* Execute a script iterations times, the parameters are consumed
+   sequentially across the iterations (ex: PE loader words).
+   Captured results are appended to result, resultLength bytes.
+	Return : 1 if ok / 0 if FAIL (ETAP not ready, PrAcc missing, bad script)
+*/
+UINT8 RunScript(UINT8 slot, UINT8 iterations, BYTE* params, BYTE* result, BYTE* resultLength){
+	UINT8 start, end, pc, op;
+	UINT8 paramIndex = 0;
+	UINT8 loopCount = 0;
+	UINT8 looping = 0;
+	UINT32_VAL value;
+	UINT32_VAL response;
+	BYTE prAcc;
+
+	*resultLength = 0;
+	if (slot >= SCRIPT_MAX_SLOTS || _scriptLength[slot] == 0)
+		return 0;
+	start = _scriptStart[slot];
+	end = start + _scriptLength[slot];
+	while (iterations--){
+		pc = start;
+		looping = 0;
+		while (pc < end){
+			op = _scriptBuffer[pc];
+			response.Val = 0;
+			switch (op & ~SCR_CAPTURE){
+				case SCR_END:
+					pc = end;
+					break;
+				case SCR_SETMODE:
+					SetMode(_scriptBuffer[pc+1], _scriptBuffer[pc+2]);
+					pc += 3;
+					break;
+				case SCR_SENDCMD:
+					SendCommand(_scriptBuffer[pc+1], _scriptBuffer[pc+2]);
+					pc += 3;
+					break;
+				case SCR_XFERDATA:
+					GetLiteral(pc+2, &value);
+					XferData(&value.v[0], _scriptBuffer[pc+1], &response.v[0]);
+					pc += 6;
+					break;
+				case SCR_XFERINST:
+					GetLiteral(pc+1, &value);
+					if (!XferInstruction(value.Val))
+						return 0;
+					pc += 5;
+					break;
+				case SCR_XFERINST_HI:
+					if (!GetParam(params, &paramIndex, 2, &value))
+						return 0;
+					value.v[2] = _scriptBuffer[pc+1];
+					value.v[3] = _scriptBuffer[pc+2];
+					if (!XferInstruction(value.Val))
+						return 0;
+					pc += 3;
+					break;
+				case SCR_XFERINST_BUF:
+					if (!GetParam(params, &paramIndex, 4, &value))
+						return 0;
+					if (!XferInstruction(value.Val))
+						return 0;
+					pc += 1;
+					break;
+				case SCR_XFRFASTDAT:
+					GetLiteral(pc+1, &value);
+					XferFastData(&value.v[0], &response.v[0], &prAcc);
+					if ((op & SCR_CAPTURE) && !prAcc)
+						return 0;
+					pc += 5;
+					break;
+				case SCR_XFRFASTDAT_BUF:
+					if (!GetParam(params, &paramIndex, 4, &value))
+						return 0;
+					XferFastData(&value.v[0], &response.v[0], &prAcc);
+					if ((op & SCR_CAPTURE) && !prAcc)
+						return 0;
+					pc += 1;
+					break;
+				case SCR_GETPERESP:
+					GetPEResponse(&response.v[0]);
+					pc += 1;
+					break;
+				case SCR_LOOP:
+					if (!looping){
+						loopCount = _scriptBuffer[pc+2];
+						looping = 1;
+					}
+					if (loopCount){
+						loopCount--;
+						if (_scriptBuffer[pc+1] > pc - start)
+							return 0;
+						pc -= _scriptBuffer[pc+1];
+					} else {
+						looping = 0;
+						pc += 3;
+					}
+					break;
+				case SCR_DELAY_US:
+					DelayUs(_scriptBuffer[pc+1]);
+					pc += 2;
+					break;
+				default:
+					return 0;
+			}
+			if (op & SCR_CAPTURE){
+				if (*resultLength > SCRIPT_RESULT_SIZE - 4)
+					return 0;
+				result[(*resultLength)++] = response.v[0];
+				result[(*resultLength)++] = response.v[1];
+				result[(*resultLength)++] = response.v[2];
+				result[(*resultLength)++] = response.v[3];
+			}
+		}
+	}
+	return 1;
+}
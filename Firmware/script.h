@@ -0,0 +1,34 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+/*
+ * Script engine: sequences of pseudo operations downloaded by the host
+ * once per session and executed later with a single USB report.
+ *
+ * Script format: <opcode> [operands...], opcode bit 7 (SCR_CAPTURE) copies
+ * the 32 bit result of the operation in the reply buffer.
+ * Operands marked "buf" are taken from the parameters of the RunScript report.
+ */
+#define SCR_END				0x00	/* end of script									*/
+#define SCR_SETMODE			0x01	/* mode, nbits										*/
+#define SCR_SENDCMD			0x02	/* cmd, nbits										*/
+#define SCR_XFERDATA		0x03	/* nbits, d0, d1, d2, d3							*/
+#define SCR_XFERINST		0x04	/* i0, i1, i2, i3									*/
+#define SCR_XFERINST_HI		0x05	/* op_lo, op_hi : instruction = op << 16 | buf16	*/
+#define SCR_XFERINST_BUF	0x06	/* instruction = buf32								*/
+#define SCR_XFRFASTDAT		0x07	/* d0, d1, d2, d3									*/
+#define SCR_XFRFASTDAT_BUF	0x08	/* data = buf32										*/
+#define SCR_GETPERESP		0x09	/* get PE response									*/
+#define SCR_LOOP			0x0A	/* back, count : jump back <back> bytes count times	*/
+#define SCR_DELAY_US		0x0B	/* us												*/
+#define SCR_CAPTURE			0x80
+
+#define SCRIPT_BUFFER_SIZE	96
+#define SCRIPT_MAX_SLOTS	6
+#define SCRIPT_PARAM_SIZE	60
+#define SCRIPT_RESULT_SIZE	60
+
+#include <GenericTypeDefs.h>
+void ClearScripts(void);
+UINT8 DownloadScript(UINT8 slot, UINT8 length, BYTE* script);
+UINT8 RunScript(UINT8 slot, UINT8 iterations, BYTE* params, BYTE* result, BYTE* resultLength);
+#endif
@@ -0,0 +1,81 @@
+#include "HardwareProfile.h"
+#include "stats.h"
+#if defined(__18F14K50)
+	#include <p18f14k50.h>
+#elif defined(__18F2550)
+	#include <p18f2550.h>
+#endif
+#pragma udata
+STATS _stats;
+static UINT16 _opcodeCount[STATS_OPCODES];
+static UINT16 _lastMark;
+
+/* Opcodes with their own counter, the first one counts the others.
+*/
+static const rom UINT8 _opcodes[STATS_OPCODES] = {
+	0x00, 0x78, 0x7A, 0x81, 0x82, 0x83, 0x85, 0x86, 0x87,
+	0x88, 0x99, 0xDD, 0xA0, 0xCC, 0xC0, 0x42, 0xAA
+};
+
+static void StatsClear(void){
+	UINT8 i;
+	BYTE* p = (BYTE*)&_stats;
+	for (i = 0; i < sizeof(_stats); i++)
+		*p++ = 0;
+	for (i = 0; i < STATS_OPCODES; i++)
+		_opcodeCount[i] = 0;
+}
+/* Timer0: 16 bit, 1:256 prescaler on the instruction clock.
+*/
+void StatsInit(void){
+	StatsClear();
+	T0CON = 0b10000111;
+	_lastMark = 0;
+}
+/* Add the time since the last mark to the busy or idle time.
+   Called often enough for the 16 bit timer not to wrap in between.
+*/
+void StatsMark(UINT8 busy){
+	UINT16_VAL now;
+	now.v[0] = TMR0L;		/* TMR0H is latched when TMR0L is read */
+	now.v[1] = TMR0H;
+	if (busy)
+		_stats.busyTicks += (UINT16)(now.Val - _lastMark);
+	else
+		_stats.idleTicks += (UINT16)(now.Val - _lastMark);
+	_lastMark = now.Val;
+}
+void StatsCommand(UINT8 opcode){
+	UINT8 i;
+	_stats.reportsIn++;
+	for (i = 1; i < STATS_OPCODES; i++){
+		if (_opcodes[i] == opcode)
+			break;
+	}
+	if (i == STATS_OPCODES)
+		i = 0;
+	_opcodeCount[i]++;
+}
+/* Copy a page of counters in result, and clear all of them when reset is set.
+	Return : number of bytes / 0 if no such page
+*/
+UINT8 StatsRead(UINT8 page, UINT8 reset, BYTE* result){
+	UINT8 i, n = 0;
+	BYTE* p = (BYTE*)&_stats;
+	if (page == STATS_PAGE_TOTALS){
+		for (n = 0; n < STATS_TOTALS_SIZE; n++)
+			result[n] = *p++;
+	} else if (page == STATS_PAGE_OPCODES){
+		result[n++] = STATS_OPCODES;
+		for (i = 0; i < STATS_OPCODES; i++){
+			result[n++] = _opcodes[i];
+			result[n++] = _opcodeCount[i];
+			result[n++] = _opcodeCount[i] >> 8;
+		}
+	} else {
+		return 0;
+	}
+	if (reset)
+		StatsClear();
+	return n;
+}
@@ -0,0 +1,40 @@
+#ifndef STATS_H
+#define STATS_H
+/*
+ * Performance counters, read and reset by the host with command 0xAC.
+ *
+ * Page 0 (STATS_PAGE_TOTALS), LSB first:
+ *   0  TCK cycles clocked (32 bit)
+ *   4  busy time, Timer0 ticks of 256 instruction cycles (32 bit)
+ *   8  idle time, same ticks (32 bit)
+ *  12  WaitETAP_Ready retries
+ *  14  WaitETAP_Ready timeouts
+ *  16  PrAcc failures of XferFastData
+ *  18  USB reports received
+ *  20  USB reports sent
+ * Page 1 (STATS_PAGE_OPCODES): count, then (opcode, 16 bit counter)
+ * for every counted opcode; opcode 0 stands for all the others.
+ */
+#define STATS_PAGE_TOTALS	0
+#define STATS_PAGE_OPCODES	1
+#define STATS_TOTALS_SIZE	22
+#define STATS_OPCODES		17
+
+#include <GenericTypeDefs.h>
+typedef struct {
+	UINT32 tckCycles;
+	UINT32 busyTicks;
+	UINT32 idleTicks;
+	UINT16 etapRetries;
+	UINT16 etapTimeouts;
+	UINT16 praccFailures;
+	UINT16 reportsIn;
+	UINT16 reportsOut;
+} STATS;
+extern STATS _stats;
+
+void StatsInit(void);
+void StatsMark(UINT8 busy);
+void StatsCommand(UINT8 opcode);
+UINT8 StatsRead(UINT8 page, UINT8 reset, BYTE* result);
+#endif
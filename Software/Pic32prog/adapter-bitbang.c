@@ -18,18 +18,38 @@
 #include "adapter.h"
 #include "pic32.h"
 #include "serial.h"
+#include "bitbang-codec.h"
 
 
+/*
+ * Reply expected from the adapter: a TDO read, or '<' for a handshake.
+ */
+typedef struct {
+    int handshake;                  // '<' expected
+    unsigned offset;                // bytes written up to the '>'
+    int npairs;                     // pairs of the read
+    unsigned char pairs [BB_MAX_PAIRS];
+    unsigned long long value;       // TDO bits, once received
+} bitbang_reply_t;
+
+#define REPLY_QUEUE     256         // replies in flight
+
 typedef struct {
     adapter_t adapter;              /* Common part */
 
-    int BitsToRead;                 // number of 'bits' waiting in Rx buffer
-    int PendingHandshake;           // indicates a return handshake is expected
+    unsigned char OutBuf [1024];    // writes not sent yet
+    unsigned OutLen;
+    unsigned Sent;                  // total bytes written
+    unsigned Acked;                 // bytes consumed by the adapter, by handshake
+    unsigned LastMark;              // position of the last '>'
+    bitbang_reply_t Reply [REPLY_QUEUE];
+    unsigned ReplyHead;             // oldest reply not consumed
+    unsigned ReplyRead;             // next reply to receive from the adapter
+    unsigned ReplyTail;             // next free slot
 
     unsigned TotalBitPairsSent;     // count of total # of TDI and TMS pairs sent
     unsigned TotalBitsReceived;     // count of total # of TDO bits recieved
-    unsigned MaxBufferedWrites;     // max continuous characters written before read
-    unsigned RunningWriteCount;     // running count of characters written, reset by read
+    unsigned MaxBufferedWrites;     // max characters written in one batch
     unsigned WriteCount;            // number of calls to serial_write
     unsigned Read1Count;            // number of calls to serial_read (data)
     unsigned Read2Count;            // number of calls to serial_read (handshakes)
@@ -37,6 +57,10 @@ typedef struct {
     unsigned DelayCount[4];         // number of calls to delay10mS (erase, xfer inst, PE resp, other)
     struct timeval T1, T2;          // record start and finishing timestamps
 
+    int Packed;                     // packed binary protocol negotiated
+    unsigned WireBytes;             // bytes written to the adapter
+    unsigned AsciiBytes;            // bytes the same writes take in ASCII mode
+
     unsigned use_executive;
     unsigned serial_execution_mode;
 } bitbang_adapter_t;
@@ -69,6 +93,158 @@ static unsigned calculate_crc (unsigned crc, unsigned char *data, unsigned nbyte
     return crc & 0xffff;
 }
 
+/*
+ * Size of the receive buffer in the programming adapter.
+ */
+static unsigned bitbang_window ()
+{
+    return (CFG1 == 1) ? 64 : 1024;
+}
+
+/*
+ * Write the accumulated batch to the serial port.
+ */
+static void bitbang_flush (bitbang_adapter_t *a)
+{
+    unsigned i;
+    int n;
+
+    for (i = 0; i < a->OutLen; i += n) {
+        n = serial_write (a->OutBuf + i, a->OutLen - i);
+        if (n <= 0) {
+            fprintf (stderr, "serial write error (in flush)\n");
+            exit (-1);
+        }
+        a->WriteCount++;
+    }
+    if (a->OutLen > a->MaxBufferedWrites)
+        a->MaxBufferedWrites = a->OutLen;
+    a->Sent += a->OutLen;
+    a->OutLen = 0;
+}
+
+/*
+ * Read exactly len bytes, or less on timeout.
+ */
+static int bitbang_read (unsigned char *data, int len)
+{
+    int got = 0, n;
+
+    while (got < len) {
+        n = serial_read (data + got, len - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/*
+ * Add an expected reply to the queue.
+ */
+static bitbang_reply_t *bitbang_expect (bitbang_adapter_t *a);
+
+/*
+ * Receive the next reply from the adapter, in the order of requests.
+ */
+static void bitbang_receive (bitbang_adapter_t *a)
+{
+    bitbang_reply_t *r = &a->Reply [a->ReplyRead % REPLY_QUEUE];
+    unsigned char buffer [BB_MAX_PAIRS];
+    int n, nbytes;
+
+    /* The request must be on the wire. */
+    bitbang_flush (a);
+
+    if (r->handshake) {
+        n = bitbang_read (buffer, 1);
+        a->Read2Count++;
+        if (n != 1 || buffer[0] != '<')
+            fprintf (stderr, "WARNING - handshake read error (in receive)\n");
+        a->Acked = r->offset;
+    } else {
+        nbytes = bb_reply_bytes (r->pairs, r->npairs, a->Packed);
+        n = bitbang_read (buffer, nbytes);
+        a->Read1Count++;
+        if (n != nbytes)
+            fprintf (stderr,
+                "WARNING - fewer bytes read (%i) than expected (%i) (in receive)\n",
+                                             n,          nbytes);
+        n = bb_decode_reply (r->pairs, r->npairs, a->Packed, buffer, &r->value);
+        if (n < 0)
+            fprintf (stderr, "WARNING - unexpected character returned (in receive)\n");
+        else
+            a->TotalBitsReceived += n;
+    }
+    a->ReplyRead++;
+}
+
+static bitbang_reply_t *bitbang_expect (bitbang_adapter_t *a)
+{
+    bitbang_reply_t *r;
+
+    while (a->ReplyTail - a->ReplyHead >= REPLY_QUEUE) {
+        /* Queue full: drop the handshakes already received. */
+        if (a->ReplyHead == a->ReplyRead)
+            bitbang_receive (a);
+        else if (a->Reply [a->ReplyHead % REPLY_QUEUE].handshake)
+            a->ReplyHead++;
+        else {
+            fprintf (stderr, "too many deferred reads\n");
+            exit (-1);
+        }
+    }
+    r = &a->Reply [a->ReplyTail++ % REPLY_QUEUE];
+    r->handshake = 0;
+    r->npairs = 0;
+    return r;
+}
+
+/*
+ * Append a handshake request: the adapter answers '<'
+ * when it has consumed everything before it.
+ */
+static void bitbang_mark (bitbang_adapter_t *a)
+{
+    bitbang_reply_t *r = bitbang_expect (a);
+
+    a->OutBuf [a->OutLen++] = '>';
+    a->WireBytes++;
+    a->AsciiBytes++;
+    a->LastMark = a->Sent + a->OutLen;
+    r->handshake = 1;
+    r->offset = a->LastMark;
+}
+
+/*
+ * Queue bytes for the adapter. Writes are collected into batches
+ * as large as the adapter buffer, and the bytes in flight are kept
+ * within the buffer by handshakes every half of it.
+ */
+static void bitbang_put (bitbang_adapter_t *a, const unsigned char *data, unsigned nbytes)
+{
+    unsigned window = bitbang_window ();
+
+    if (a->OutLen + nbytes + 1 > window)
+        bitbang_flush (a);
+
+    /* Wait until the adapter has room for the data. */
+    while (a->Sent + a->OutLen + nbytes + 1 - a->Acked > window) {
+        if (a->LastMark <= a->Acked) {
+            /* No handshake in flight: ask for one. */
+            bitbang_mark (a);
+        }
+        bitbang_receive (a);
+    }
+    memcpy (a->OutBuf + a->OutLen, data, nbytes);
+    a->OutLen += nbytes;
+    a->WireBytes += nbytes;
+
+    if (a->Sent + a->OutLen - a->LastMark >= window / 2 &&
+        a->OutLen < sizeof (a->OutBuf))
+        bitbang_mark (a);
+}
+
 /*
  * Sends a command ('8')to the programmer telling it to insert
  * a 10mS delay in the datastream being sent to the target. This
@@ -80,8 +256,8 @@ static void bitbang_delay10mS (bitbang_adapter_t *a, int caller)
     unsigned char ch;
 
     ch = '8';
-    serial_write (&ch, 1);
-    a->WriteCount++;
+    bitbang_put (a, &ch, 1);
+    a->AsciiBytes++;
     a->DelayCount[caller]++;
 }
 
@@ -122,6 +298,10 @@ static void bitbang_delay10mS (bitbang_adapter_t *a, int caller)
  * if the request is 'D'..'G', then respond with '0'/'1' to indicate TDO = 0/1
  *
  * (by RR)
+ *
+ * When the adapter answers '!' to the '!' command, the pairs are sent
+ * packed four per byte instead, and TDO comes back eight bits per byte,
+ * see bitbang-codec.h. All other commands stay the same.
  */
 static void bitbang_send (bitbang_adapter_t *a,
     unsigned tms_nbits, unsigned tms,
@@ -144,166 +324,117 @@ static void bitbang_send (bitbang_adapter_t *a,
     unsigned char buffer[110];  // @@@@@@@@@@ BUFFERED WRITES VERSION @@@@@@@@@@
     int index = 0;              // index of next slot to use in buffer
     int count = 0;              // count of number of TDI/TMS pairs
-    int i, n;
+    int ascii_bytes;            // length of the same pairs in ASCII mode
+    int i;
     unsigned char ch;
 
-    if (read_flag && (a->BitsToRead != 0))
-        fprintf (stderr, "WARNING - double read request (in send)\n");
     if (read_flag && (tdi_nbits == 0))
         fprintf (stderr, "WARNING - request to read 0 bits (in send)\n");
 
-    for (i = tms_nbits; i > 0; i--) {           // for each of the n bits...
-        ch = (tms & 1) + 'd';                   // d, e, f, g
-        buffer [index++] = ch;                  // append to buffer
-        tms >>= 1;                              // shift TMS right one bit
-    }
-    count += tms_nbits;
-
-    if (DBG1 && (tms_nbits != 0))
-        buffer[index++] = '.';                  // spacer, ignored by programmer
-
-    if (tdi_nbits != 0) {                       // 1-0-0 if nTDI <> 0
-        ch = 1 + 'd';
-        buffer[index++] = ch;
-        ch = 0 + 'd';
-        buffer[index++] = ch;
-        ch = 0 + (read_flag ? 'D' : 'd');
-        buffer[index++] = ch;
-        count += 3;
-        if (DBG1)
-            buffer[index++] = '.';              // spacer, ignored by programmer
-    }
+    if (read_flag) {
+        /* The reply is collected later, by bitbang_recv(). */
+        bitbang_reply_t *r = bitbang_expect (a);
 
-    for (i = tdi_nbits; i > 0; i--) {
-        ch = ((tdi & 1) << 1) + (i == 1) +      // TMS=0 for n-1 bits, then 1 on last bit
-             ((read_flag == 1 && i != 1) ?      // 0 = no read, 1 = normal read, 2 = oPrAcc read
-              'D' : 'd');                       // UC = read, LC = none, no read on last bit
-        buffer[index++] = ch;                   // append to buffer
-        tdi >>= 1;                              // shift TDI right one bit
-    }
-    count += tdi_nbits;
-
-    if (tdi_nbits != 0) {                       // 1-0 if nTDI <> 0
-        if (DBG1)
-            buffer[index++] = '.';              // spacer, ignored by programmer
-        ch = 1 + 'd';
-        buffer[index++] = ch;
-        ch = 0 + 'd';
-        buffer[index++] = ch;
-        count += 2;
-    }
-
-    //
-    // Control handshaking for ICSP programmers
-    //
-
-    if (a->PendingHandshake)
-    {
-        //////// this code is also duplicated in bitbang_send ////////
-        if (a->RunningWriteCount > a->MaxBufferedWrites)
-            a->MaxBufferedWrites = a->RunningWriteCount;
-        a->RunningWriteCount = 0;
-        //////////////////////////////////////////////////////////////
-
-        a->PendingHandshake = 0;
-
-        n = serial_read (&ch, 1);
-        a->Read2Count++;
-
-        if (n != 1 || ch != '<')
-            fprintf (stderr, "WARNING - handshake read error (in send)\n");
-    }
-
-    //
-    // the below block is to implement handshake on
-    // EVERY write that does not have (read_flag != 0)
-    //
-    if (CFG1 == 1 && !read_flag)
-    {
-        buffer[index++] = '>';
-        a->PendingHandshake = 1;
+        r->npairs = bb_pairs (r->pairs, tms_nbits, tms, tdi_nbits, tdi, read_flag);
     }
 
-    //
-    // this block is to implement handshake on every 900 bytes sent out
-    // NOTE: assumes the Rx buffer in the programmer is 1024 bytes long
-    //                                                  **********
+    if (a->Packed) {
+        unsigned char pairs [BB_MAX_PAIRS];
+
+        count = bb_pairs (pairs, tms_nbits, tms, tdi_nbits, tdi, read_flag);
+        index = bb_encode (pairs, count, buffer);
+        ascii_bytes = count;
+    } else {
+        for (i = tms_nbits; i > 0; i--) {           // for each of the n bits...
+            ch = (tms & 1) + 'd';                   // d, e, f, g
+            buffer [index++] = ch;                  // append to buffer
+            tms >>= 1;                              // shift TMS right one bit
+        }
+        count += tms_nbits;
+
+        if (DBG1 && (tms_nbits != 0))
+            buffer[index++] = '.';                  // spacer, ignored by programmer
+
+        if (tdi_nbits != 0) {                       // 1-0-0 if nTDI <> 0
+            ch = 1 + 'd';
+            buffer[index++] = ch;
+            ch = 0 + 'd';
+            buffer[index++] = ch;
+            ch = 0 + (read_flag ? 'D' : 'd');
+            buffer[index++] = ch;
+            count += 3;
+            if (DBG1)
+                buffer[index++] = '.';              // spacer, ignored by programmer
+        }
 
-    if (CFG1 == 2 && !read_flag && (a->RunningWriteCount + index) > 900)    // 900 + 50 < 1024
-    {
-        buffer[index++] = '>';
-        a->PendingHandshake = 1;
+        for (i = tdi_nbits; i > 0; i--) {
+            ch = ((tdi & 1) << 1) + (i == 1) +      // TMS=0 for n-1 bits, then 1 on last bit
+                 ((read_flag == 1 && i != 1) ?      // 0 = no read, 1 = normal read, 2 = oPrAcc read
+                  'D' : 'd');                       // UC = read, LC = none, no read on last bit
+            buffer[index++] = ch;                   // append to buffer
+            tdi >>= 1;                              // shift TDI right one bit
+        }
+        count += tdi_nbits;
+
+        if (tdi_nbits != 0) {                       // 1-0 if nTDI <> 0
+            if (DBG1)
+                buffer[index++] = '.';              // spacer, ignored by programmer
+            ch = 1 + 'd';
+            buffer[index++] = ch;
+            ch = 0 + 'd';
+            buffer[index++] = ch;
+            count += 2;
+        }
+        ascii_bytes = index;
     }
 
-    //
-    // end of handshaking code
-    //
-
     buffer[index] = 0;          // append trailing zero so can print as a string
-    if (DBG1)
+    if (DBG1 && ! a->Packed)
         fprintf (stderr, "n=%i, <%s> read=%i\n", index, buffer, read_flag);
 
     a->TotalBitPairsSent += count;
-    a->RunningWriteCount += index;
+    a->AsciiBytes += ascii_bytes;
 
-    if (a->BitsToRead != 0)
-        fprintf (stderr, "WARNING - write while pending read (in send)\n");
-
-    serial_write (buffer, index);
-    a->WriteCount++;
-
-    if (read_flag)
-        a->BitsToRead += tdi_nbits;
+    //
+    // Handshaking is done by bitbang_put(), for the whole batch.
+    //
+    bitbang_put (a, buffer, index);
 }
 
 /*
+ * Get the TDO bits of the oldest read. Reads are deferred:
+ * the batch is sent and the replies collected only here.
  * (by RR)
  */
 static unsigned long long bitbang_recv (bitbang_adapter_t *a)
 {
-    unsigned char buffer[70];
+    bitbang_reply_t *r;
     unsigned long long word;
-    int n, i;
-
-    //////// this code is also duplicated in bitbang_send ////////
-    if (a->RunningWriteCount > a->MaxBufferedWrites)
-        a->MaxBufferedWrites = a->RunningWriteCount;
-    a->RunningWriteCount = 0;
-    //////////////////////////////////////////////////////////////
-
-    if (a->PendingHandshake)
-        fprintf (stderr, "WARNING - handshake pending error (in recv)\n");
-
-    n = serial_read (buffer, a->BitsToRead);
-    a->Read1Count++;
-
-    if (n != a->BitsToRead)
-        fprintf (stderr,
-            "WARNING - fewer bits read (%i) than expected (%i) (in recv)\n",
-                                        n,          a->BitsToRead);
 
-    word = 0;
-
-    for (i = 0; i < n; i++) {
-        if (buffer[i] == '1')
-            word |= 1 << i;
-        else if (buffer[i] != '0')
-            fprintf (stderr,
-                "WARNING - unexpected character (0x%02x) returned (in recv)\n",
-                                               buffer[i]);
+    for (;;) {
+        /* Skip the handshakes already received. */
+        while (a->ReplyHead != a->ReplyRead &&
+               a->Reply [a->ReplyHead % REPLY_QUEUE].handshake)
+            a->ReplyHead++;
+        if (a->ReplyHead != a->ReplyRead)
+            break;
+        if (a->ReplyRead == a->ReplyTail) {
+            fprintf (stderr, "WARNING - no pending read (in recv)\n");
+            return 0;
+        }
+        bitbang_receive (a);
     }
+    r = &a->Reply [a->ReplyHead++ % REPLY_QUEUE];
+    word = r->value;
 
     if (DBG1) {
         unsigned L4 = word >> 48;
         unsigned L3 = (word >> 32) & 0xFFFF;
         unsigned L2 = (word >> 16) & 0xFFFF;
         unsigned L1 = word & 0xFFFF;
-        fprintf (stderr, "TDO = %04x %04x %04x %04x (%i bits)\n",
-                                 L4,  L3,  L2,  L1, a->BitsToRead);
+        fprintf (stderr, "TDO = %04x %04x %04x %04x\n",
+                                 L4,  L3,  L2,  L1);
     }
-
-    a->TotalBitsReceived += a->BitsToRead;
-    a->BitsToRead = 0;
     return word;
 }
 
@@ -322,6 +453,7 @@ static void bitbang_ICSP_enable (bitbang_adapter_t *a, int ICSP_EN)
                                  // 0000000001111111111222222222233333333334444444444555555555566666
                                  // 1234567890123456789012345678901234567890123456789012345678901234
 
+        bitbang_flush (a);
         serial_write (buffer, 64);
         usleep (150000);    // 150mS delay to allow the above to percolate through the system
     }
@@ -332,6 +464,7 @@ static void bitbang_ICSP_enable (bitbang_adapter_t *a, int ICSP_EN)
                                  // 0000000001111111
                                  // 1234567890123456
 
+        bitbang_flush (a);
         serial_write (buffer, 16);
 
         // 100mS delay to allow the above to percolate through the system
@@ -342,6 +475,7 @@ static void bitbang_ICSP_enable (bitbang_adapter_t *a, int ICSP_EN)
 static void bitbang_close (adapter_t *adapter, int power_on)
 {
     bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+    int i;
 
     usleep (100000);
 
@@ -361,7 +495,16 @@ static void bitbang_close (adapter_t *adapter, int power_on)
     printf ("\n");
     printf ("total TDI/TMS pairs sent = %i pairs\n", a->TotalBitPairsSent);
     printf ("total TDO bits received  = %i bits\n",  a->TotalBitsReceived);
-    printf ("maximum continuous write = %i chars\n", a->MaxBufferedWrites);
+    printf ("maximum batched write    = %i chars\n", a->MaxBufferedWrites);
+    printf ("serial bytes sent        = %u (%s mode), %u in ascii mode\n",
+        a->WireBytes, a->Packed ? "packed" : "ascii", a->AsciiBytes);
+    for (i = 0; i < 3; i++) {
+        static const unsigned baud[3] = { 115200, 500000, 1000000 };
+
+        printf ("pairs/second at %7u  = %u ascii, %u packed\n", baud[i],
+            bb_pair_rate (baud[i], a->TotalBitPairsSent, a->AsciiBytes),
+            bb_pair_rate (baud[i], a->TotalBitPairsSent, a->WireBytes));
+    }
 
     printf ("O/S serial writes        = %i\n", a->WriteCount);
     printf ("O/S serial reads (data)  = %i\n", a->Read1Count);
@@ -572,6 +715,37 @@ static unsigned get_pe_response (bitbang_adapter_t *a)
     return response;
 }
 
+/*
+ * Get a series of words from the PE. All the reads are queued
+ * before the first result is looked at, so the whole series
+ * goes out in one batch. PrAcc is checked afterwards: at the
+ * speed of the serial link the PE is always ready.
+ */
+static void get_pe_responses (bitbang_adapter_t *a, unsigned *data, unsigned nwords)
+{
+    unsigned i, ctl;
+
+    for (i = 0; i < nwords; i++) {
+        bitbang_send (a, 1, 1, 5, ETAP_CONTROL, 0);       /* Send command. */
+        bitbang_send (a, 0, 0, 32, CONTROL_PRACC |        /* Xfer data. */
+                                  CONTROL_PROBEN |
+                                CONTROL_PROBTRAP, 1);
+        bitbang_send (a, 1, 1, 5, ETAP_DATA, 0);          /* Send command. */
+        bitbang_send (a, 0, 0, 32, 0, 1);                 /* Get data. */
+        bitbang_send (a, 1, 1, 5, ETAP_CONTROL, 0);       /* Send command. */
+        bitbang_send (a, 0, 0, 32, CONTROL_PROBEN |       /* Send data. */
+                                 CONTROL_PROBTRAP, 0);
+    }
+    for (i = 0; i < nwords; i++) {
+        ctl = bitbang_recv (a);
+        data[i] = bitbang_recv (a);
+        if (! (ctl & CONTROL_PRACC)) {
+            fprintf (stderr, "PE response, PrAcc not set (in GetPEResponses)\n");
+            exit (-1);
+        }
+    }
+}
+
 /*
  * Read a word from memory (without PE).
  *
@@ -637,9 +811,8 @@ static void bitbang_read_data (adapter_t *adapter,
                                                 response,     PE_READ << 16);
             exit (-1);
         }
-        for (i = 0; i < 32; i++) {
-            *data++ = get_pe_response (a);          /* Get data */
-        }
+        get_pe_responses (a, data, 32);             /* Get data */
+        data += 32;
         addr += 32 * 4;
     }
 }
@@ -684,7 +857,7 @@ static void bitbang_load_executive (adapter_t *adapter,
     printf (" 4 (LDR)");
 
     /* Download the PE loader. */
-    int i;
+    unsigned i;
     for (i = 0; i < PIC32_PE_LOADER_LEN; i += 2) {
         /* Step 5. */
         unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
@@ -855,7 +1028,7 @@ static void bitbang_program_row (adapter_t *adapter, unsigned addr,
     //
 
     /* Download data. */
-    int i;
+    unsigned i;
     for (i = 0; i < words_per_row; i++) {
         xfer_fastdata (a, *data++);               /* Send word. */
     }
@@ -1116,17 +1289,37 @@ adapter_t *adapter_open_bitbang (const char *port, int baud_rate)
         return 0;
     }
 
+    //
+    // Ask for the packed protocol. Older firmware ignores
+    // the '!' and answers only the handshake.
+    //
+    buffer[0] = BB_NEGOTIATE;
+    buffer[1] = '>';
+    serial_write (buffer, 2);
+    n = serial_read (buffer, 2);
+    a->Packed = (n == 2 && buffer[0] == BB_NEGOTIATE && buffer[1] == '<');
+    if (n < 1 || buffer[n-1] != '<') {
+        fprintf (stderr, "\nNo handshake from 'ascii ICSP' adapter\n");
+        serial_close();
+        free (a);
+        return 0;
+    }
+    printf ("     Protocol: %s\n", a->Packed ? "packed" : "ascii");
+
     //
     // This is the end of 'ascii ICSP' ID probe
     //
 
-    a->BitsToRead = 0;
-    a->PendingHandshake = 0;               // handshake read req'd before next write
+    a->OutLen = 0;                         // nothing batched yet
+    a->Sent = a->Acked = a->LastMark = 0;
+    a->ReplyHead = a->ReplyRead = a->ReplyTail = 0;
 
     a->TotalBitPairsSent = 0;              // count of total # of TDI+TMS bits sent
     a->TotalBitsReceived = 0;              // count of total # of TDO bits recieved
-    a->MaxBufferedWrites = 0;              // maximum continuous write length (chars)
-    a->RunningWriteCount = 0;              // running count of writes, reset by read
+    a->MaxBufferedWrites = 0;              // maximum batch written at once (chars)
+
+    a->WireBytes = 0;
+    a->AsciiBytes = 0;
 
     a->WriteCount = 0;
     a->Read1Count = 0;
@@ -36,6 +36,9 @@ typedef struct {
     unsigned use_executive;
     unsigned serial_execution_mode;
 
+    unsigned char out [64];             /* Report being assembled */
+    unsigned outlen;
+
 } pickit_adapter_t;
 
 /*
@@ -63,6 +66,15 @@ typedef struct {
 #define IFACE                   0
 #define TIMO_MSEC               1000
 
+/*
+ * Slots of the adapter script buffer, filled once
+ * per session by pickit_download_scripts().
+ */
+#define SLOT_PE_READ            0       /* Read 32 words, address from buffer */
+#define SLOT_ROW_START          1       /* Row program command and address */
+#define SLOT_ROW_DATA           2       /* Send 32 words of row data */
+#define SLOT_PE_RESP            3       /* Get response of PE */
+
 static void pickit_send_buf (pickit_adapter_t *a, unsigned char *buf, unsigned nbytes)
 {
     if (debug_level > 1) {
@@ -92,6 +104,69 @@ static void pickit_send (pickit_adapter_t *a, unsigned argc, ...)
     pickit_send_buf (a, buf, i);
 }
 
+/*
+ * Send the report being assembled, padded with END_OF_BUFFER.
+ */
+static void pickit_flush (pickit_adapter_t *a)
+{
+    if (a->outlen == 0)
+        return;
+    memset (a->out + a->outlen, CMD_END_OF_BUFFER, 64 - a->outlen);
+    pickit_send_buf (a, a->out, a->outlen);
+    a->outlen = 0;
+}
+
+/*
+ * Append a command group to the report being assembled.
+ * The groups are executed by the adapter in order, so that
+ * several of them can share one report.
+ */
+static void pickit_queue (pickit_adapter_t *a,
+    const unsigned char *cmd, unsigned nbytes)
+{
+    if (a->outlen + nbytes > 64)
+        pickit_flush (a);
+    memcpy (a->out + a->outlen, cmd, nbytes);
+    a->outlen += nbytes;
+}
+
+/*
+ * Append bytes for the download buffer, filling every report
+ * to the end. The bytes are split over as many DOWNLOAD_DATA
+ * commands as needed; the caller must not exceed the 256 bytes
+ * of the buffer between two script runs.
+ */
+static void pickit_queue_data (pickit_adapter_t *a,
+    const unsigned char *data, unsigned nbytes)
+{
+    unsigned n;
+
+    while (nbytes > 0) {
+        if (a->outlen + 3 > 64)
+            pickit_flush (a);
+        n = 64 - 2 - a->outlen;
+        if (n > nbytes)
+            n = nbytes;
+        a->out[a->outlen++] = CMD_DOWNLOAD_DATA;
+        a->out[a->outlen++] = n;
+        memcpy (a->out + a->outlen, data, n);
+        a->outlen += n;
+        data += n;
+        nbytes -= n;
+    }
+}
+
+static void pickit_queue_run (pickit_adapter_t *a,
+    unsigned slot, unsigned iterations)
+{
+    unsigned char cmd [3];
+
+    cmd[0] = CMD_RUN_SCRIPT;
+    cmd[1] = slot;
+    cmd[2] = iterations;
+    pickit_queue (a, cmd, 3);
+}
+
 static void pickit_recv (pickit_adapter_t *a)
 {
     if (hid_read (a->hiddev, a->reply, 64) != 64) {
@@ -152,6 +227,42 @@ static void serial_execution (pickit_adapter_t *a)
         SCRIPT_JT2_XFERDATA8_LIT, MCHP_FLASH_ENABLE);
 }
 
+/*
+ * Store the scripts used with the PE in the adapter, so that
+ * the hot loops send only CMD_RUN_SCRIPT instead of the whole
+ * script body with every report.
+ */
+static void pickit_download_scripts (pickit_adapter_t *a)
+{
+    static const unsigned char scripts[] = {
+        CMD_CLEAR_SCRIPT_BUFFER,
+        CMD_DOWNLOAD_SCRIPT, SLOT_PE_READ, 13,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                0x20, 0, 1, 0,                  // READ
+            SCRIPT_JT2_XFRFASTDAT_BUF,
+            SCRIPT_JT2_WAIT_PE_RESP,
+            SCRIPT_JT2_GET_PE_RESP,
+            SCRIPT_LOOP, 1, 31,
+        CMD_DOWNLOAD_SCRIPT, SLOT_ROW_START, 4,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_BUF,          // PROGRAM ROW
+            SCRIPT_JT2_XFRFASTDAT_BUF,          // address
+        CMD_DOWNLOAD_SCRIPT, SLOT_ROW_DATA, 5,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_BUF,
+            SCRIPT_LOOP, 1, 31,
+        CMD_DOWNLOAD_SCRIPT, SLOT_PE_RESP, 1,
+            SCRIPT_JT2_GET_PE_RESP,
+    };
+
+    if (debug_level > 0)
+        fprintf (stderr, "%s: download scripts\n", a->name);
+    pickit_queue (a, scripts, sizeof (scripts));
+    pickit_flush (a);
+    check_timeout (a, "download scripts");
+}
+
 /*
  * Download programming executive (PE).
  */
@@ -318,6 +429,8 @@ static void pickit_load_executive (adapter_t *adapter,
     }
     if (debug_level > 0)
         fprintf (stderr, "%s: PE version = %04x\n", a->name, version);
+
+    pickit_download_scripts (a);
 }
 
 #if 0
@@ -544,12 +657,11 @@ static void pickit_read_data (adapter_t *adapter,
 
     /* Use PE to read memory. */
     for (words_read = 0; words_read < nwords; ) {
-        /* Download addresses for 8 script runs. */
+        /* Download addresses for 8 script runs, in the same report
+         * as the first run. */
         unsigned i, k = 0;
-        memset (buf, CMD_END_OF_BUFFER, 64);
-        buf[k++] = CMD_CLEAR_DOWNLOAD_BUFFER;
-        buf[k++] = CMD_DOWNLOAD_DATA;
-        buf[k++] = 8 * 4;
+        static const unsigned char clear_cmd = CMD_CLEAR_DOWNLOAD_BUFFER;
+
         for (i = 0; i < 8; i++) {
             unsigned address = addr + words_read*4 + i*32*4;
             buf[k++] = address;
@@ -557,20 +669,18 @@ static void pickit_read_data (adapter_t *adapter,
             buf[k++] = address >> 16;
             buf[k++] = address >> 24;
         }
-        pickit_send_buf (a, buf, k);
+        pickit_queue (a, &clear_cmd, 1);
+        pickit_queue_data (a, buf, k);
 
         for (k = 0; k < 8; k++) {
             /* Read progmem. */
-            pickit_send (a, 17, CMD_CLEAR_UPLOAD_BUFFER,
-                CMD_EXECUTE_SCRIPT, 13,
-                    SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
-                    SCRIPT_JT2_XFRFASTDAT_LIT,
-                        0x20, 0, 1, 0,          // READ
-                    SCRIPT_JT2_XFRFASTDAT_BUF,
-                    SCRIPT_JT2_WAIT_PE_RESP,
-                    SCRIPT_JT2_GET_PE_RESP,
-                    SCRIPT_LOOP, 1, 31,
-                CMD_UPLOAD_DATA_NOLEN);
+            static const unsigned char read_cmd[] = {
+                CMD_CLEAR_UPLOAD_BUFFER,
+                CMD_RUN_SCRIPT, SLOT_PE_READ, 1,
+                CMD_UPLOAD_DATA_NOLEN,
+            };
+            pickit_queue (a, read_cmd, sizeof (read_cmd));
+            pickit_flush (a);
             pickit_recv (a);
             memcpy (data, a->reply, 64);
 //fprintf (stderr, "   ...%08x...\n", data[0]);
@@ -587,31 +697,6 @@ static void pickit_read_data (adapter_t *adapter,
     }
 }
 
-/*
- * Put data to download buffer.
- * Max 15 words (60 bytes).
- */
-static void download_data (pickit_adapter_t *a,
-    unsigned *data, unsigned nwords, int clear_flag)
-{
-    unsigned char buf [64];
-    unsigned i, k = 0;
-
-    memset (buf, CMD_END_OF_BUFFER, 64);
-    if (clear_flag)
-        buf[k++] = CMD_CLEAR_DOWNLOAD_BUFFER;
-    buf[k++] = CMD_DOWNLOAD_DATA;
-    buf[k++] = nwords * 4;
-    for (i=0; i<nwords; i++) {
-        unsigned word = *data++;
-        buf[k++] = word;
-        buf[k++] = word >> 8;
-        buf[k++] = word >> 16;
-        buf[k++] = word >> 24;
-    }
-    pickit_send_buf (a, buf, k);
-}
-
 /*
  * Write a word to flash memory.
  */
@@ -732,61 +817,52 @@ static void pickit_program_row (adapter_t *adapter, unsigned addr,
         fprintf (stderr, "%s: slow flash write not implemented yet.\n", a->name);
         exit (-1);
     }
-    /* Use PE to write flash memory. */
-
-    pickit_send (a, 15, CMD_CLEAR_UPLOAD_BUFFER,
-        CMD_EXECUTE_SCRIPT, 12,
-            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
-            SCRIPT_JT2_XFRFASTDAT_LIT,
-		words_per_row, 0, 0, 0,         // PROGRAM ROW
-	    SCRIPT_JT2_XFRFASTDAT_LIT,
-		(unsigned char) addr,
-		(unsigned char) (addr >> 8),
-		(unsigned char) (addr >> 16),
-		(unsigned char) (addr >> 24));
-
-    /* Download data. */
-    if (words_per_row == 32) {
-        /* MX1/2 family. */
-        download_data (a, data, 15, 1);
-        download_data (a, data+15, 15, 0);
-
-        pickit_send (a, 18,
-            CMD_DOWNLOAD_DATA, 2*4,
-                WORD_AS_BYTES (data[30]),
-                WORD_AS_BYTES (data[31]),
-            CMD_EXECUTE_SCRIPT, 6,              // execute
-                SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
-                SCRIPT_JT2_XFRFASTDAT_BUF,
-                SCRIPT_LOOP, 1, 31);
-    } else {
-        /* MX3/4/5/6/7 or MZ family. */
-        for (i = 0; i < words_per_row/64; i++) {
-            /* Download 256 bytes of data. */
-            download_data (a, data, 15, 1);
-            download_data (a, data+15, 15, 0);
-            download_data (a, data+30, 15, 0);
-            download_data (a, data+45, 15, 0);
-
-            pickit_send (a, 26,
-                CMD_DOWNLOAD_DATA, 4*4,
-                    WORD_AS_BYTES (data[60]),
-                    WORD_AS_BYTES (data[61]),
-                    WORD_AS_BYTES (data[62]),
-                    WORD_AS_BYTES (data[63]),
-                CMD_EXECUTE_SCRIPT, 6,              // execute
-                    SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
-                    SCRIPT_JT2_XFRFASTDAT_BUF,
-                    SCRIPT_LOOP, 1, 63);
-
-            data += 64;
+    /* Use PE to write flash memory.
+     * The command, address and data go through the download buffer,
+     * packed back to back in full reports, and stored scripts
+     * feed them to the PE: 256 bytes at most per script run. */
+    unsigned char buf [256];
+    unsigned k, n;
+    static const unsigned char start_cmd[] = {
+        CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_CLEAR_DOWNLOAD_BUFFER,
+    };
+    static const unsigned char end_cmd[] = {
+        CMD_RUN_SCRIPT, SLOT_PE_RESP, 1,
+        CMD_UPLOAD_DATA,
+    };
+
+    k = 0;
+    buf[k++] = words_per_row;                   // PROGRAM ROW
+    buf[k++] = 0;
+    buf[k++] = 0;
+    buf[k++] = 0;
+    buf[k++] = addr;
+    buf[k++] = addr >> 8;
+    buf[k++] = addr >> 16;
+    buf[k++] = addr >> 24;
+    pickit_queue (a, start_cmd, sizeof (start_cmd));
+    pickit_queue_data (a, buf, k);
+    pickit_queue_run (a, SLOT_ROW_START, 1);
+
+    /* Download data, 64 words per script run. */
+    for (i = 0; i < words_per_row; i += n) {
+        n = words_per_row - i;
+        if (n > 64)
+            n = 64;
+        for (k = 0; k < n*4; k += 4) {
+            unsigned word = *data++;
+            buf[k] = word;
+            buf[k+1] = word >> 8;
+            buf[k+2] = word >> 16;
+            buf[k+3] = word >> 24;
         }
+        pickit_queue_data (a, buf, k);
+        pickit_queue_run (a, SLOT_ROW_DATA, n / 32);
     }
 
-    pickit_send (a, 5, CMD_CLEAR_UPLOAD_BUFFER,
-        CMD_EXECUTE_SCRIPT, 1,
-            SCRIPT_JT2_GET_PE_RESP,
-        CMD_UPLOAD_DATA);
+    pickit_queue (a, end_cmd, sizeof (end_cmd));
+    pickit_flush (a);
 
     pickit_recv (a);
     //fprintf (stderr, "%s: program PE response %u bytes: %02x...\n",
@@ -997,6 +1073,7 @@ adapter_t *adapter_open_pickit (void)
         return 0;
     }
 	a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
+    a->adapter.report_words = 15;       /* pickit_queue_data() */
     
 	if (! (a->reply[1] & MCHP_STATUS_CPS)) {
         fprintf (stderr, "Device is code protected and must be erased first.\n");
@@ -19,6 +19,17 @@
 #include "adapter.h"
 #include "hidapi.h"
 #include "pic32.h"
+#include "bitbang-codec.h"
+
+/*
+ * Raw TMS/TDI vectors, command 0xAA: flags, number of bits,
+ * then TMS, TDI and optional capture mask, one bit per clock, LSB first.
+ */
+#define RAW_CAPTURE     0x01    /* Return TDO of every bit */
+#define RAW_MASK        0x02    /* Return TDO of the bits set in the mask */
+#define RAW_MAX_BITS    240     /* Two vectors in a report */
+#define RAW_MAX_MASKED  160     /* Three vectors in a report */
+#define RAW_BYTES       (RAW_MAX_BITS / 8)
 
 typedef struct {
     /* Common part */
@@ -27,6 +38,14 @@ typedef struct {
     hid_device *hiddev;
 	unsigned long long read_word;
     unsigned use_executive;
+
+    /* Raw TMS/TDI vectors, not sent yet. */
+    unsigned char raw_tms [RAW_BYTES];
+    unsigned char raw_tdi [RAW_BYTES];
+    unsigned char raw_mask [RAW_BYTES];
+    unsigned raw_nbits;
+    unsigned raw_masked;
+
     unsigned serial_execution_mode;
 } usbjtag_adapter_t;
 
@@ -57,6 +76,67 @@ static unsigned calculate_crc (unsigned crc, unsigned char *data, unsigned nbyte
     return crc & 0xffff;
 }
 
+/*
+ * Send the queued raw vectors in one report.
+ * When the capture mask is used, get the TDO bits into read_word.
+ */
+static void usbjtag_flush (usbjtag_adapter_t *a)
+{
+    unsigned char buf [64];
+    unsigned nbytes, ncaptured, i;
+    int res;
+
+    if (a->raw_nbits == 0)
+        return;
+    nbytes = (a->raw_nbits + 7) / 8;
+    memset (buf, 0, sizeof (buf));
+    buf[0] = 0xAA;
+    buf[1] = a->raw_masked ? RAW_MASK : 0;
+    buf[2] = a->raw_nbits;
+    memcpy (buf + 3, a->raw_tms, nbytes);
+    memcpy (buf + 3 + nbytes, a->raw_tdi, nbytes);
+    if (a->raw_masked)
+        memcpy (buf + 3 + 2*nbytes, a->raw_mask, nbytes);
+    res = hid_write (a->hiddev, buf, 64);
+    if (res < 0) {
+        fprintf (stderr, "%s: error %d sending raw vectors\n", a->name, res);
+        exit (-1);
+    }
+    if (a->raw_masked) {
+        res = hid_read (a->hiddev, buf, 64);
+        if (res == 0) {
+            fprintf (stderr, "Timed out.\n");
+            exit (-1);
+        }
+        if (buf[0] != 1 || buf[63] != 0xAA) {
+            fprintf (stderr, "uhb: error %d receiving packet\n", res);
+            exit (-1);
+        }
+        /* SendData[61] has the number of captured bits. */
+        ncaptured = buf[62];
+        if (ncaptured > 64)
+            ncaptured = 64;
+        a->read_word = 0;
+        for (i=0; i<ncaptured; i++)
+            if (buf[1 + i/8] >> (i & 7) & 1)
+                a->read_word |= 1ULL << i;
+    }
+    memset (a->raw_tms, 0, sizeof (a->raw_tms));
+    memset (a->raw_tdi, 0, sizeof (a->raw_tdi));
+    memset (a->raw_mask, 0, sizeof (a->raw_mask));
+    a->raw_nbits = 0;
+    a->raw_masked = 0;
+}
+
+/*
+ * Send a command report, after the queued raw vectors.
+ */
+static int usbjtag_write (usbjtag_adapter_t *a, unsigned char *buf)
+{
+    usbjtag_flush (a);
+    return hid_write (a->hiddev, buf, 64);
+}
+
 /* Get the DeviceId (OK)
 */
 static unsigned usbjtag_GetDeviceId(usbjtag_adapter_t *a){
@@ -70,7 +150,7 @@ static unsigned usbjtag_GetDeviceId(usbjtag_adapter_t *a){
 	}
 	
 	buf[0] = 0x78;
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	} 
@@ -116,7 +196,7 @@ static unsigned usbjtag_GetMchpStatus(usbjtag_adapter_t *a){
 	}
 	
 	buf[0] = 0x7A;
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	} 
@@ -145,24 +225,6 @@ static unsigned usbjtag_GetMchpStatus(usbjtag_adapter_t *a){
     }
 	return word;
 }
-/* Helper Leds/Ports..
-*/
-static void usbjtag_SetLedsStatus(usbjtag_adapter_t *a, unsigned char led1, unsigned char led2, unsigned char led3, unsigned char led4){
-	int res;
-	unsigned char buf [64];
-	if (debug_level> 0){
-		printf("CALL()->usbjtag_SetLedsStatus.()\n");
-	}
-	buf[0] = 0x20;
-	buf[1] = led1;
-	buf[2] = led2;
-	buf[3] = led3;
-	buf[4] = led4;
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	} 
-}
 /*JTAG SetMode Pseudo Operation
 */
 static void usbjtag_SetMode(usbjtag_adapter_t *a, unsigned char mode, unsigned char mode_bits)
@@ -177,7 +239,7 @@ static void usbjtag_SetMode(usbjtag_adapter_t *a, unsigned char mode, unsigned c
 	buf[1] = mode;
     buf[2] = mode_bits; //TRONCATO!
   
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -199,7 +261,7 @@ static void usbjtag_SendCommand(usbjtag_adapter_t *a, unsigned char command, uns
 	buf[1] = command;
     buf[2] = cmd_bits; //TRONCATO!
   
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -209,7 +271,7 @@ static void usbjtag_SendCommand(usbjtag_adapter_t *a, unsigned char command, uns
 }
 /*JTAG XferInstruction Pseudo Operation
 */
-static unsigned usbtag_XferInstruction(usbjtag_adapter_t *a, unsigned instruction)
+static unsigned usbjtag_XferInstruction(usbjtag_adapter_t *a, unsigned instruction)
 {
 	int res;
 	unsigned result;
@@ -219,7 +281,7 @@ static unsigned usbtag_XferInstruction(usbjtag_adapter_t *a, unsigned instructio
     buf[2] = instruction >> 8;
     buf[3] = instruction >> 16;
     buf[4] = instruction >> 24;
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -239,66 +301,17 @@ static unsigned usbtag_XferInstruction(usbjtag_adapter_t *a, unsigned instructio
 		}
     }
 	return result;
-}/*JTAG XferData Pseudo Operation
-*/
-/*JTAG XferData Pseudo Operation
-*/
-static unsigned usbtag_XferData(usbjtag_adapter_t *a, unsigned data, unsigned char data_length)
-{
-	unsigned result;
-	int res;
-	unsigned char buf [64];
-	int i;
-	if (debug_level> 0){
-		printf("CALL()->usbtag_XferData.()\n");
-	}
-	buf[0] = 0x85;
-	buf[1] = data;
-    buf[2] = data >> 8;
-    buf[3] = data >> 16;
-    buf[4] = data >> 24;
-	buf[5] = data_length;
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); //hid_read_timeout (a->hiddev, a->reply, 64, 1000);
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[1] != 0 && buf[63] != 0x85) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
-		exit (-1);
-	}
-	result = buf[1];
-	result |= buf[2] << 8;
-	result |= buf[3] << 16;
-	result |= buf[4] << 24;
-	
-	if (result == 0xDEADBEAF) {
-		fprintf (stderr, "uhb: error 0xDEADBEAF xfer_instruction \n");
-		exit (-1);
-	}
-	if (debug_level > 0) {
-		fprintf(stderr,"RCV:");
-		for (i=0;i<8;i++){
-			fprintf(stderr,"%02x ", buf[i]);
-		}
-		fprintf(stderr,"\n");
-    }
-	return result;
 }
 /*JTAG XferData Pseudo Operation
 */
-static unsigned usbtag_XferFastData(usbjtag_adapter_t *a, unsigned data)
+static unsigned usbjtag_XferFastData(usbjtag_adapter_t *a, unsigned data)
 {
 	unsigned result;
 	int res;
 	unsigned char buf [64];
 	int i;
 	if (debug_level> 0){
-		printf("CALL()->usbtag_XferFastData.()\n");
+		printf("CALL()->usbjtag_XferFastData.()\n");
 	}
 	buf[0] = 0x84;
 	buf[1] = data;
@@ -306,7 +319,7 @@ static unsigned usbtag_XferFastData(usbjtag_adapter_t *a, unsigned data)
     buf[3] = data >> 16;
     buf[4] = data >> 24;
 	buf[5] = 32;
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -352,7 +365,7 @@ static unsigned usbjtag_InvokeSerialExecution(usbjtag_adapter_t *a)
 	}
 	buf[0] = 0x86;
 	buf[1] = memcmp(a->adapter.family_name, "mz", 2);     // not needed for MZ processors
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -388,7 +401,7 @@ static void usbjtag_EnterPgm(usbjtag_adapter_t *a)
 		printf("CALL()->usbjtag_reset.()\n");
 	}
 	buf[0] = 0x83;
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -404,67 +417,43 @@ static void usbjtag_reset(usbjtag_adapter_t *a, int trst, int sysrst, int led)
 		printf("CALL()->usbjtag_reset.()\n");
 	}
 	buf[0] = 0x82;
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
 }
 
-static void usbjtag_send(usbjtag_adapter_t *a, unsigned char tms_prolog_nbits, unsigned char tms_prolog, unsigned char tdi_nbits, unsigned long long tdi, int read_flag)
+/*
+ * Queue a JTAG transaction as raw vectors: TMS header, then TDI data
+ * with TMS 1-0-0 before and 1-0 after it. Many transactions go in
+ * one report; a read sends the report and waits for the TDO bits.
+ */
+static void usbjtag_send (usbjtag_adapter_t *a, unsigned char tms_prolog_nbits, unsigned char tms_prolog, unsigned char tdi_nbits, unsigned long long tdi, int read_flag)
 {
-	//int res;
-	//unsigned char buf [64];
-	//unsigned long long word = 0;
-	
-	if (debug_level> 0){
-		printf("!!EMPTY!!()->usbjtag_send.()\n");
-	}
-	/*
-	buf[0] = 0xAA;
-	buf[1] = read_flag;
-    buf[2] = tms_prolog_nbits; //TRONCATO!
-    buf[3] = tms_prolog;	   //TRONCATO!	
-    buf[4] = tdi_nbits; 	   //TRONCATO!	 
-	buf[5] = tdi;
-    buf[6] = tdi >> 8;
-    buf[7] = tdi >> 16;
-    buf[8] = tdi >> 24;
-	buf[9] = tdi >> 32;
-	buf[10] = tdi >> 40;
-	buf[11] = tdi >> 48;
-	buf[12] = tdi >> 54;
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	if (debug_level > 0) {
-		if (tdi_nbits > 33)
-		  fprintf (stderr, " %I64u", tdi);
+    unsigned char pairs [BB_MAX_PAIRS];
+    unsigned limit, n;
+    int i;
+    int npairs;
+
+    npairs = bb_pairs (pairs, tms_prolog_nbits, tms_prolog,
+        tdi_nbits, tdi, read_flag);
+    limit = (read_flag || a->raw_masked) ? RAW_MAX_MASKED : RAW_MAX_BITS;
+    if (a->raw_nbits + npairs > limit)
+        usbjtag_flush (a);
+
+    for (i=0; i<npairs; i++) {
+        n = a->raw_nbits++;
+        if (pairs[i] & BB_TMS)
+            a->raw_tms [n/8] |= 1 << (n & 7);
+        if (pairs[i] & BB_TDI)
+            a->raw_tdi [n/8] |= 1 << (n & 7);
+        if (pairs[i] & BB_READ)
+            a->raw_mask [n/8] |= 1 << (n & 7);
+    }
+    if (read_flag) {
+        a->raw_masked = 1;
+        usbjtag_flush (a);
     }
-	*/
-	/* Get reply. */
-	/*
-	if (read_flag>0) {
-		res = hid_read(a->hiddev,buf, 64); //hid_read_timeout (a->hiddev, a->reply, 64, 1000);
-		if (res == 0) {
-			fprintf (stderr, "Timed out.\n");
-			exit (-1);
-		}
-		if (buf[1] != 0 && buf[63] != 0xAA) {
-			fprintf (stderr, "uhb: error %d receiving packet\n", res);
-			exit (-1);
-		}
-		word = buf[1];
-		word |= buf[2] << 8;
-		word |= buf[3] << 16;
-		word |= buf[4] << 24;
-		word |= (unsigned long long)buf[5] << 32;
-		word |= (unsigned long long)buf[6] << 40;
-		word |= (unsigned long long)buf[7] << 48;
-		word |= (unsigned long long)buf[8] << 54;
-		a->read_word = word;
-	}
-	*/
 }
 
 static unsigned long long usbjtag_recv (usbjtag_adapter_t *a)
@@ -474,9 +463,36 @@ static unsigned long long usbjtag_recv (usbjtag_adapter_t *a)
     return a->read_word;
 }
 
-static void usbjtag_speed (usbjtag_adapter_t *a, int khz)
+/*
+ * Set the delay of every clock phase (command 0xAB):
+ * 0 for none, 1 for the default, then about 3 cycles per count.
+ */
+static void usbjtag_delay (usbjtag_adapter_t *a, unsigned delay)
 {
-    // TODO: Set the clock rate of bitbang adapter.
+    unsigned char buf [64];
+    int res;
+
+    memset (buf, 0, sizeof (buf));
+    buf[0] = 0xAB;
+    buf[1] = delay;
+    res = usbjtag_write (a, buf);
+    if (res < 0) {
+        fprintf (stderr, "%s: error %d sending clock delay\n", a->name, res);
+        exit (-1);
+    }
+    res = hid_read (a->hiddev, buf, 64);
+    if (res == 0) {
+        fprintf (stderr, "Timed out.\n");
+        exit (-1);
+    }
+    if (buf[0] != 1 || buf[63] != 0xAB) {
+        /* Old firmware: always at full speed. */
+        if (debug_level > 0)
+            fprintf (stderr, "%s: cannot set TCK rate\n", a->name);
+        return;
+    }
+    if (debug_level > 0)
+        fprintf (stderr, "%s: clock delay %u\n", a->name, delay);
 }
 
 static void usbjtag_close (adapter_t *adapter, int power_on)
@@ -555,7 +571,7 @@ static unsigned get_pe_response (usbjtag_adapter_t *a)
 	unsigned word = 0;
 	buf[0] = 0xC0;
 	buf[1] = 0x01; //num of response...
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -589,7 +605,7 @@ static void get_pe_response_multi (usbjtag_adapter_t *a,unsigned char count,unsi
 	int i = 0;
 	buf[0] = 0xC0;
 	buf[1] = count; //num of read data 
-	res = hid_write(a->hiddev, buf, 64);
+	res = usbjtag_write(a, buf);
 	if (res < 0) {
 		printf("Unable to write()\n");
 	}
@@ -623,16 +639,16 @@ static unsigned usbjtag_read_word (adapter_t *adapter, unsigned addr)
     serial_execution (a);
 
     //fprintf (stderr, "%s: read word from %08x\n", a->name, addr);
-    usbtag_XferInstruction (a, 0x3c04bf80);           // lui s3, 0xFF20
-    usbtag_XferInstruction (a, 0x3c080000 | addr_hi); // lui t0, addr_hi
-    usbtag_XferInstruction (a, 0x35080000 | addr_lo); // ori t0, addr_lo
-    usbtag_XferInstruction (a, 0x8d090000);           // lw t1, 0(t0)
-    usbtag_XferInstruction (a, 0xae690000);           // sw t1, 0(s3)
-    usbtag_XferInstruction (a, 0);           			// nop see -> DS60001145Q-page 18
+    usbjtag_XferInstruction (a, 0x3c04bf80);           // lui s3, 0xFF20
+    usbjtag_XferInstruction (a, 0x3c080000 | addr_hi); // lui t0, addr_hi
+    usbjtag_XferInstruction (a, 0x35080000 | addr_lo); // ori t0, addr_lo
+    usbjtag_XferInstruction (a, 0x8d090000);           // lw t1, 0(t0)
+    usbjtag_XferInstruction (a, 0xae690000);           // sw t1, 0(s3)
+    usbjtag_XferInstruction (a, 0);           			// nop see -> DS60001145Q-page 18
     //usbjtag_send (a, 1, 1, 5, ETAP_FASTDATA, 0);  /* Send command. */
     //usbjtag_send (a, 0, 0, 33, 0, 1);             /* Get fastdata. */
     usbjtag_SendCommand(a, ETAP_FASTDATA,5);
-	unsigned word = usbtag_XferFastData(a,0);//usbjtag_recv (a) >> 1;
+	unsigned word = usbjtag_XferFastData(a,0);//usbjtag_recv (a) >> 1;
 
     if (debug_level > 0)
         fprintf (stderr, "%s: read word at %08x -> %08x\n", a->name, addr, word);
@@ -695,28 +711,28 @@ static void usbjtag_load_executive (adapter_t *adapter,
 
     if (memcmp(a->adapter.family_name, "mz", 2) != 0) {            // steps 1. to 3. not needed for MZ processors
         /* Step 1. */
-        usbtag_XferInstruction (a, 0x3c04bf88);   // lui a0, 0xbf88
-        usbtag_XferInstruction (a, 0x34842000);   // ori a0, 0x2000 - address of BMXCON
-        usbtag_XferInstruction (a, 0x3c05001f);   // lui a1, 0x1f
-        usbtag_XferInstruction (a, 0x34a50040);   // ori a1, 0x40   - a1 has 001f0040
-        usbtag_XferInstruction (a, 0xac850000);   // sw  a1, 0(a0)  - BMXCON initialized
+        usbjtag_XferInstruction (a, 0x3c04bf88);   // lui a0, 0xbf88
+        usbjtag_XferInstruction (a, 0x34842000);   // ori a0, 0x2000 - address of BMXCON
+        usbjtag_XferInstruction (a, 0x3c05001f);   // lui a1, 0x1f
+        usbjtag_XferInstruction (a, 0x34a50040);   // ori a1, 0x40   - a1 has 001f0040
+        usbjtag_XferInstruction (a, 0xac850000);   // sw  a1, 0(a0)  - BMXCON initialized
         printf ("1");
 
         /* Step 2. */
-        usbtag_XferInstruction (a, 0x34050800);   // li  a1, 0x800  - a1 has 00000800
-        usbtag_XferInstruction (a, 0xac850010);   // sw  a1, 16(a0) - BMXDKPBA initialized
+        usbjtag_XferInstruction (a, 0x34050800);   // li  a1, 0x800  - a1 has 00000800
+        usbjtag_XferInstruction (a, 0xac850010);   // sw  a1, 16(a0) - BMXDKPBA initialized
         printf (" 2");
 
         /* Step 3. */
-        usbtag_XferInstruction (a, 0x8c850040);   // lw  a1, 64(a0) - load BMXDMSZ
-        usbtag_XferInstruction (a, 0xac850020);   // sw  a1, 32(a0) - BMXDUDBA initialized
-        usbtag_XferInstruction (a, 0xac850030);   // sw  a1, 48(a0) - BMXDUPBA initialized
+        usbjtag_XferInstruction (a, 0x8c850040);   // lw  a1, 64(a0) - load BMXDMSZ
+        usbjtag_XferInstruction (a, 0xac850020);   // sw  a1, 32(a0) - BMXDUDBA initialized
+        usbjtag_XferInstruction (a, 0xac850030);   // sw  a1, 48(a0) - BMXDUPBA initialized
         printf (" 3");
     }
 
     /* Step 4. */
-    usbtag_XferInstruction (a, 0x3c04a000);   // lui a0, 0xa000
-    usbtag_XferInstruction (a, 0x34840800);   // ori a0, 0x800  - a0 has a0000800
+    usbjtag_XferInstruction (a, 0x3c04a000);   // lui a0, 0xa000
+    usbjtag_XferInstruction (a, 0x34840800);   // ori a0, 0x800  - a0 has a0000800
     printf (" 4 (LDR)");
 
     /* Download the PE loader. */
@@ -726,18 +742,18 @@ static void usbjtag_load_executive (adapter_t *adapter,
         unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
         unsigned opcode2 = 0x34c60000 | pic32_pe_loader[i+1];
 
-        usbtag_XferInstruction(a, opcode1);      // lui a2, PE_loader_hi++
-        usbtag_XferInstruction(a, opcode2);      // ori a2, PE_loader_lo++
-        usbtag_XferInstruction(a, 0xac860000);   // sw  a2, 0(a0)
-        usbtag_XferInstruction(a, 0x24840004);   // addiu a0, 4
+        usbjtag_XferInstruction(a, opcode1);      // lui a2, PE_loader_hi++
+        usbjtag_XferInstruction(a, opcode2);      // ori a2, PE_loader_lo++
+        usbjtag_XferInstruction(a, 0xac860000);   // sw  a2, 0(a0)
+        usbjtag_XferInstruction(a, 0x24840004);   // addiu a0, 4
     }
     printf (" 5");
 
     /* Jump to PE loader (step 6). */
-    usbtag_XferInstruction (a, 0x3c19a000);   // lui t9, 0xa000
-    usbtag_XferInstruction (a, 0x37390800);   // ori t9, 0x800  - t9 has a0000800
-    usbtag_XferInstruction (a, 0x03200008);   // jr  t9
-    usbtag_XferInstruction (a, 0x00000000);   // nop
+    usbjtag_XferInstruction (a, 0x3c19a000);   // lui t9, 0xa000
+    usbjtag_XferInstruction (a, 0x37390800);   // ori t9, 0x800  - t9 has a0000800
+    usbjtag_XferInstruction (a, 0x03200008);   // jr  t9
+    usbjtag_XferInstruction (a, 0x00000000);   // nop
     printf (" 6");
 
     /* Switch from serial to fast execution mode. */
@@ -941,9 +957,8 @@ adapter_t *adapter_open_bitbang () //const char *port, int baud_rate)
     a->hiddev = hiddev;
 	a->name = "MRACH PIC USB JTAG v0.20";
     
-	// TODO: Set default clock rate.
-    //int khz = 500;
-    //usbjtag_speed (a, khz);
+    /* Set default clock rate. */
+    usbjtag_delay (a, 1);
     /* Activate LED. */
     //usbjtag_reset (a, 0, 0, 1);
 
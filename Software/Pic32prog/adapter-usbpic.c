@@ -17,11 +17,13 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include <usb.h>
 
 #include "adapter.h"
 #include "hidapi.h"
 #include "pic32.h"
+#include "jtag-chain.h"
 
 
 typedef struct {
@@ -33,6 +35,12 @@ typedef struct {
 	unsigned char wires_mode;		  /* Take Track of what kind of connection we wants to use (JTAG or ICSP) */
     unsigned use_executive;
     unsigned serial_execution_mode;
+    unsigned has_scripts;             /* Firmware script engine available */
+    unsigned read_loop_loaded;        /* Streaming read loop is in target RAM */
+    unsigned tck_delay;               /* Clock phase delay, command 0xAB */
+    unsigned idcode;                  /* Read at attach, for the first get_idcode */
+    chain_t chain;                    /* JTAG daisy chain, when found */
+    unsigned panel;                   /* TAPs written by broadcast, 0 = one TAP */
 } usb_adapter_t;
 
 static int DBG2 = 0;    // print messages at entry to main routines
@@ -41,6 +49,138 @@ static int DBG2 = 0;    // print messages at entry to main routines
  */
 #define usbpic_VID          0x04D8
 #define usbpic_PID          0x0080  /* Stefano Tests */
+/*
+ * Firmware script engine (see Firmware/script.h).
+ */
+#define SCR_END             0x00
+#define SCR_SETMODE         0x01    /* mode, nbits */
+#define SCR_SENDCMD         0x02    /* cmd, nbits */
+#define SCR_XFERDATA        0x03    /* nbits, 32-bit literal */
+#define SCR_XFERINST        0x04    /* 32-bit literal instruction */
+#define SCR_XFERINST_HI     0x05    /* 16-bit opcode, low half from parameters */
+#define SCR_XFERINST_BUF    0x06    /* instruction from parameters */
+#define SCR_XFRFASTDAT      0x07    /* 32-bit literal */
+#define SCR_XFRFASTDAT_BUF  0x08    /* data from parameters */
+#define SCR_GETPERESP       0x09
+#define SCR_LOOP            0x0A    /* back, count */
+#define SCR_DELAY_US        0x0B    /* us */
+#define SCR_CAPTURE         0x80    /* copy the result in the reply */
+
+#define SCR_LIT(w)          (w) & 0xff, ((w) >> 8) & 0xff, ((w) >> 16) & 0xff, ((w) >> 24) & 0xff
+#define SCR_HI(op)          (op) & 0xff, ((op) >> 8) & 0xff
+
+#define SCRIPT_PARAM_SIZE   60
+#define SCRIPT_READ_WORD    0       /* Script slots */
+#define SCRIPT_PE_LOADER    1
+#define SCRIPT_EXEC         2
+#define SCRIPT_FASTDATA     3
+#define SCRIPT_FASTDATA_WR  4
+
+/* Read a word (without PE), parameters: address high, address low.
+*/
+static const unsigned char script_read_word[] = {
+    SCR_SENDCMD, TAP_SW_ETAP, 5,
+    SCR_SETMODE, 0x1f, 6,                       // reset etap
+    SCR_XFERINST, SCR_LIT(0x3c13ff20),          // lui s3, 0xFF20
+    SCR_XFERINST_HI, SCR_HI(0x3c08),            // lui t0, addr_hi
+    SCR_XFERINST_HI, SCR_HI(0x3508),            // ori t0, addr_lo
+    SCR_XFERINST, SCR_LIT(0x8d090000),          // lw t1, 0(t0)
+    SCR_XFERINST, SCR_LIT(0xae690000),          // sw t1, 0(s3)
+    SCR_XFERINST, SCR_LIT(0),                   // nop
+    SCR_SENDCMD, ETAP_FASTDATA, 5,
+    SCR_XFRFASTDAT | SCR_CAPTURE, SCR_LIT(0),   // get fastdata
+    SCR_END,
+};
+
+/* Store a PE loader word (step 5), parameters: word high, word low.
+*/
+static const unsigned char script_pe_loader[] = {
+    SCR_XFERINST_HI, SCR_HI(0x3c06),            // lui a2, PE_loader_hi++
+    SCR_XFERINST_HI, SCR_HI(0x34c6),            // ori a2, PE_loader_lo++
+    SCR_XFERINST, SCR_LIT(0xac860000),          // sw  a2, 0(a0)
+    SCR_XFERINST, SCR_LIT(0x24840004),          // addiu a0, 4
+    SCR_END,
+};
+
+/* Execute an instruction, parameter: instruction.
+*/
+static const unsigned char script_exec[] = {
+    SCR_XFERINST_BUF,
+    SCR_END,
+};
+
+/* Read a word from the FASTDATA register.
+*/
+static const unsigned char script_fastdata[] = {
+    SCR_XFRFASTDAT | SCR_CAPTURE, SCR_LIT(0),
+    SCR_END,
+};
+
+/* Write a word to the FASTDATA register, parameter: data.
+*/
+static const unsigned char script_fastdata_wr[] = {
+    SCR_XFRFASTDAT_BUF,
+    SCR_END,
+};
+
+/*
+ * RAM resident loop for reading memory without PE (see usbpic_read_stream).
+ * Input: a0 = address, a1 = number of words. The words are stored to the
+ * FASTDATA register, then the loop jumps back to the debug exception vector.
+ */
+#define READ_LOOP_ADDR      0xa0000800
+
+static const unsigned read_loop[] = {
+    0x3c13ff20,     // lui   s3, 0xff20
+    0x8c890000,     // 1: lw t1, 0(a0)
+    0x24840004,     // addiu a0, 4
+    0x24a5ffff,     // addiu a1, -1
+    0xae690000,     // sw    t1, 0(s3) - wait for the probe
+    0x14a0fffb,     // bnez  a1, 1b
+    0x00000000,     // nop
+    0x3c19ff20,     // lui   t9, 0xff20
+    0x37390200,     // ori   t9, 0x200 - t9 has ff200200
+    0x03200008,     // jr    t9
+    0x00000000,     // nop
+};
+
+/*
+ * NVM controller, for flash programming without PE.
+ */
+#define NVMCON_MX           0xbf80f400
+#define NVMCON_MZ           0xbf800600
+#define NVMKEY_OFF          0x10
+#define NVMADDR_OFF         0x20
+#define NVMDATA_OFF         0x30    /* NVMDATA0-3 at 0x30-0x60 on MZ */
+#define NVMSRCADDR_MX_OFF   0x40
+#define NVMSRCADDR_MZ_OFF   0x70
+
+#define NVMCON_WR           0x8000  /* Start the operation */
+#define NVMCON_WREN         0x4000  /* Write enable */
+#define NVMCON_WRERR        0x2000  /* Write error */
+#define NVMCON_LVDERR       0x1000  /* Low voltage error */
+#define NVMOP_WORD_PGM      0x1
+#define NVMOP_QUAD_WORD_PGM 0x2     /* MZ only */
+#define NVMOP_ROW_PGM       0x3
+#define NVMOP_PAGE_ERASE    0x4
+
+#define ROW_BUFFER_ADDR     0xa0000000  /* Row data for NVMOP_ROW_PGM, below the read loop */
+
+/* Map RAM from 0x800 as kernel program memory (MX only),
+ * same as steps 1 to 3 of the PE download.
+ */
+static const unsigned bmx_init[] = {
+    0x3c04bf88,     // lui a0, 0xbf88
+    0x34842000,     // ori a0, 0x2000 - address of BMXCON
+    0x3c05001f,     // lui a1, 0x1f
+    0x34a50040,     // ori a1, 0x40   - a1 has 001f0040
+    0xac850000,     // sw  a1, 0(a0)  - BMXCON initialized
+    0x34050800,     // li  a1, 0x800  - a1 has 00000800
+    0xac850010,     // sw  a1, 16(a0) - BMXDKPBA initialized
+    0x8c850040,     // lw  a1, 64(a0) - load BMXDMSZ
+    0xac850020,     // sw  a1, 32(a0) - BMXDUDBA initialized
+    0xac850030,     // sw  a1, 48(a0) - BMXDUPBA initialized
+};
 /* Calculate checksum.
  */
 static unsigned calculate_crc (unsigned crc, unsigned char *data, unsigned nbytes){
@@ -59,27 +199,59 @@ static unsigned calculate_crc (unsigned crc, unsigned char *data, unsigned nbyte
     }
     return crc & 0xffff;
 }
+/* Send a request and get the reply in the same buffer.
+   Replies to other commands, left by an earlier failure, are
+   read and dropped. A request which could not be written is sent
+   again; idempotent requests are also sent again when no reply came.
+   Return 0 when no valid reply was received.
+*/
+#define USBPIC_RETRIES      3
+#define USBPIC_TIMEOUT      1000    /* Milliseconds to wait for a reply */
+#define USBPIC_STALE        16      /* Most stale replies dropped */
+
+static int usbpic_transact(usb_adapter_t *a, unsigned char *buf, int idempotent){
+	unsigned char req [64];
+	int res, tries, n;
+
+	memcpy(req, buf, 64);
+	for (tries = 0; ; tries++) {
+		res = hid_write(a->hiddev, req, 64);
+		if (res >= 0) {
+			for (n = 0; n <= USBPIC_STALE; n++) {
+				res = hid_read_timeout(a->hiddev, buf, 64, USBPIC_TIMEOUT);
+				if (res <= 0)
+					break;
+				if (buf[63] == req[0] || buf[0] == 0xFE) {
+					// After a retry the other reply may still come: drop it.
+					if (tries > 0)
+						while (hid_read_timeout(a->hiddev, req, 64, USBPIC_TIMEOUT) > 0)
+							continue;
+					return 1;
+				}
+				if (debug_level > 0)
+					fprintf (stderr, "command %02x: stale reply to %02x dropped\n", req[0], buf[63]);
+			}
+			if (! idempotent)
+				return 0;
+		}
+		if (tries >= USBPIC_RETRIES)
+			return 0;
+		if (debug_level > 0)
+			fprintf (stderr, "command %02x: retry %d\n", req[0], tries + 1);
+		mdelay(10);
+	}
+}
 /* Get the hardware configured Wire setup mode
 */
 unsigned char usbpic_GetWiresMode(usb_adapter_t *a){
-	int res;
 	unsigned char buf [64];
 	if (debug_level> 0){
 		
 	}
 	buf[0] = 0x11;
 	buf[1] = 0x00; //0 get others set.
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); 
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[0] != 1 && buf[63] != 0x11) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
+	if (! usbpic_transact(a, buf, 1) || buf[0] != 1) {
+		fprintf (stderr, "uhb: error receiving packet\n");
 		exit (-1);
 	}
 	if (debug_level> 0){
@@ -90,7 +262,6 @@ unsigned char usbpic_GetWiresMode(usb_adapter_t *a){
 /* Set the wanted wire connection mode configuration 
 */
 static void usbpic_SetWiresMode(usb_adapter_t *a, unsigned char mode){
-	int res;
 	unsigned char buf [64];
 	
 	if (a->wires_mode == mode) 
@@ -102,17 +273,8 @@ static void usbpic_SetWiresMode(usb_adapter_t *a, unsigned char mode){
 	buf[0] = 0x11;
 	buf[1] = 0x01; //0 get others set.
 	buf[2] = mode;
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); //hid_read_timeout (a->hiddev, a->reply, 64, 1000);
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[0] != 1 && buf[63] != 0x11) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
+	if (! usbpic_transact(a, buf, 1) || buf[0] != 1) {
+		fprintf (stderr, "uhb: error receiving packet\n");
 		exit (-1);
 	}
 	a->wires_mode = usbpic_GetWiresMode(a);
@@ -180,6 +342,27 @@ static void set_programming_mode (usb_adapter_t *a, int ICSP_EN){
 			usbpic_ExitPgm(a);
 	}
 }
+/* Attach in one round trip: wires mode, I/O ports, programming mode,
+   then IDCODE and MCHP status. The MCHP command register stays selected.
+   Return 0 when not supported by the firmware.
+*/
+static int usbpic_Attach(usb_adapter_t *a, unsigned char mode, unsigned *idcode, unsigned *status){
+	unsigned char buf [64];
+
+	memset(buf, 0, 64);
+	buf[0] = 0x84;
+	buf[1] = mode;
+	if (! usbpic_transact(a, buf, 1) || buf[0] != 1)
+		return 0;
+	*idcode = buf[1] | buf[2] << 8 | buf[3] << 16 | buf[4] << 24;
+	*status = buf[5];
+	a->wires_mode = buf[6];
+	a->pgm_port_setup = 1;
+	a->pgm_mode_active = 1;
+	if (debug_level > 0)
+		printf("Attach(%02x)->IDCODE=%08x status=%02x\n", mode, *idcode, *status);
+	return 1;
+}
 /*JTAG SetMode Pseudo Operation
 */
 static void usbpic_SetMode(usb_adapter_t *a, unsigned char mode, unsigned char mode_bits){
@@ -261,7 +444,6 @@ static void usbpic_close (adapter_t *adapter, int power_on){
 */
 static unsigned usbpic_XferData(usb_adapter_t *a, unsigned data, unsigned char data_length) {
     unsigned result;
-	int res;
 	unsigned char buf [64];
 	buf[0] = 0x85;
 	buf[1] = data;
@@ -269,17 +451,9 @@ static unsigned usbpic_XferData(usb_adapter_t *a, unsigned data, unsigned char d
     buf[3] = data >> 16;
     buf[4] = data >> 24;
 	buf[5] = data_length;
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); //hid_read_timeout (a->hiddev, a->reply, 64, 1000);
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[0] != 1 && buf[63] != 0x85) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
+	// Data registers are read or written again without harm.
+	if (! usbpic_transact(a, buf, 1)) {
+		fprintf (stderr, "uhb: XferData: error receiving packet\n");
 		exit (-1);
 	}
 	result = buf[1];
@@ -296,7 +470,6 @@ static unsigned usbpic_XferData(usb_adapter_t *a, unsigned data, unsigned char d
 /*JTAG XferInstruction Pseudo Operation
 */
 static unsigned char usbpic_XferInstruction (usb_adapter_t *a, unsigned instruction){
-	int res;
 	unsigned char buf [64];
 	unsigned char reply = 0;
 	
@@ -305,17 +478,8 @@ static unsigned char usbpic_XferInstruction (usb_adapter_t *a, unsigned instruct
 	buf[2] = instruction >> 8;
 	buf[3] = instruction >> 16;
 	buf[4] = instruction >> 24;
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); 
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[0] != 1 && buf[63] != 0xDD) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
+	if (! usbpic_transact(a, buf, 0)) {
+		fprintf (stderr, "uhb: XferInstruction: error receiving packet\n");
 		exit (-1);
 	}
 	reply = buf[1] & 1 ? 1 : 0;
@@ -338,7 +502,6 @@ static unsigned char usbpic_XferInstruction (usb_adapter_t *a, unsigned instruct
 */
 static unsigned usbpic_XferFastData(usb_adapter_t *a, unsigned data){
 	unsigned long result;
-	int res;
 	unsigned char buf [64];
 	
 	buf[0] = 0xA0;
@@ -347,17 +510,8 @@ static unsigned usbpic_XferFastData(usb_adapter_t *a, unsigned data){
 	buf[3] = data >> 16;
 	buf[4] = data >> 24;
 
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); //hid_read_timeout (a->hiddev, a->reply, 64, 1000);
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[0] != 1 && buf[63] != 0xA0) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
+	if (! usbpic_transact(a, buf, 0)) {
+		fprintf (stderr, "uhb: XferFastData: error receiving packet\n");
 		exit (-1);
 	}
 	result = buf[1];
@@ -403,6 +557,14 @@ static unsigned usbpic_XferFastData(usb_adapter_t *a, unsigned data){
  */
 static unsigned usbpic_get_idcode (adapter_t *adapter){
     usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned idcode = a->idcode;
+
+    // The first call after open returns the IDCODE read at attach,
+    // without another round trip. The target keeps it as cpuid.
+    if (idcode) {
+        a->idcode = 0;
+        return idcode;
+    }
     // Reset the JTAG TAP controller: TMS 1-1-1-1-1-0.
     // After reset, the IDCODE register is always selected.
 	usbpic_SetMode(a,(unsigned char)0x1f,6);
@@ -412,24 +574,14 @@ static unsigned usbpic_get_idcode (adapter_t *adapter){
 */
 static unsigned usbpic_GetPeResponse (usb_adapter_t *a){
 	unsigned result;
-	int res;
 	unsigned char buf [64];
 	
 	buf[0] = 0xCC;
     if (debug_level > 1) {
 		fprintf(stderr,"GetPeResponse()\n");
 	}
-	res = hid_write(a->hiddev, buf, 64);
-	if (res < 0) {
-		printf("Unable to write()\n");
-	}
-	res = hid_read(a->hiddev,buf, 64); //hid_read_timeout (a->hiddev, a->reply, 64, 1000);
-	if (res == 0) {
-		fprintf (stderr, "Timed out.\n");
-		exit (-1);
-	}
-	if (buf[0] != 1 && buf[63] != 0xCC) {
-		fprintf (stderr, "uhb: error %d receiving packet\n", res);
+	if (! usbpic_transact(a, buf, 0)) {
+		fprintf (stderr, "uhb: GetPeResponse: error receiving packet\n");
 		exit (-1);
 	}
 	result = (unsigned) buf[1];
@@ -507,6 +659,182 @@ static void get_pe_response_multi (usb_adapter_t *a, unsigned char count, unsign
 
 	}
 }
+/* Clear the firmware script buffer.
+   Return 0 if the firmware has no script engine.
+*/
+static int usbpic_ClearScripts(usb_adapter_t *a){
+	unsigned char buf [64];
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = 0x40;
+	if (! usbpic_transact(a, buf, 1)) {
+		fprintf (stderr, "uhb: error receiving packet\n");
+		exit (-1);
+	}
+	if (buf[0] == 0xFE) // Unknown command: old firmware.
+		return 0;
+	if (buf[0] != 1) {
+		fprintf (stderr, "uhb: error %02x clearing scripts\n", buf[0]);
+		exit (-1);
+	}
+	return 1;
+}
+/* Download a script in the firmware script buffer.
+*/
+static void usbpic_DownloadScript(usb_adapter_t *a, unsigned char slot, const unsigned char *script, unsigned char length){
+	unsigned char buf [64];
+
+	if (length > 61) {
+		fprintf (stderr, "script %d too long (%d bytes)\n", slot, length);
+		exit (-1);
+	}
+	memset(buf, 0, sizeof(buf));
+	buf[0] = 0x41;
+	buf[1] = slot;
+	buf[2] = length;
+	memcpy(&buf[3], script, length);
+	if (! usbpic_transact(a, buf, 1) || buf[0] != 1) {
+		fprintf (stderr, "uhb: failed to download script %d\n", slot);
+		exit (-1);
+	}
+}
+/* Run a downloaded script iterations times with the given parameters.
+   Return the number of captured words stored in result (if not null).
+*/
+static unsigned usbpic_RunScript(usb_adapter_t *a, unsigned char slot, unsigned char iterations,
+                                 const unsigned char *params, unsigned nparams, unsigned *result){
+	unsigned i, nwords;
+	unsigned char buf [64];
+
+	if (nparams > SCRIPT_PARAM_SIZE) {
+		fprintf (stderr, "script %d: too many parameters (%u bytes)\n", slot, nparams);
+		exit (-1);
+	}
+	memset(buf, 0, sizeof(buf));
+	buf[0] = 0x42;
+	buf[1] = slot;
+	buf[2] = iterations;
+	if (nparams > 0)
+		memcpy(&buf[3], params, nparams);
+	// Only the read script can be run again without side effects.
+	if (! usbpic_transact(a, buf, slot == SCRIPT_READ_WORD) || buf[0] != 1) {
+		fprintf (stderr, "uhb: script %d failed, status %02x\n", slot, buf[0]);
+		exit (-1);
+	}
+	nwords = buf[62] / 4;
+	if (result) {
+		for (i = 0; i < nwords; i++) {
+			result[i] = buf[i*4+1];
+			result[i] |= buf[i*4+2] << 8;
+			result[i] |= buf[i*4+3] << 16;
+			result[i] |= (unsigned) buf[i*4+4] << 24;
+		}
+	}
+	return nwords;
+}
+/* Run a script over a block of words, SCRIPT_PARAM_SIZE/4 words per report.
+   Up to USBPIC_BURST requests are written back to back before the replies
+   are collected, so the adapter is never idle waiting for the host.
+   The words are taken from in[] (when not null) as parameters,
+   and the captured words stored to out[] (when not null).
+   The scripts have side effects, so requests are never sent twice:
+   a write is completed, late replies are waited for and stale
+   replies to other commands dropped, a bounded number of times.
+*/
+#define USBPIC_BURST        16
+
+static void usbpic_run_burst(usb_adapter_t *a, unsigned char slot, unsigned nwords,
+                             const unsigned *in, unsigned *out){
+	unsigned char req [USBPIC_BURST * 64];
+	unsigned char reply [USBPIC_BURST * 64];
+	unsigned char *buf;
+	int nreports, sent, got, end, res, k, tries;
+	unsigned i, n;
+
+	while (nwords > 0) {
+		for (nreports = 0; nreports < USBPIC_BURST && nwords > 0; nreports++) {
+			n = (nwords < SCRIPT_PARAM_SIZE / 4) ? nwords : SCRIPT_PARAM_SIZE / 4;
+			buf = req + nreports * 64;
+			memset(buf, 0, 64);
+			buf[0] = 0x42;
+			buf[1] = slot;
+			buf[2] = n;
+			if (in) {
+				for (i = 0; i < n; i++) {
+					buf[3+i*4]   = in[i];
+					buf[3+i*4+1] = in[i] >> 8;
+					buf[3+i*4+2] = in[i] >> 16;
+					buf[3+i*4+3] = in[i] >> 24;
+				}
+				in += n;
+			}
+			nwords -= n;
+		}
+		for (sent = 0, tries = 0; sent < nreports; ) {
+			res = hid_write_many(a->hiddev, req + sent * 64, 64, nreports - sent);
+			if (res > 0) {
+				sent += res;
+				continue;
+			}
+			if (++tries > USBPIC_RETRIES) {
+				fprintf (stderr, "uhb: script %d: unable to write()\n", slot);
+				exit (-1);
+			}
+			mdelay(10);
+		}
+		for (got = 0, tries = 0; got < nreports; ) {
+			res = hid_read_many(a->hiddev, reply + got * 64, 64, nreports - got, USBPIC_TIMEOUT);
+			if (res < 0 || (res == 0 && ++tries > USBPIC_RETRIES)) {
+				fprintf (stderr, "uhb: script %d: error receiving packet\n", slot);
+				exit (-1);
+			}
+			// Keep the replies to this burst only.
+			end = got + res;
+			for (k = got; k < end; k++) {
+				buf = reply + k * 64;
+				if (buf[63] == 0x42) {
+					if (k != got)
+						memcpy(reply + got * 64, buf, 64);
+					got++;
+				} else if (debug_level > 0)
+					fprintf (stderr, "script %d: stale reply to %02x dropped\n", slot, buf[63]);
+			}
+		}
+		for (k = 0; k < nreports; k++) {
+			buf = reply + k * 64;
+			if (buf[63] != 0x42 || buf[0] != 1) {
+				fprintf (stderr, "uhb: script %d failed, status %02x\n", slot, buf[0]);
+				exit (-1);
+			}
+			if (out) {
+				n = buf[62] / 4;
+				for (i = 0; i < n; i++) {
+					out[i] = buf[i*4+1];
+					out[i] |= buf[i*4+2] << 8;
+					out[i] |= buf[i*4+3] << 16;
+					out[i] |= (unsigned) buf[i*4+4] << 24;
+				}
+				out += n;
+			}
+		}
+	}
+}
+/* Upload the scripts used in this session.
+*/
+static void usbpic_setup_scripts(usb_adapter_t *a){
+	a->has_scripts = usbpic_ClearScripts(a);
+	if (a->has_scripts) {
+		usbpic_DownloadScript(a, SCRIPT_READ_WORD, script_read_word, sizeof(script_read_word));
+		usbpic_DownloadScript(a, SCRIPT_PE_LOADER, script_pe_loader, sizeof(script_pe_loader));
+		usbpic_DownloadScript(a, SCRIPT_EXEC, script_exec, sizeof(script_exec));
+		usbpic_DownloadScript(a, SCRIPT_FASTDATA, script_fastdata, sizeof(script_fastdata));
+		usbpic_DownloadScript(a, SCRIPT_FASTDATA_WR, script_fastdata_wr, sizeof(script_fastdata_wr));
+	}
+	a->adapter.report_words = a->has_scripts ? SCRIPT_PARAM_SIZE / 4 : 1;
+	a->adapter.stream_protocol = a->has_scripts ? 2 : 1;
+	if (debug_level > 0)
+		fprintf (stderr, "Firmware scripts %s\n", a->has_scripts ? "enabled" : "not supported");
+}
 /*JTAG Sequence to enter serial execution 
 (if Write protected return MCHP_STATUS)
 return 0 for succees or MCHP_STATUS for fail.
@@ -568,11 +896,25 @@ static unsigned usbpic_read_word (adapter_t *adapter, unsigned addr) {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
     unsigned addr_lo = addr & 0xFFFF;
     unsigned addr_hi = (addr >> 16) & 0xFFFF;
+    unsigned word;
     if (DBG2)
         fprintf (stderr, "read_word\n");
 
     serial_execution (a);
-		
+
+    if (a->has_scripts) {
+        unsigned char param[4];
+
+        param[0] = addr_hi;
+        param[1] = addr_hi >> 8;
+        param[2] = addr_lo;
+        param[3] = addr_lo >> 8;
+        usbpic_RunScript(a, SCRIPT_READ_WORD, 1, param, 4, &word);
+        if (debug_level > 0)
+            fprintf (stderr, "read word at %08x -> %08x\n", addr, word);
+        return word;
+    }
+
 	usbpic_SendCommand(a, (unsigned char)TAP_SW_ETAP, 5);
 	usbpic_SetMode(a, 0x1f, 6);					      //reset etap
 	usbpic_XferInstruction (a, 0x3c13ff20); 	      //lui $s3, 0xFF20 STEFANO
@@ -583,12 +925,117 @@ static unsigned usbpic_read_word (adapter_t *adapter, unsigned addr) {
 	usbpic_XferInstruction (a, 0);					  // nop
 	
     usbpic_SendCommand(a, (unsigned char)ETAP_FASTDATA, 5);
-	unsigned word = usbpic_XferFastData(a,0x00);       // Get fastdata. / 
+	word = usbpic_XferFastData(a,0x00);                // Get fastdata. / 
 	
 	if (debug_level > 0)
         fprintf (stderr, "read word at %08x -> %08x\n", addr, word);
 	return word;
 }
+/* Send a block of words to the FASTDATA register (ETAP_FASTDATA selected).
+ */
+static void usbpic_fastdata_write (usb_adapter_t *a, const unsigned *data, unsigned nwords) {
+    unsigned i;
+
+    if (! a->has_scripts) {
+        for (i = 0; i < nwords; i++)
+            usbpic_XferFastData(a, data[i]);
+        return;
+    }
+    usbpic_run_burst(a, SCRIPT_FASTDATA_WR, nwords, data, 0);
+}
+/* Execute a sequence of instructions in serial execution mode.
+ */
+static void usbpic_exec (usb_adapter_t *a, const unsigned *code, unsigned ninstr) {
+    unsigned char param[SCRIPT_PARAM_SIZE];
+    unsigned i, n;
+
+    if (! a->has_scripts) {
+        for (i = 0; i < ninstr; i++)
+            usbpic_XferInstruction (a, code[i]);
+        return;
+    }
+    while (ninstr > 0) {
+        n = (ninstr < SCRIPT_PARAM_SIZE / 4) ? ninstr : SCRIPT_PARAM_SIZE / 4;
+        for (i = 0; i < n; i++) {
+            param[i*4]   = code[i];
+            param[i*4+1] = code[i] >> 8;
+            param[i*4+2] = code[i] >> 16;
+            param[i*4+3] = code[i] >> 24;
+        }
+        usbpic_RunScript(a, SCRIPT_EXEC, n, param, n * 4, 0);
+        code += n;
+        ninstr -= n;
+    }
+}
+/* Store words in target RAM using serial execution.
+ */
+static void usbpic_load_ram (usb_adapter_t *a, unsigned addr, const unsigned *words, unsigned nwords) {
+    unsigned char param[SCRIPT_PARAM_SIZE];
+    unsigned code[2], i, n;
+
+    code[0] = 0x3c040000 | (addr >> 16);        // lui a0, addr_hi
+    code[1] = 0x34840000 | (addr & 0xffff);     // ori a0, addr_lo
+    usbpic_exec (a, code, 2);
+
+    while (nwords > 0) {
+        n = (nwords < SCRIPT_PARAM_SIZE / 4) ? nwords : SCRIPT_PARAM_SIZE / 4;
+        if (a->has_scripts) {
+            for (i = 0; i < n; i++) {
+                param[i*4]   = words[i] >> 16;
+                param[i*4+1] = words[i] >> 24;
+                param[i*4+2] = words[i];
+                param[i*4+3] = words[i] >> 8;
+            }
+            usbpic_RunScript(a, SCRIPT_PE_LOADER, n, param, n * 4, 0);
+        } else {
+            for (i = 0; i < n; i++) {
+                usbpic_XferInstruction (a, 0x3c060000 | (words[i] >> 16));     // lui a2, word_hi
+                usbpic_XferInstruction (a, 0x34c60000 | (words[i] & 0xffff));  // ori a2, word_lo
+                usbpic_XferInstruction (a, 0xac860000);   // sw  a2, 0(a0)
+                usbpic_XferInstruction (a, 0x24840004);   // addiu a0, 4
+            }
+        }
+        words += n;
+        nwords -= n;
+    }
+}
+/* Read a memory block without PE.
+ * A small loop in target RAM streams the words to the FASTDATA register,
+ * the host pulls them with fastdata reads: one report per 15 words
+ * with the firmware scripts, sent in bursts, one per word without.
+ */
+static void usbpic_read_stream (usb_adapter_t *a, unsigned addr, unsigned nwords, unsigned *data) {
+    unsigned code[8], n;
+
+    if (nwords == 0)
+        return;
+    serial_execution (a);
+    if (! a->read_loop_loaded) {
+        if (memcmp(a->adapter.family_name, "mz", 2) != 0)
+            usbpic_exec (a, bmx_init, sizeof(bmx_init) / sizeof(bmx_init[0]));
+        usbpic_load_ram (a, READ_LOOP_ADDR, read_loop, sizeof(read_loop) / sizeof(read_loop[0]));
+        a->read_loop_loaded = 1;
+    }
+    code[0] = 0x3c040000 | (addr >> 16);                // lui a0, addr_hi
+    code[1] = 0x34840000 | (addr & 0xffff);             // ori a0, addr_lo
+    code[2] = 0x3c050000 | (nwords >> 16);              // lui a1, nwords_hi
+    code[3] = 0x34a50000 | (nwords & 0xffff);           // ori a1, nwords_lo
+    code[4] = 0x3c190000 | (READ_LOOP_ADDR >> 16);      // lui t9, loop_hi
+    code[5] = 0x37390000 | (READ_LOOP_ADDR & 0xffff);   // ori t9, loop_lo
+    code[6] = 0x03200008;                               // jr  t9
+    code[7] = 0;                                        // nop
+    usbpic_exec (a, code, 8);
+
+    usbpic_SendCommand(a, (unsigned char)ETAP_FASTDATA, 5);
+    if (a->has_scripts) {
+        usbpic_run_burst(a, SCRIPT_FASTDATA, nwords, 0, data);
+    } else {
+        for (n = 0; n < nwords; n++)
+            data[n] = usbpic_XferFastData(a, 0);
+    }
+    if (debug_level > 0)
+        fprintf (stderr, "stream read at %08x done\n", addr);
+}
 /* Read a memory block.
  */
 static void usbpic_read_data (adapter_t *adapter, unsigned addr, unsigned nwords, unsigned *data) {
@@ -601,6 +1048,10 @@ static void usbpic_read_data (adapter_t *adapter, unsigned addr, unsigned nwords
 
     if (! a->use_executive) {
         // Without PE. //
+        if (nwords > 1) {
+            usbpic_read_stream (a, addr, nwords, data);
+            return;
+        }
         for (i = nwords; i > 0; i--) {
             *data++ = usbpic_read_word (adapter, addr);
             addr += 4;
@@ -640,6 +1091,7 @@ static void usbpic_load_executive (adapter_t *adapter, const unsigned *pe, unsig
     usb_adapter_t *a = (usb_adapter_t*) adapter;
 
     a->use_executive = 1;
+    a->read_loop_loaded = 0;                    // overwritten by the PE loader
 	
     serial_execution (a);
     printf ("   Loading PE: ");
@@ -672,15 +1124,32 @@ static void usbpic_load_executive (adapter_t *adapter, const unsigned *pe, unsig
 
     // Download the PE loader. 
 
-    for (i = 0; i < PIC32_PE_LOADER_LEN; i += 2) {
-        // Step 5. 
-        unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
-        unsigned opcode2 = 0x34c60000 | pic32_pe_loader[i+1];
+    if (a->has_scripts) {
+        // Step 5, up to 15 loader words per report.
+        unsigned char param[SCRIPT_PARAM_SIZE];
+        int j, n;
+
+        for (i = 0; i < PIC32_PE_LOADER_LEN; i += n * 2) {
+            n = (PIC32_PE_LOADER_LEN - i) / 2;
+            if (n > SCRIPT_PARAM_SIZE / 4)
+                n = SCRIPT_PARAM_SIZE / 4;
+            for (j = 0; j < n * 2; j++) {
+                param[j*2]   = pic32_pe_loader[i+j];
+                param[j*2+1] = pic32_pe_loader[i+j] >> 8;
+            }
+            usbpic_RunScript(a, SCRIPT_PE_LOADER, n, param, n * 4, 0);
+        }
+    } else {
+        for (i = 0; i < PIC32_PE_LOADER_LEN; i += 2) {
+            // Step 5. 
+            unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
+            unsigned opcode2 = 0x34c60000 | pic32_pe_loader[i+1];
 
-        usbpic_XferInstruction (a, opcode1);      // lui a2, PE_loader_hi++
-        usbpic_XferInstruction (a, opcode2);      // ori a2, PE_loader_lo++
-        usbpic_XferInstruction (a, 0xac860000);   // sw  a2, 0(a0)
-        usbpic_XferInstruction (a, 0x24840004);   // addiu a0, 4
+            usbpic_XferInstruction (a, opcode1);      // lui a2, PE_loader_hi++
+            usbpic_XferInstruction (a, opcode2);      // ori a2, PE_loader_lo++
+            usbpic_XferInstruction (a, 0xac860000);   // sw  a2, 0(a0)
+            usbpic_XferInstruction (a, 0x24840004);   // addiu a0, 4
+        }
     }
     printf (" 5");
 
@@ -700,9 +1169,7 @@ static void usbpic_load_executive (adapter_t *adapter, const unsigned *pe, unsig
     printf (" 7a (PE)");
 
     // Download the PE itself (step 7-B). //
-    for (i = 0; i < nwords; i++) {
-		usbpic_XferFastData(a, *pe++);
-	}
+    usbpic_fastdata_write(a, pe, nwords);
     printf (" 7b");
 
     // Download the PE instructions. 
@@ -721,6 +1188,69 @@ static void usbpic_load_executive (adapter_t *adapter, const unsigned *pe, unsig
     }
     printf ("PE version = v%04x\n", version & 0xFFFF);
 }
+/* Store a value in an NVM register: t0 has the NVMCON address.
+ * Return the number of instructions.
+ */
+static unsigned nvm_store (unsigned *code, unsigned offset, unsigned value)
+{
+    code[0] = 0x3c090000 | (value >> 16);       // lui t1, value_hi
+    code[1] = 0x35290000 | (value & 0xffff);    // ori t1, value_lo
+    code[2] = 0xad090000 | offset;              // sw  t1, offset(t0)
+    return 3;
+}
+/* Run an NVM operation without PE, using serial execution.
+ * The data registers (NVMDATA or NVMSRCADDR) are loaded from offsets/values.
+ */
+static void usbpic_nvm_operation (usb_adapter_t *a, unsigned op, unsigned addr,
+    const unsigned *offsets, const unsigned *values, unsigned nregs)
+{
+    int mz = (memcmp(a->adapter.family_name, "mz", 2) == 0);
+    unsigned nvmcon = mz ? NVMCON_MZ : NVMCON_MX;
+    unsigned code[32], n, i, status;
+
+    serial_execution (a);
+
+    n = 0;
+    code[n++] = 0x3c080000 | (nvmcon >> 16);        // lui t0, nvmcon_hi
+    code[n++] = 0x35080000 | (nvmcon & 0xffff);     // ori t0, nvmcon_lo
+    n += nvm_store (code + n, NVMADDR_OFF, addr);
+    for (i = 0; i < nregs; i++)
+        n += nvm_store (code + n, offsets[i], values[i]);
+    code[n++] = 0x34090000 | NVMCON_WREN | op;      // li  t1, WREN | op
+    code[n++] = 0xad090000;                         // sw  t1, 0(t0) - NVMCON
+    if (mz)
+        code[n++] = 0xad000000 | NVMKEY_OFF;        // sw  zero, NVMKEY
+    n += nvm_store (code + n, NVMKEY_OFF, 0xaa996655);
+    n += nvm_store (code + n, NVMKEY_OFF, 0x556699aa);
+    code[n++] = 0x34090000 | NVMCON_WR;             // li  t1, WR
+    code[n++] = 0xad090008;                         // sw  t1, 8(t0) - NVMCONSET
+    usbpic_exec (a, code, n);
+
+    // Wait until WR is cleared by the hardware.
+    for (i = 0; ; i++) {
+        status = usbpic_read_word (&a->adapter, nvmcon);
+        if (! (status & NVMCON_WR))
+            break;
+        if (i >= 1000) {
+            fprintf (stderr, "\nNVM operation %u timed out at %08x\n", op, addr);
+            exit (-1);
+        }
+        mdelay (1);
+    }
+
+    n = 0;
+    code[n++] = 0x3c080000 | (nvmcon >> 16);        // lui t0, nvmcon_hi
+    code[n++] = 0x35080000 | (nvmcon & 0xffff);     // ori t0, nvmcon_lo
+    code[n++] = 0x34090000 | NVMCON_WREN;           // li  t1, WREN
+    code[n++] = 0xad090004;                         // sw  t1, 4(t0) - NVMCONCLR
+    usbpic_exec (a, code, n);
+
+    if (status & (NVMCON_WRERR | NVMCON_LVDERR)) {
+        fprintf (stderr, "\nNVM operation %u failed at %08x, NVMCON = %08x\n",
+                                               op,       addr,         status);
+        exit (-1);
+    }
+}
 /* Erase all flash memory.
  */
 static void usbpic_erase_chip (adapter_t *adapter) {
@@ -731,6 +1261,11 @@ static void usbpic_erase_chip (adapter_t *adapter) {
 	usbpic_SendCommand(a, MTAP_COMMAND, 5);		// Send command. [
 	usbpic_XferData(a, MCHP_ERASE, 8);		//XferData
 
+    // The erase resets the CPU: PE and serial execution are lost.
+    a->use_executive = 0;
+    a->serial_execution_mode = 0;
+    a->read_loop_loaded = 0;
+
     if (memcmp(a->adapter.family_name, "mz", 2) == 0)
 		usbpic_XferData(a, MCHP_DEASSERT_RST, 8); // needed for PIC32MZ devices only.
 
@@ -762,14 +1297,16 @@ static void usbpic_program_word (adapter_t *adapter, unsigned addr, unsigned wor
 
     if (debug_level > 0)
         fprintf (stderr, "program word at %08x: %08x\n", addr, word);
+    if (memcmp(a->adapter.family_name, "mz", 2) == 0)
+        printf("!ECC!");                        // warn if word-write to MZ processor
+
     if (! a->use_executive) {
         // Without PE. 
-        fprintf (stderr, "slow flash write not implemented yet\n");
-        exit (-1);
-    }
+        unsigned offset = NVMDATA_OFF;
 
-    if (memcmp(a->adapter.family_name, "mz", 2) == 0)
-        printf("!ECC!");                        // warn if word-write to MZ processor
+        usbpic_nvm_operation (a, NVMOP_WORD_PGM, addr, &offset, &word, 1);
+        return;
+    }
 
     // Use PE to write flash memory. 
     //usbpic_send (a, 1, 1, 5, ETAP_FASTDATA, 0);  // Send command. 
@@ -786,74 +1323,888 @@ static void usbpic_program_word (adapter_t *adapter, unsigned addr, unsigned wor
     }
 }
 
-/* Flash write row of memory.
+/* Write 4 words to flash memory (PIC32MZ configuration words).
  */
-static void usbpic_program_row (adapter_t *adapter, unsigned addr, unsigned *data, unsigned words_per_row)
+static void usbpic_program_quad_word (adapter_t *adapter, unsigned addr,
+    unsigned word0, unsigned word1, unsigned word2, unsigned word3)
 {
-	
     usb_adapter_t *a = (usb_adapter_t*) adapter;
 
     if (debug_level > 0)
-        fprintf (stderr, "row program %u words at %08x\n", words_per_row, addr);
+        fprintf (stderr, "program quad word at %08x: %08x-%08x-%08x-%08x\n",
+            addr, word0, word1, word2, word3);
     if (! a->use_executive) {
         // Without PE. 
-        fprintf (stderr, "slow flash write not implemented yet\n");
-        exit (-1);
+        static const unsigned offsets[4] = {
+            NVMDATA_OFF, NVMDATA_OFF + 0x10, NVMDATA_OFF + 0x20, NVMDATA_OFF + 0x30,
+        };
+        unsigned words[4];
+
+        words[0] = word0;
+        words[1] = word1;
+        words[2] = word2;
+        words[3] = word3;
+        usbpic_nvm_operation (a, NVMOP_QUAD_WORD_PGM, addr, offsets, words, 4);
+        return;
     }
 
     // Use PE to write flash memory. 
-    //usbpic_send (a, 1, 1, 5, ETAP_FASTDATA, 0);  // Send command. 
 	usbpic_SendCommand(a,ETAP_FASTDATA,5); //ETAP_FASTDATA
-    usbpic_XferFastData(a, PE_ROW_PROGRAM << 16 | words_per_row);
-    usbpic_XferFastData(a, addr);                      // Send address. 
-
-    // Download data. 
-    int i;
-    for (i = 0; i < words_per_row; i++) {
-        usbpic_XferFastData(a, *data++);               // Send word. 
-    }
+    usbpic_XferFastData (a, PE_QUAD_WORD_PGRM << 16);
+    usbpic_XferFastData (a, addr);                    // Send address. 
+    usbpic_XferFastData (a, word0);                   // Send words. 
+    usbpic_XferFastData (a, word1);
+    usbpic_XferFastData (a, word2);
+    usbpic_XferFastData (a, word3);
 
     unsigned response = get_pe_response (a);
-    if (response != (PE_ROW_PROGRAM << 16)) {
-        fprintf (stderr, "\nfailed to program row at %08x, reply = %08x\n",
-                                                     addr,         response);
+    if (response != (PE_QUAD_WORD_PGRM << 16)) {
+        fprintf (stderr, "\nfailed to program quad word at %08x, reply = %08x\n",
+                                                          addr,         response);
         exit (-1);
     }
 }
 
-/* Verify a block of memory.
+/* Store a word in a report, little endian.
  */
-static void usbpic_verify_data (adapter_t *adapter, unsigned addr, unsigned nwords, unsigned *data)
+static void put_word (unsigned char *buf, unsigned word)
 {
-	usb_adapter_t *a = (usb_adapter_t*) adapter;
-    unsigned data_crc, flash_crc;
+    buf[0] = word;
+    buf[1] = word >> 8;
+    buf[2] = word >> 16;
+    buf[3] = word >> 24;
+}
+
+/* Encode the PE row program command as reports: SendCommand(ETAP_FASTDATA),
+   the header and address words, the data and GetPEResponse.
+   They depend only on the image, so they can be compiled once
+   and replayed to every device.
+ */
+static void usbpic_encode_row (adapter_t *adapter, stream_t *s, unsigned addr, unsigned *data, unsigned words_per_row)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned char *buf;
+    unsigned i, n;
+
+    s->row_bytes = words_per_row * 4;
+    buf = stream_add (s, STREAM_NO_REPLY, 0, 0);
+    buf[0] = 0x99;
+    buf[1] = ETAP_FASTDATA;
+    buf[2] = 5;
+    buf = stream_add (s, STREAM_STATUS, 0, 0);
+    buf[0] = 0xA0;
+    put_word (buf + 1, PE_ROW_PROGRAM << 16 | words_per_row);
+    buf = stream_add (s, STREAM_STATUS, 0, 0);
+    buf[0] = 0xA0;
+    put_word (buf + 1, addr);
+
+    while (words_per_row > 0) {
+        buf = stream_add (s, STREAM_STATUS, 0, 0);
+        if (! a->has_scripts) {
+            n = 1;
+            buf[0] = 0xA0;
+            put_word (buf + 1, *data);
+        } else {
+            n = (words_per_row < SCRIPT_PARAM_SIZE / 4) ? words_per_row : SCRIPT_PARAM_SIZE / 4;
+            buf[0] = 0x42;
+            buf[1] = SCRIPT_FASTDATA_WR;
+            buf[2] = n;
+            for (i = 0; i < n; i++)
+                put_word (buf + 3 + i*4, data[i]);
+        }
+        data += n;
+        words_per_row -= n;
+    }
+    buf = stream_add (s, STREAM_RESPONSE, PE_ROW_PROGRAM << 16, addr);
+    buf[0] = 0xCC;
+}
+
+/* Send a stream of reports, with up to STREAM_INFLIGHT replies in flight,
+   and check the replies in order. Every reply has status 1 and
+   the command echoed; a PE response must be the expected one.
+   row_done (when not null) is called for every confirmed row.
+ */
+static void usbpic_replay (adapter_t *adapter, const stream_t *s, void (*row_done) (unsigned addr, unsigned nbytes))
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned char reply [STREAM_INFLIGHT * 64];
+    const stream_mark_t *mark;
+    unsigned char *buf;
+    unsigned first, sent, checked, nreplies, response;
+    int got, res, k;
 
     if (! a->use_executive) {
-        // Without PE. 
-        fprintf (stderr, "slow verify not implemented yet\n");
+        fprintf (stderr, "uhb: cannot replay a stream without PE\n");
         exit (-1);
     }
-	// Use PE to get CRC of flash memory. 
-	usbpic_SendCommand(a,(unsigned char)ETAP_FASTDATA,5);
-	usbpic_XferFastData (a, PE_GET_CRC << 16);
-	mdelay(100);
-	usbpic_XferFastData (a, addr);            // Send address. 
-    mdelay(100);
-	usbpic_XferFastData (a, nwords * 4);      // Send length. 
-    mdelay(100);
-    unsigned response = get_pe_response (a);
+    sent = checked = 0;
+    while (sent < s->nreports) {
+        // Write reports until STREAM_INFLIGHT replies are expected.
+        first = sent;
+        nreplies = 0;
+        while (sent < s->nreports) {
+            if (s->marks[sent].check != STREAM_NO_REPLY) {
+                if (nreplies == STREAM_INFLIGHT)
+                    break;
+                nreplies++;
+            }
+            sent++;
+        }
+        if (hid_write_many(a->hiddev, s->reports + first * STREAM_REPORT,
+                           STREAM_REPORT, sent - first) != (int) (sent - first)) {
+            fprintf (stderr, "uhb: stream: unable to write()\n");
+            exit (-1);
+        }
+        for (got = 0; got < (int) nreplies; got += res) {
+            res = hid_read_many(a->hiddev, reply + got * 64, 64, nreplies - got, -1);
+            if (res <= 0) {
+                fprintf (stderr, "uhb: stream: error receiving packet\n");
+                exit (-1);
+            }
+        }
+
+        // Match the replies to the reports.
+        for (k = 0; k < (int) nreplies; k++, checked++) {
+            while (s->marks[checked].check == STREAM_NO_REPLY)
+                checked++;
+            mark = &s->marks[checked];
+            buf = reply + k * 64;
+            if (buf[63] != s->reports[checked * STREAM_REPORT] || buf[0] != 1) {
+                fprintf (stderr, "uhb: stream: command %02x failed, status %02x\n",
+                    s->reports[checked * STREAM_REPORT], buf[0]);
+                exit (-1);
+            }
+            if (mark->check != STREAM_RESPONSE)
+                continue;
+            response = buf[1] | buf[2] << 8 | buf[3] << 16 | (unsigned) buf[4] << 24;
+            if (response != mark->expect) {
+                fprintf (stderr, "\nfailed to program row at %08x, reply = %08x\n",
+                    mark->addr, response);
+                exit (-1);
+            }
+            if (row_done)
+                row_done (mark->addr, s->row_bytes);
+        }
+    }
+}
+
+static stream_t row_stream;             /* Reports of one row, reused */
+
+/* Flash write row of memory.
+ */
+static void usbpic_program_row (adapter_t *adapter, unsigned addr, unsigned *data, unsigned words_per_row)
+{
+	
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+
+    if (debug_level > 0)
+        fprintf (stderr, "row program %u words at %08x\n", words_per_row, addr);
+    if (! a->use_executive) {
+        // Without PE: copy the row to RAM, the NVM controller reads it from there. 
+        unsigned offset, srcaddr = ROW_BUFFER_ADDR & 0x1fffffff;
+
+        offset = (memcmp(a->adapter.family_name, "mz", 2) == 0) ?
+            NVMSRCADDR_MZ_OFF : NVMSRCADDR_MX_OFF;
+        serial_execution (a);
+        usbpic_load_ram (a, ROW_BUFFER_ADDR, data, words_per_row);
+        usbpic_nvm_operation (a, NVMOP_ROW_PGM, addr, &offset, &srcaddr, 1);
+        return;
+    }
+
+    // Use PE to write flash memory: the same reports as a compiled stream.
+    stream_reset (&row_stream);
+    usbpic_encode_row (adapter, &row_stream, addr, data, words_per_row);
+    usbpic_replay (adapter, &row_stream, 0);
+}
+
+/* Erase a run of pages of flash memory with one PE command.
+ * The PE sets PrAcc when it posts the response: poll it, up to
+ * four times the nominal erase time, before reading the response.
+ */
+#define PAGE_ERASE_MSEC     20      /* Erase time of one page */
+
+static void usbpic_erase_pages (adapter_t *adapter, unsigned addr, unsigned npages)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned control, i;
+
+    if (! a->use_executive) {
+        fprintf (stderr, "page erase needs the PE\n");
+        exit (-1);
+    }
+    if (debug_level > 0)
+        fprintf (stderr, "erase %u pages at %08x\n", npages, addr);
+    usbpic_SendCommand(a,ETAP_FASTDATA,5);
+    usbpic_XferFastData(a, PE_PAGE_ERASE << 16 | npages);
+    usbpic_XferFastData(a, addr);                      // Send address. 
+
+    usbpic_SendCommand(a,ETAP_CONTROL,5);
+    for (i = 0; ; i++) {
+        control = usbpic_XferData(a, CONTROL_PRACC | CONTROL_PROBEN |
+            CONTROL_PROBTRAP, 32);
+        if (control & CONTROL_PRACC)
+            break;
+        if (i >= 4 * npages * PAGE_ERASE_MSEC) {
+            fprintf (stderr, "\nerase of %u pages at %08x timed out\n",
+                                             npages,     addr);
+            exit (-1);
+        }
+        mdelay (1);
+    }
+    unsigned response = get_pe_response (a);
+    if (response != (PE_PAGE_ERASE << 16)) {
+        fprintf (stderr, "\nfailed to erase %u pages at %08x, reply = %08x\n",
+                                           npages,     addr,         response);
+        exit (-1);
+    }
+}
+
+/* Erase one page of flash memory.
+ */
+static void usbpic_erase_page (adapter_t *adapter, unsigned addr)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+
+    if (debug_level > 0)
+        fprintf (stderr, "page erase at %08x\n", addr);
+    if (! a->use_executive) {
+        usbpic_nvm_operation (a, NVMOP_PAGE_ERASE, addr, 0, 0, 0);
+        return;
+    }
+    usbpic_erase_pages (adapter, addr, 1);
+}
+
+/* Check that a memory block is erased, using the PE.
+ * Return 1 if blank.
+ */
+static int usbpic_blank_check (adapter_t *adapter, unsigned addr, unsigned nwords)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+
+    if (! a->use_executive) {
+        fprintf (stderr, "blank check needs the PE\n");
+        exit (-1);
+    }
+	usbpic_SendCommand(a,(unsigned char)ETAP_FASTDATA,5);
+	usbpic_XferFastData (a, PE_BLANK_CHECK << 16);
+	usbpic_XferFastData (a, addr);            // Send address. 
+	usbpic_XferFastData (a, nwords * 4);      // Send length. 
+    unsigned response = get_pe_response (a);
+    if ((response >> 16) != PE_BLANK_CHECK) {
+        fprintf (stderr, "\nfailed to blank check %d words at %08x, reply = %08x\n",
+                                                 nwords,     addr,       response);
+        exit (-1);
+    }
+    return (response & 0xffff) == 0;
+}
+
+/* Round trip to the adapter, used to measure the link latency.
+ */
+static void usbpic_ping (adapter_t *adapter)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+	int i;
+	unsigned char buf [64];
+
+	buf[0] = 0x10;
+	for (i = 1; i < 64; i++)
+		buf[i] = i - 1;
+	if (! usbpic_transact(a, buf, 1)) {
+		fprintf (stderr, "Timed out.\n");
+		exit (-1);
+	}
+}
+
+/* Firmware performance counters, command 0xAC.
+*/
+#define STATS_PAGE_TOTALS   0
+#define STATS_PAGE_OPCODES  1
+#define STATS_TICK_NSEC     21333   /* Timer0: 256 cycles at 12 MIPS */
+
+static unsigned get32(const unsigned char *p){
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+/* Read a page of counters in buf, starting at buf[1].
+   Return the number of bytes, 0 when not supported by the firmware.
+*/
+static int usbpic_read_stats(usb_adapter_t *a, int page, int reset, unsigned char *buf){
+	memset(buf, 0, 64);
+	buf[0] = 0xAC;
+	buf[1] = page;
+	buf[2] = reset;
+	if (! usbpic_transact(a, buf, 0) || buf[0] != 1)
+		return 0;
+	return buf[62];
+}
+/* Print the counters since the adapter was opened.
+*/
+static void usbpic_print_stats (adapter_t *adapter)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+	unsigned char buf [64];
+	unsigned tck, busy_ms, idle_ms, n, i, count;
+
+	if (! usbpic_read_stats(a, STATS_PAGE_TOTALS, 0, buf)) {
+		printf ("Adapter statistics not supported by the firmware\n");
+		return;
+	}
+	tck = get32(buf + 1);
+	busy_ms = (unsigned long long) get32(buf + 5) * STATS_TICK_NSEC / 1000000;
+	idle_ms = (unsigned long long) get32(buf + 9) * STATS_TICK_NSEC / 1000000;
+	printf ("Adapter statistics:\n");
+	printf ("   TCK cycles: %u", tck);
+	if (busy_ms > 0)
+		printf (", %u kHz while busy", tck / busy_ms);
+	printf ("\n");
+	printf ("    Busy/idle: %u / %u msec", busy_ms, idle_ms);
+	if (busy_ms + idle_ms > 0)
+		printf (", %u%% busy", busy_ms * 100 / (busy_ms + idle_ms));
+	printf ("\n");
+	printf ("  ETAP wait: %u retries, %u timeouts; PrAcc failures: %u\n",
+		buf[13] | buf[14] << 8, buf[15] | buf[16] << 8, buf[17] | buf[18] << 8);
+	printf ("  USB reports: %u received, %u sent\n",
+		buf[19] | buf[20] << 8, buf[21] | buf[22] << 8);
+
+	/* Command queue of the firmware. */
+	memset(buf, 0, 64);
+	buf[0] = 0xAD;
+	if (usbpic_transact(a, buf, 0) && buf[0] == 1)
+		printf ("        Queue: %u OUT and %u IN buffers, up to %u commands waiting\n",
+			buf[1], buf[2], buf[3]);
+
+	if (! usbpic_read_stats(a, STATS_PAGE_OPCODES, 0, buf))
+		return;
+	printf ("     Commands:");
+	n = buf[1];
+	for (i = 0; i < n && 4 + i*3 < 63; i++) {
+		count = buf[3 + i*3] | buf[4 + i*3] << 8;
+		if (count == 0)
+			continue;
+		if (buf[2 + i*3] == 0)
+			printf (" other=%u", count);
+		else
+			printf (" %02x=%u", buf[2 + i*3], count);
+	}
+	printf ("\n");
+}
+
+/* Verify a block of memory against a known CRC, using the PE.
+ * Return 0 without PE.
+ */
+static int usbpic_verify_crc (adapter_t *adapter, unsigned addr, unsigned nwords, unsigned data_crc)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned flash_crc;
+
+    if (! a->use_executive)
+        return 0;
+
+    // Use PE to get CRC of flash memory.
+    usbpic_SendCommand(a,(unsigned char)ETAP_FASTDATA,5);
+    usbpic_XferFastData (a, PE_GET_CRC << 16);
+    mdelay(100);
+    usbpic_XferFastData (a, addr);            // Send address.
+    mdelay(100);
+    usbpic_XferFastData (a, nwords * 4);      // Send length.
+    mdelay(100);
+    unsigned response = get_pe_response (a);
     if (response != (PE_GET_CRC << 16)) {
         fprintf (stderr, "\nfailed to verify %d words at %08x, reply = %08x\n",
                                              nwords,     addr,       response);
         exit (-1);
     }
     flash_crc = get_pe_response (a) & 0xffff;
-    data_crc = calculate_crc (0xffff, (unsigned char*) data, nwords * 4);
     if (flash_crc != data_crc) {
         fprintf (stderr, "\nchecksum failed at %08x: returned %04x, expected %04x\n",
                                                addr,        flash_crc,     data_crc);
         exit (-1);
     }
+    return 1;
+}
+
+/* Verify a block of memory.
+ */
+static void usbpic_verify_data (adapter_t *adapter, unsigned addr, unsigned nwords, unsigned *data)
+{
+	usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned data_crc;
+
+    if (! a->use_executive) {
+        // Without PE: read back and compare. 
+        unsigned i, *block = malloc (nwords * sizeof(unsigned));
+
+        if (! block) {
+            fprintf (stderr, "Out of memory\n");
+            exit (-1);
+        }
+        usbpic_read_data (adapter, addr, nwords, block);
+        for (i = 0; i < nwords; i++) {
+            if (block[i] != data[i]) {
+                fprintf (stderr, "\nverify failed at %08x: file=%08x, mem=%08x\n",
+                                                addr + i*4,  data[i],  block[i]);
+                exit (-1);
+            }
+        }
+        free (block);
+        return;
+    }
+    data_crc = calculate_crc (0xffff, (unsigned char*) data, nwords * 4);
+    usbpic_verify_crc (adapter, addr, nwords, data_crc);
+}
+
+
+/* Clock phase delay of the firmware: 0 = no padding, 1 = default,
+   then about 0.5 usec of TCK period per count.
+*/
+#define TCK_DELAY_DEFAULT   1
+#define TCK_DELAY_SAFE      64      /* Reference of the calibration */
+#define TCK_CAL_TRIES       4       /* Samples per step of the search */
+#define TCK_CAL_CONFIRM     16      /* Samples of the chosen delay */
+#define MTAP_BYPASS         0x1f
+
+/* Set the clock phase delay. Return 0 when not supported by the firmware.
+*/
+static int usbpic_SetTckDelay(usb_adapter_t *a, unsigned delay){
+	unsigned char buf [64];
+
+	memset(buf, 0, 64);
+	buf[0] = 0xAB;
+	buf[1] = delay;
+	if (! usbpic_transact(a, buf, 1) || buf[0] != 1)
+		return 0;
+	a->tck_delay = delay;
+	return 1;
+}
+/* Sample of the link: IDCODE, MCHP status, and two patterns
+   echoed through the BYPASS register, which only a good clock
+   returns unchanged. TDI stays 0 while in the MCHP command register.
+*/
+static void usbpic_link_sample(usb_adapter_t *a, unsigned *sample){
+	usbpic_SetMode(a, 0x1f, 6);
+	sample[0] = usbpic_XferData(a, 0, 32);
+	usbpic_SendCommand(a, TAP_SW_MTAP, 5);
+	usbpic_SetMode(a, 0x1f, 6);
+	usbpic_SendCommand(a, MTAP_COMMAND, 5);
+	sample[1] = usbpic_XferData(a, MCHP_STATUS, 8);
+	usbpic_SendCommand(a, MTAP_BYPASS, 5);
+	sample[2] = usbpic_XferData(a, 0xa5c3f00f, 32);
+	sample[3] = usbpic_XferData(a, 0x5a3c0ff0, 32);
+	usbpic_SetMode(a, 0x1f, 6);
+}
+/* Check the link at the given delay against the reference sample.
+*/
+static int usbpic_link_ok(usb_adapter_t *a, unsigned delay, const unsigned *ref, int tries){
+	unsigned sample [4];
+
+	usbpic_SetTckDelay(a, delay);
+	while (tries-- > 0) {
+		usbpic_link_sample(a, sample);
+		if (memcmp(sample, ref, sizeof(sample)) != 0)
+			return 0;
+	}
+	return 1;
+}
+/* Name of the file with the calibrated delay of this adapter,
+   in the cache directory, or the default one when not given.
+*/
+static const char *tck_cache_path(usb_adapter_t *a){
+	static char path [1024];
+	wchar_t serial [64];
+	char key [64];
+	const char *dir = cache_dir ? cache_dir : default_cache_dir ();
+	int i, n = 0;
+
+	if (hid_get_serial_number_string(a->hiddev, serial, 64) == 0) {
+		for (i = 0; serial[i] && n < 63; i++)
+			if ((serial[i] >= '0' && serial[i] <= '9') ||
+			    (serial[i] >= 'A' && serial[i] <= 'Z') ||
+			    (serial[i] >= 'a' && serial[i] <= 'z'))
+				key[n++] = serial[i];
+	}
+	key[n] = 0;
+#ifdef _WIN32
+	mkdir (dir);
+#else
+	mkdir (dir, 0777);
+#endif
+	snprintf (path, sizeof (path), "%s/usbpic-%04x-%s.tck", dir,
+		usbpic_PID, n ? key : "noserial");
+	return path;
+}
+/* Find the fastest reliable clock for this adapter, cable and target:
+   take a reference sample at a slow clock, then binary search
+   the smallest delay that reproduces it, plus a margin.
+   The result is cached by adapter serial, and checked at next connect.
+*/
+static void usbpic_calibrate(usb_adapter_t *a){
+	unsigned ref [4], lo, hi, delay;
+	const char *path = tck_cache_path(a);
+	FILE *fd;
+
+	if (! usbpic_SetTckDelay(a, TCK_DELAY_SAFE)) {
+		if (debug_level > 0)
+			fprintf (stderr, "TCK delay not supported by the firmware\n");
+		return;
+	}
+	usbpic_link_sample(a, ref);
+	if ((ref[0] & 0xfff) != 0x053 || ref[2] == ref[3]) {
+		/* No target: nothing to calibrate against. */
+		usbpic_SetTckDelay(a, TCK_DELAY_DEFAULT);
+		return;
+	}
+
+	/* Cached delay, when still good. */
+	fd = path ? fopen (path, "r") : 0;
+	if (fd) {
+		if (fscanf (fd, "%u", &delay) == 1 && delay <= TCK_DELAY_SAFE &&
+		    usbpic_link_ok(a, delay, ref, TCK_CAL_CONFIRM)) {
+			fclose (fd);
+			if (debug_level > 0)
+				fprintf (stderr, "TCK delay %u (cached)\n", delay);
+			return;
+		}
+		fclose (fd);
+	}
+
+	lo = 0;
+	hi = TCK_DELAY_SAFE;
+	while (lo < hi) {
+		delay = (lo + hi) / 2;
+		if (usbpic_link_ok(a, delay, ref, TCK_CAL_TRIES))
+			hi = delay;
+		else
+			lo = delay + 1;
+	}
+	/* Margin of a quarter for temperature and noise. */
+	delay = hi + (hi + 3) / 4;
+	if (delay > TCK_DELAY_SAFE)
+		delay = TCK_DELAY_SAFE;
+	while (delay < TCK_DELAY_SAFE && ! usbpic_link_ok(a, delay, ref, TCK_CAL_CONFIRM))
+		delay += delay / 4 + 1;
+	if (delay > TCK_DELAY_SAFE)
+		delay = TCK_DELAY_SAFE;
+	usbpic_SetTckDelay(a, delay);
+	if (debug_level > 0)
+		fprintf (stderr, "TCK delay %u (calibrated)\n", delay);
+
+	fd = path ? fopen (path, "w") : 0;
+	if (fd) {
+		fprintf (fd, "%u\n", delay);
+		fclose (fd);
+	}
+}
+
+/* Raw TMS/TDI vectors, command 0xAA, for the daisy chain.
+*/
+#define RAW_CAPTURE         0x01    /* Return TDO of every bit */
+#define RAW_MAX_BITS        240     /* Two vectors in a report */
+
+static int usbpic_shift(void *arg, unsigned nbits, const unsigned char *tms,
+    const unsigned char *tdi, unsigned char *tdo){
+	usb_adapter_t *a = arg;
+	unsigned char req [USBPIC_BURST * 64];
+	unsigned char reply [USBPIC_BURST * 64];
+	unsigned char *buf;
+	unsigned first, done, n, nbytes, k, nreports;
+	int got, res;
+
+	for (done = 0; done < nbits; ) {
+		/* Up to USBPIC_BURST vectors in flight. */
+		first = done;
+		for (nreports = 0; nreports < USBPIC_BURST && done < nbits; nreports++) {
+			n = nbits - done;
+			if (n > RAW_MAX_BITS)
+				n = RAW_MAX_BITS;
+			nbytes = (n + 7) / 8;
+			buf = req + nreports * 64;
+			memset(buf, 0, 64);
+			buf[0] = 0xAA;
+			buf[1] = tdo ? RAW_CAPTURE : 0;
+			buf[2] = n;
+			memcpy(buf + 3, tms + done/8, nbytes);
+			memcpy(buf + 3 + nbytes, tdi + done/8, nbytes);
+			done += n;
+		}
+		if (hid_write_many(a->hiddev, req, 64, nreports) != (int) nreports)
+			return 0;
+		if (! tdo)
+			continue;
+		for (got = 0; got < (int) nreports; got += res) {
+			res = hid_read_many(a->hiddev, reply + got * 64, 64, nreports - got, -1);
+			if (res <= 0)
+				return 0;
+		}
+		for (k = 0; k < nreports; k++) {
+			buf = reply + k * 64;
+			if (buf[0] != 1 || buf[63] != 0xAA)
+				return 0;
+			n = nbits - first;
+			if (n > RAW_MAX_BITS)
+				n = RAW_MAX_BITS;
+			memcpy(tdo + first/8, buf + 1, (n + 7) / 8);
+			first += n;
+		}
+	}
+	return 1;
+}
+/* Have the firmware pad every scan for the other TAPs of the chain,
+   which stay in BYPASS. Return 0 when not supported by the firmware.
+*/
+static int usbpic_pad_tap(usb_adapter_t *a, int tap){
+	unsigned char buf [64];
+	unsigned ir_pre, ir_post, dr_pre, dr_post;
+
+	chain_position(&a->chain, tap, &ir_pre, &ir_post, &dr_pre, &dr_post);
+	memset(buf, 0, 64);
+	buf[0] = 0xAE;
+	buf[1] = ir_pre;
+	buf[2] = ir_post;
+	buf[3] = dr_pre;
+	buf[4] = dr_post;
+	return usbpic_transact(a, buf, 1) && buf[0] == 1;
+}
+/* Daisy chain: find the TAPs, then have the firmware pad every
+   scan for the other TAPs, which stay in BYPASS. The PIC32 given
+   by --chain is selected, or the first one. With --chain=all,
+   the PIC32s with the same IDCODE as the first one form a panel.
+   Return the IDCODE of the selected TAP, or 0.
+*/
+static unsigned usbpic_select_tap(usb_adapter_t *a){
+	chain_t *c = &a->chain;
+	int tap = chain_tap, n = 0;
+
+	if (chain_discover(c, usbpic_shift, a) < 0)
+		return 0;
+	if (tap < 0) {
+		for (tap = 0; tap < c->ntaps; tap++)
+			if ((c->idcode[tap] & 0xfff) == 0x053)
+				break;
+	}
+	if (chain_tap == CHAIN_ALL && tap < c->ntaps)
+		n = chain_broadcast_select(c, tap);
+	if (n > 1)
+		a->panel = c->broadcast;
+	else
+		c->broadcast = 0;
+	if (c->ntaps > 1 || debug_level > 0)
+		chain_print(c);
+	if (tap >= c->ntaps || (c->idcode[tap] & 0xfff) != 0x053) {
+		fprintf (stderr, "no PIC32 to select in the JTAG chain\n");
+		return 0;
+	}
+	if (! usbpic_pad_tap(a, tap)) {
+		fprintf (stderr, "JTAG chain not supported by the adapter firmware\n");
+		return 0;
+	}
+	if (a->panel)
+		printf ("Broadcast to %d devices\n", n);
+	else if (c->ntaps > 1)
+		printf ("Selected TAP %d\n", tap);
+
+	/* Programming mode again, now for the selected TAP. */
+	set_programming_mode (a, 0);
+	set_programming_mode (a, 1);
+	usbpic_SetMode(a, 0x1f, 6);
+	return usbpic_XferData(a, 0, 32);
+}
+
+/* Read the MCHP status of the selected TAP.
+*/
+static unsigned usbpic_GetStatus(usb_adapter_t *a){
+	usbpic_SendCommand(a, (unsigned char)TAP_SW_MTAP,5);
+	usbpic_SetMode(a,(unsigned char)0x1f, 6);
+	usbpic_SendCommand(a, (unsigned char)MTAP_COMMAND,5);
+	return usbpic_XferData(a,MCHP_STATUS,8);
+}
+
+/* A panel: identical PIC32s of the chain, written at once.
+   Rows are broadcast to all the devices, and the PE responses
+   checked per device. The other operations run on every device
+   in turn: the devices go through the same steps, so the state
+   of the first one is restored before each of the others.
+   Reads are done on one of the devices.
+*/
+typedef struct {
+    unsigned use_executive;
+    unsigned serial_execution_mode;
+    unsigned read_loop_loaded;
+} panel_state_t;
+
+/* Select the device of the panel after tap, or the first
+   one for tap -1. Return -1 after the last one.
+*/
+static int panel_next(usb_adapter_t *a, int tap, panel_state_t *s){
+	int next;
+
+	for (next = tap + 1; next < a->chain.ntaps; next++)
+		if (a->panel >> next & 1)
+			break;
+	if (next >= a->chain.ntaps)
+		return -1;
+	if (tap < 0) {
+		s->use_executive = a->use_executive;
+		s->serial_execution_mode = a->serial_execution_mode;
+		s->read_loop_loaded = a->read_loop_loaded;
+	} else {
+		a->use_executive = s->use_executive;
+		a->serial_execution_mode = s->serial_execution_mode;
+		a->read_loop_loaded = s->read_loop_loaded;
+	}
+	if (! usbpic_pad_tap(a, next)) {
+		fprintf (stderr, "cannot select TAP %d of the panel\n", next);
+		exit (-1);
+	}
+	if (debug_level > 0)
+		fprintf (stderr, "panel: TAP %d\n", next);
+	return next;
+}
+
+/* Status of every device: the first bad one, or the last.
+*/
+static unsigned panel_status(usb_adapter_t *a){
+	panel_state_t s;
+	unsigned status = 0;
+	int tap;
+
+	for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s)) {
+		status = usbpic_GetStatus(a);
+		if ((status & (MCHP_STATUS_CFGRDY | MCHP_STATUS_FCBUSY)) != MCHP_STATUS_CFGRDY) {
+			fprintf (stderr, "TAP %d: ", tap);
+			break;
+		}
+	}
+	return status;
+}
+
+static void panel_load_executive (adapter_t *adapter, const unsigned *pe, unsigned nwords, unsigned pe_version)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_load_executive (adapter, pe, nwords, pe_version);
+}
+
+static void panel_erase_chip (adapter_t *adapter)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_erase_chip (adapter);
+}
+
+static void panel_erase_page (adapter_t *adapter, unsigned addr)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_erase_page (adapter, addr);
+}
+
+static void panel_erase_pages (adapter_t *adapter, unsigned addr, unsigned npages)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_erase_pages (adapter, addr, npages);
+}
+
+/* Blank when blank on every device.
+ */
+static int panel_blank_check (adapter_t *adapter, unsigned addr, unsigned nwords)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap, blank = 1;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        if (! usbpic_blank_check (adapter, addr, nwords))
+            blank = 0;
+    return blank;
+}
+
+static void panel_program_word (adapter_t *adapter, unsigned addr, unsigned word)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_program_word (adapter, addr, word);
+}
+
+static void panel_program_quad_word (adapter_t *adapter, unsigned addr,
+    unsigned word0, unsigned word1, unsigned word2, unsigned word3)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_program_quad_word (adapter, addr, word0, word1, word2, word3);
+}
+
+/* Write a row to all the devices with one fast data stream.
+ */
+static void panel_program_row (adapter_t *adapter, unsigned addr, unsigned *data, unsigned words_per_row)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    unsigned header [2], response [CHAIN_MAX_TAPS], fail;
+    panel_state_t s;
+    int tap;
+
+    if (! a->use_executive) {
+        for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+            usbpic_program_row (adapter, addr, data, words_per_row);
+        return;
+    }
+    if (debug_level > 0)
+        fprintf (stderr, "broadcast row %u words at %08x\n", words_per_row, addr);
+    memset (response, 0, sizeof (response));
+    header[0] = PE_ROW_PROGRAM << 16 | words_per_row;
+    header[1] = addr;
+    fail = a->panel;
+    if (chain_broadcast_command (&a->chain, ETAP_FASTDATA)) {
+        fail = chain_broadcast_fastdata (&a->chain, header, 2);
+        fail |= chain_broadcast_fastdata (&a->chain, data, words_per_row);
+        fail |= chain_broadcast_response (&a->chain, PE_ROW_PROGRAM << 16, response);
+    }
+    if (fail) {
+        for (tap = 0; tap < a->chain.ntaps; tap++)
+            if (fail >> tap & 1)
+                fprintf (stderr, "\nTAP %d: failed to program row at %08x, reply = %08x\n",
+                                   tap,                             addr,   response[tap]);
+        exit (-1);
+    }
+}
+
+static void panel_verify_data (adapter_t *adapter, unsigned addr, unsigned nwords, unsigned *data)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        usbpic_verify_data (adapter, addr, nwords, data);
+}
+
+static int panel_verify_crc (adapter_t *adapter, unsigned addr, unsigned nwords, unsigned data_crc)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+    panel_state_t s;
+    int tap, done = 1;
+
+    for (tap = panel_next(a, -1, &s); tap >= 0; tap = panel_next(a, tap, &s))
+        if (! usbpic_verify_crc (adapter, addr, nwords, data_crc))
+            done = 0;
+    return done;
 }
 
 /* Initialize bitbang adapter.
@@ -864,6 +2215,7 @@ adapter_t *adapter_open_usbpic(const char wires_mode){
 
     usb_adapter_t *a;
 	hid_device *hiddev;
+	unsigned char buf [64];
 	
     hiddev = hid_open (usbpic_VID, usbpic_PID, 0);
     if (! hiddev) {
@@ -877,22 +2229,37 @@ adapter_t *adapter_open_usbpic(const char wires_mode){
     }
     a->hiddev = hiddev;
 	a->name = "MRACH USB PIC32PGM v0.20";
+
+	/* All replies are read by this thread, right after the request:
+	 * no need for a reader thread in hidapi, when it has one. */
+	hid_set_low_latency (hiddev, 1);
     printf ("   MRACH USB PIC32PGM v0.20 --> Connesso [%s] wires\n\n", wires_mode == 2 ? "JTAG":"ICSP");
 
     a->use_executive = 0;
     a->serial_execution_mode = 0;
 
-	usbpic_SetWiresMode(a, wires_mode);
-	usbpic_SetupIOPorts(a, 1); //Init ports io.
+	unsigned idcode, status = 0;
+	int attached = usbpic_Attach(a, wires_mode, &idcode, &status);
+	if (! attached) {
+		/* Old firmware: step by step. */
+		usbpic_SetWiresMode(a, wires_mode);
+		usbpic_SetupIOPorts(a, 1); //Init ports io.
 	
 /*	
     // Reset the JTAG TAP controller: TMS 1-1-1-1-1-0.
     // After reset, the IDCODE register is always selected.
     // Read out 32 bits of data. //
 */
-	set_programming_mode (a, 1);
-	usbpic_SetMode(a, (unsigned char)0x1f, 6);
-	unsigned idcode = usbpic_XferData(a, 0, 32); // 1. (pg 20)
+		set_programming_mode (a, 1);
+		usbpic_SetMode(a, (unsigned char)0x1f, 6);
+		idcode = usbpic_XferData(a, 0, 32); // 1. (pg 20)
+	}
+	if (a->wires_mode == 2 && (chain_tap != -1 ||
+	    ((idcode & 0xfff) != 0x053 && idcode != 0 && idcode != 0xffffffff))) {
+		/* Not a single PIC32: look for a daisy chain. */
+		idcode = usbpic_select_tap(a);
+		attached = 0;
+	}
     if ((idcode & 0xfff) != 0x053) {
         // Microchip vendor ID is expected. //
         if (debug_level > 0 || (idcode != 0 && idcode != 0xffffffff))
@@ -904,11 +2271,13 @@ adapter_t *adapter_open_usbpic(const char wires_mode){
         return 0;
     }
 
+    usbpic_calibrate(a);
+
     // Check status. //
-	usbpic_SendCommand(a, (unsigned char)TAP_SW_MTAP,5);
-	usbpic_SetMode(a,(unsigned char)0x1f, 6);
-	usbpic_SendCommand(a, (unsigned char)MTAP_COMMAND,5);
-    unsigned status = usbpic_XferData(a,MCHP_STATUS,8);
+	if (a->panel)
+		status = panel_status(a);
+	else if (! attached)
+		status = usbpic_GetStatus(a);
 	if (debug_level > 0)
         fprintf (stderr, "MCHP Status %04x\n", status);
 
@@ -920,7 +2289,17 @@ adapter_t *adapter_open_usbpic(const char wires_mode){
 		free (a);
         return 0;
     }
-    a->adapter.flags = AD_PROBE | AD_ERASE | AD_READ | AD_WRITE;
+    usbpic_setup_scripts(a);
+
+    /* Count from here: clear the firmware counters and queue depth. */
+    usbpic_read_stats(a, STATS_PAGE_TOTALS, 1, buf);
+    memset(buf, 0, 64);
+    buf[0] = 0xAD;
+    usbpic_transact(a, buf, 0);
+
+    a->adapter.flags = AD_PROBE | AD_ERASE | AD_READ | AD_WRITE | AD_SLOW_WRITE |
+        AD_READ_STREAM;
+    a->idcode = idcode;
 	
     /* User functions. */
     a->adapter.close = usbpic_close;
@@ -929,8 +2308,40 @@ adapter_t *adapter_open_usbpic(const char wires_mode){
     a->adapter.read_word = usbpic_read_word;
     a->adapter.read_data = usbpic_read_data;
     a->adapter.verify_data = usbpic_verify_data;
+    a->adapter.verify_crc = usbpic_verify_crc;
     a->adapter.erase_chip = usbpic_erase_chip;
     a->adapter.program_word = usbpic_program_word;
     a->adapter.program_row = usbpic_program_row;
+    a->adapter.program_quad_word = usbpic_program_quad_word;
+    a->adapter.blank_check = usbpic_blank_check;
+    a->adapter.erase_page = usbpic_erase_page;
+    a->adapter.erase_pages = usbpic_erase_pages;
+    a->adapter.encode_row = usbpic_encode_row;
+    a->adapter.replay = usbpic_replay;
+    a->adapter.ping = usbpic_ping;
+    a->adapter.print_stats = usbpic_print_stats;
+    a->adapter.crc_msec = 300;          // delays in usbpic_verify_data
+
+    if (a->panel) {
+        // Same operations on every device, rows by broadcast.
+        // The stream of reports is for a single device.
+        unsigned m;
+
+        for (m = a->panel; m; m &= m - 1)
+            a->adapter.ndevices++;
+        a->adapter.load_executive = panel_load_executive;
+        a->adapter.verify_data = panel_verify_data;
+        a->adapter.verify_crc = panel_verify_crc;
+        a->adapter.erase_chip = panel_erase_chip;
+        a->adapter.program_word = panel_program_word;
+        a->adapter.program_row = panel_program_row;
+        a->adapter.program_quad_word = panel_program_quad_word;
+        a->adapter.blank_check = panel_blank_check;
+        a->adapter.erase_page = panel_erase_page;
+        a->adapter.erase_pages = panel_erase_pages;
+        a->adapter.encode_row = 0;
+        a->adapter.replay = 0;
+        a->adapter.stream_protocol = 0;
+    }
     return &a->adapter;
 }
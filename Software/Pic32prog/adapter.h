@@ -12,11 +12,14 @@
 #define _ADAPTER_H
 
 #include <stdarg.h>
+#include "stream.h"
 
 #define AD_READ  0x0001
 #define AD_WRITE 0x0002
 #define AD_ERASE 0x0004
 #define AD_PROBE 0x0008
+#define AD_SLOW_WRITE 0x0010            /* Flash write without PE */
+#define AD_READ_STREAM 0x0020           /* Reads of any length at once */
 
 typedef struct _adapter_t adapter_t;
 
@@ -27,18 +30,32 @@ struct _adapter_t {
 
     unsigned flags;
     const char *family_name;            /* Name of pic32 family */
+    unsigned report_words;              /* Data words per transaction (0 = 1) */
+    unsigned crc_msec;                  /* Fixed time of a verify_data call */
+    unsigned stream_protocol;           /* Format of encoded reports, 0 = none */
+    unsigned ndevices;                  /* Devices written at once, 0 = 1 */
 
     void (*close) (adapter_t *a, int power_on);
     unsigned (*get_idcode) (adapter_t *a);
     void (*load_executive) (adapter_t *a, const unsigned *pe, unsigned nwords, unsigned pe_version);
     void (*read_data) (adapter_t *a, unsigned addr, unsigned nwords, unsigned *data);
     void (*verify_data) (adapter_t *a, unsigned addr, unsigned nwords, unsigned *data);
+    int (*verify_crc) (adapter_t *a, unsigned addr, unsigned nwords, unsigned crc);
     void (*program_block) (adapter_t *a, unsigned addr, unsigned *data);
     void (*program_quad_word) (adapter_t *a, unsigned addr, unsigned word0, unsigned word1, unsigned word2, unsigned word3);
     void (*program_row) (adapter_t *a, unsigned addr, unsigned *data, unsigned words_per_row);
     void (*program_word) (adapter_t *a, unsigned addr, unsigned word);
     unsigned (*read_word) (adapter_t *a, unsigned addr);
     void (*erase_chip) (adapter_t *a);
+    void (*erase_page) (adapter_t *a, unsigned addr);
+    void (*erase_pages) (adapter_t *a, unsigned addr, unsigned npages);  /* With PE */
+    int (*blank_check) (adapter_t *a, unsigned addr, unsigned nwords);
+    void (*ping) (adapter_t *a);
+    void (*print_stats) (adapter_t *a);  /* Counters of the adapter firmware */
+
+    /* Row programming with PE, as a stream of reports. */
+    void (*encode_row) (adapter_t *a, stream_t *s, unsigned addr, unsigned *data, unsigned words_per_row);
+    void (*replay) (adapter_t *a, const stream_t *s, void (*row_done) (unsigned addr, unsigned nbytes));
 };
 
 adapter_t *adapter_open_usbpic (const char wires_mode);
@@ -54,5 +71,9 @@ adapter_t *adapter_open_pickit (void);
 
 void mdelay (unsigned msec);
 extern int debug_level;
+extern const char *cache_dir;
+const char *default_cache_dir (void);   /* When cache_dir is not given */
+extern int chain_tap;                   /* PIC32 of a JTAG chain, or -1 */
+#define CHAIN_ALL   (-2)                /* All identical PIC32s at once */
 
 #endif
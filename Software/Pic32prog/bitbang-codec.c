@@ -0,0 +1,168 @@
+/*
+ * Packed binary protocol of the 'ascii ICSP' bitbang adapter.
+ *
+ * In ASCII mode every TMS/TDI pair takes a character and every
+ * TDO bit comes back as a character. Packed mode sends four pairs
+ * per byte and returns eight TDO bits per byte; the control
+ * commands and the '>'/'<' handshake are kept as they are.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include "bitbang-codec.h"
+
+int bb_pairs (unsigned char *pairs, unsigned tms_nbits, unsigned tms,
+    unsigned tdi_nbits, unsigned long long tdi, int read_flag)
+{
+    int n = 0;
+    unsigned i;
+
+    for (i = tms_nbits; i > 0; i--) {
+        pairs[n++] = tms & 1;
+        tms >>= 1;
+    }
+    if (tdi_nbits != 0) {                       // 1-0-0
+        pairs[n++] = BB_TMS;
+        pairs[n++] = 0;
+        pairs[n++] = read_flag ? BB_READ : 0;
+    }
+    for (i = tdi_nbits; i > 0; i--) {
+        pairs[n++] = ((tdi & 1) ? BB_TDI : 0) | (i == 1 ? BB_TMS : 0) |
+                     ((read_flag == 1 && i != 1) ? BB_READ : 0);
+        tdi >>= 1;
+    }
+    if (tdi_nbits != 0) {                       // 1-0
+        pairs[n++] = BB_TMS;
+        pairs[n++] = 0;
+    }
+    return n;
+}
+
+/*
+ * Length of the frame starting at the pair:
+ * a run of pairs with the same read flag.
+ */
+static int frame_length (const unsigned char *pairs, int npairs)
+{
+    int n;
+
+    for (n = 1; n < npairs && n < BB_MAX_FRAME; n++)
+        if ((pairs[n] ^ pairs[0]) & BB_READ)
+            break;
+    return n;
+}
+
+int bb_encode (const unsigned char *pairs, int npairs, unsigned char *out)
+{
+    int nbytes = 0, n, i;
+
+    while (npairs > 0) {
+        n = frame_length (pairs, npairs);
+        out[nbytes++] = 0x80 | ((pairs[0] & BB_READ) ? 0x40 : 0) | (n - 1);
+        for (i = 0; i < n; i++) {
+            if (i % 4 == 0)
+                out[nbytes++] = 0;
+            out[nbytes-1] |= (pairs[i] & (BB_TMS | BB_TDI)) << (2 * (i % 4));
+        }
+        pairs += n;
+        npairs -= n;
+    }
+    return nbytes;
+}
+
+int bb_reply_bytes (const unsigned char *pairs, int npairs, int packed)
+{
+    int nbytes = 0, n;
+
+    while (npairs > 0) {
+        n = packed ? frame_length (pairs, npairs) : 1;
+        if (pairs[0] & BB_READ) {
+            if (packed)
+                nbytes += (n + 7) / 8;
+            else
+                nbytes++;
+        }
+        pairs += n;
+        npairs -= n;
+    }
+    return nbytes;
+}
+
+int bb_decode_reply (const unsigned char *pairs, int npairs, int packed,
+    const unsigned char *in, unsigned long long *tdo)
+{
+    int nbits = 0, n, i;
+
+    *tdo = 0;
+    while (npairs > 0) {
+        n = packed ? frame_length (pairs, npairs) : 1;
+        if (pairs[0] & BB_READ) {
+            for (i = 0; i < n; i++) {
+                int bit;
+
+                if (packed)
+                    bit = (in[i / 8] >> (i % 8)) & 1;
+                else if (*in == '0' || *in == '1')
+                    bit = *in - '0';
+                else
+                    return -1;
+                if (bit)
+                    *tdo |= 1ULL << nbits;
+                nbits++;
+            }
+            in += packed ? (n + 7) / 8 : 1;
+        }
+        pairs += n;
+        npairs -= n;
+    }
+    return nbits;
+}
+
+int bb_decode (const unsigned char *in, int *nbytes,
+    unsigned char *pairs, int maxpairs)
+{
+    int pos = 0, npairs = 0, n, i, read;
+
+    while (pos < *nbytes && (in[pos] & 0x80)) {
+        read = (in[pos] & 0x40) ? BB_READ : 0;
+        n = (in[pos] & 0x3f) + 1;
+        if (pos + 1 + (n + 3) / 4 > *nbytes || npairs + n > maxpairs)
+            return -1;
+        pos++;
+        for (i = 0; i < n; i++)
+            pairs[npairs++] = ((in[pos + i/4] >> (2 * (i % 4))) & 3) | read;
+        pos += (n + 3) / 4;
+    }
+    *nbytes = pos;
+    return npairs;
+}
+
+int bb_encode_reply (const unsigned char *pairs, int npairs,
+    const unsigned char *bits, unsigned char *out)
+{
+    int nbytes = 0, n, i;
+
+    while (npairs > 0) {
+        n = frame_length (pairs, npairs);
+        if (pairs[0] & BB_READ) {
+            for (i = 0; i < n; i++) {
+                if (i % 8 == 0)
+                    out[nbytes++] = 0;
+                if (bits[i])
+                    out[nbytes-1] |= 1 << (i % 8);
+            }
+        }
+        pairs += n;
+        bits += n;
+        npairs -= n;
+    }
+    return nbytes;
+}
+
+unsigned bb_pair_rate (unsigned baud, unsigned npairs, unsigned nbytes)
+{
+    if (nbytes == 0)
+        return 0;
+    return (unsigned long long) baud / 10 * npairs / nbytes;
+}
@@ -0,0 +1,82 @@
+/*
+ * Packed binary protocol of the 'ascii ICSP' bitbang adapter.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _BITBANG_CODEC_H
+#define _BITBANG_CODEC_H
+
+/*
+ * One TMS/TDI bit pair, with a flag to read TDO.
+ * TMS and TDI have the same values as in ASCII commands 'd'..'g'.
+ */
+#define BB_TMS          1
+#define BB_TDI          2
+#define BB_READ         4
+
+#define BB_MAX_PAIRS    (14 + 3 + 64 + 2)   /* Largest bitbang_send() */
+#define BB_MAX_FRAME    64                  /* Pairs in a packed frame */
+
+/*
+ * Command to switch the adapter to the packed protocol,
+ * answered by the same character.
+ */
+#define BB_NEGOTIATE    '!'
+
+/*
+ * Build the bit pairs of a JTAG transaction: TMS header, then
+ * TDI data with TMS 1-0-0 before and 1-0 after it.
+ * When read_flag is 1, TDO is read on the last header bit and
+ * on all data bits but the last; when 2, only on the last header bit.
+ * Return the number of pairs.
+ */
+int bb_pairs (unsigned char *pairs, unsigned tms_nbits, unsigned tms,
+    unsigned tdi_nbits, unsigned long long tdi, int read_flag);
+
+/*
+ * Encode pairs as packed frames. A frame is a byte 0x80 + read*0x40 +
+ * (npairs - 1), followed by four pairs per byte, LSB first.
+ * Bytes below 0x80 stay ASCII commands ('>', '8' and so on).
+ * Return the number of bytes.
+ */
+int bb_encode (const unsigned char *pairs, int npairs, unsigned char *out);
+
+/*
+ * Size of the TDO reply: one byte per bit in ASCII mode,
+ * eight bits per byte for every read frame in packed mode.
+ */
+int bb_reply_bytes (const unsigned char *pairs, int npairs, int packed);
+
+/*
+ * Decode the TDO reply. Return -1 on a bad character,
+ * else the number of bits.
+ */
+int bb_decode_reply (const unsigned char *pairs, int npairs, int packed,
+    const unsigned char *in, unsigned long long *tdo);
+
+/*
+ * Reference decoder, as done by the adapter firmware.
+ * Decode packed frames from the stream, until a byte below 0x80
+ * or the end. Return the number of pairs, *nbytes is set to the
+ * number of bytes consumed; -1 on a truncated frame.
+ */
+int bb_decode (const unsigned char *in, int *nbytes,
+    unsigned char *pairs, int maxpairs);
+
+/*
+ * Reference encoder of the reply: TDO bits of the read pairs,
+ * in bits[] one per pair, packed per frame. Return the number of bytes.
+ */
+int bb_encode_reply (const unsigned char *pairs, int npairs,
+    const unsigned char *bits, unsigned char *out);
+
+/*
+ * Pairs per second on a link of the given baud rate, at the
+ * measured ratio of pairs per byte sent (8N1 framing).
+ */
+unsigned bb_pair_rate (unsigned baud, unsigned npairs, unsigned nbytes);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * Cache of parsed code files.
+ *
+ * The image of a HEX/SREC/ELF file is stored on disk, keyed by
+ * a hash of the file contents. Later the dirty maps and the row CRCs
+ * are appended for every family row size the image was written with.
+ * A cache file is a header followed by sections:
+ *      EXTENT  - contents of a region, from offset, length bytes;
+ *      DIRTY   - dirty map of a region for a row size and devcfg
+ *                offset, one byte per row, followed by the CRC
+ *                of every row, 16 bits each.
+ * Sections are padded to a multiple of 4 bytes.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#   include <io.h>
+#else
+#   include <sys/mman.h>
+#endif
+#ifndef O_BINARY
+#   define O_BINARY 0
+#endif
+
+#include "cache.h"
+#include "adapter.h"
+
+#define CACHE_VERSION   1
+#define CACHE_BLOCK     128             /* Granularity of extents */
+
+#define SECT_EXTENT     1
+#define SECT_DIRTY      2
+
+typedef struct {
+    char            magic [4];          /* "P32C" */
+    unsigned        version;
+    unsigned        key_lo;             /* Hash of the file contents */
+    unsigned        key_hi;
+    unsigned        src_bytes;          /* Size of the file */
+    unsigned        total_bytes;        /* Bytes stored by the parser */
+    unsigned        used;               /* Bit per region */
+} cache_header_t;
+
+typedef struct {
+    unsigned        tag;                /* SECT_xxx */
+    unsigned        region;             /* CACHE_FLASH or CACHE_BOOT */
+    unsigned        offset;             /* EXTENT: start in the region */
+    unsigned        length;             /* EXTENT: bytes, DIRTY: rows */
+    unsigned        row_bytes;          /* DIRTY: row size */
+    unsigned        devcfg_offset;      /* DIRTY: devcfg offset in boot */
+    unsigned        nbytes;             /* Size of the payload */
+} cache_section_t;
+
+static char cache_path [1024];          /* Empty when no cache */
+static unsigned long long cache_key;
+static unsigned cache_src_bytes;
+static int cache_valid;                 /* Cache file is for this key */
+static unsigned char *cache_base;       /* Mapped cache file */
+static unsigned cache_nbytes;
+
+#define ALIGN4(n)       (((n) + 3) & ~3)
+
+/*
+ * Map a whole file into memory, read only.
+ * Return 0 when the file cannot be mapped.
+ * Used by the ELF loader too.
+ */
+unsigned char *map_file (const char *filename, unsigned *nbytes)
+{
+    struct stat st;
+    unsigned char *base;
+    int fd;
+
+    fd = open (filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return 0;
+    if (fstat (fd, &st) < 0 || st.st_size == 0) {
+        close (fd);
+        return 0;
+    }
+#ifdef _WIN32
+    HANDLE h = CreateFileMapping ((HANDLE) _get_osfhandle (fd),
+        0, PAGE_READONLY, 0, 0, 0);
+    base = 0;
+    if (h) {
+        base = MapViewOfFile (h, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle (h);
+    }
+#else
+    base = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        base = 0;
+#endif
+    close (fd);
+    *nbytes = st.st_size;
+    return base;
+}
+
+void unmap_file (unsigned char *base, unsigned nbytes)
+{
+#ifdef _WIN32
+    UnmapViewOfFile (base);
+#else
+    munmap (base, nbytes);
+#endif
+}
+
+/*
+ * CRC16-CCITT, as computed by the PE.
+ */
+unsigned cache_crc (unsigned crc, const unsigned char *data, unsigned nbytes)
+{
+    static const unsigned short crc_table [16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    };
+    unsigned i;
+
+    while (nbytes--) {
+        i = (crc >> 12) ^ (*data >> 4);
+        crc = crc_table[i & 0x0F] ^ (crc << 4);
+        i = (crc >> 12) ^ (*data >> 0);
+        crc = crc_table[i & 0x0F] ^ (crc << 4);
+        data++;
+    }
+    return crc & 0xffff;
+}
+
+/*
+ * FNV-1a hash of the file contents.
+ */
+static unsigned long long hash_data (const unsigned char *data, unsigned nbytes)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    while (nbytes--) {
+        hash ^= *data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Find next section of the mapped cache file.
+ * Return 0 at the end of file or on a broken section.
+ */
+static cache_section_t *next_section (unsigned *pos)
+{
+    cache_section_t *s;
+
+    if (*pos + sizeof (cache_section_t) > cache_nbytes)
+        return 0;
+    s = (cache_section_t*) (cache_base + *pos);
+    if (s->nbytes > cache_nbytes - *pos - sizeof (cache_section_t))
+        return 0;
+    *pos += sizeof (cache_section_t) + s->nbytes;
+    return s;
+}
+
+int cache_open (const char *dir, char *filename,
+    cache_region_t *region, int *total_bytes)
+{
+    unsigned char *src;
+    unsigned pos;
+    cache_header_t *h;
+    cache_section_t *s;
+
+    if (! dir || strcmp (filename, "-") == 0)
+        return 0;
+    src = map_file (filename, &cache_src_bytes);
+    if (! src)
+        return 0;
+    cache_key = hash_data (src, cache_src_bytes);
+    unmap_file (src, cache_src_bytes);
+
+#ifdef _WIN32
+    mkdir (dir);
+#else
+    mkdir (dir, 0777);
+#endif
+    snprintf (cache_path, sizeof (cache_path), "%s/%08x%08x.p32c", dir,
+        (unsigned) (cache_key >> 32), (unsigned) cache_key);
+
+    cache_base = map_file (cache_path, &cache_nbytes);
+    if (! cache_base)
+        return 0;
+    h = (cache_header_t*) cache_base;
+    if (cache_nbytes < sizeof (*h) || memcmp (h->magic, "P32C", 4) != 0 ||
+        h->version != CACHE_VERSION || h->src_bytes != cache_src_bytes ||
+        h->key_lo != (unsigned) cache_key ||
+        h->key_hi != (unsigned) (cache_key >> 32)) {
+        /* Stale or foreign file: rebuild. */
+        unmap_file (cache_base, cache_nbytes);
+        cache_base = 0;
+        return 0;
+    }
+
+    pos = sizeof (*h);
+    while ((s = next_section (&pos)) != 0) {
+        if (s->tag != SECT_EXTENT)
+            continue;
+        if (s->region > CACHE_BOOT || s->length > s->nbytes ||
+            s->offset + s->length > region[s->region].nbytes) {
+            fprintf (stderr, "%s: broken cache file\n", cache_path);
+            unmap_file (cache_base, cache_nbytes);
+            cache_base = 0;
+            return 0;
+        }
+        memcpy (region[s->region].data + s->offset, s + 1, s->length);
+    }
+    region[CACHE_FLASH].used = h->used & 1;
+    region[CACHE_BOOT].used = h->used >> 1 & 1;
+    *total_bytes = h->total_bytes;
+    cache_valid = 1;
+    if (debug_level > 0)
+        fprintf (stderr, "cache: image loaded from %s\n", cache_path);
+    return 1;
+}
+
+static int write_section (FILE *fd, cache_section_t *s, const void *data)
+{
+    static const unsigned char pad [4];
+
+    if (fwrite (s, sizeof (*s), 1, fd) != 1)
+        return 0;
+    if (s->length > 0 && fwrite (data, s->length, 1, fd) != 1)
+        return 0;
+    if (s->nbytes > s->length && fwrite (pad, s->nbytes - s->length, 1, fd) != 1)
+        return 0;
+    return 1;
+}
+
+/*
+ * Is there any loaded data in the block?
+ */
+static int block_used (const unsigned char *data, unsigned nbytes)
+{
+    while (nbytes--)
+        if (*data++ != 0xff)
+            return 1;
+    return 0;
+}
+
+void cache_save (cache_region_t *region, int total_bytes)
+{
+    char tmp [sizeof (cache_path) + 8];
+    cache_header_t h;
+    cache_section_t s;
+    FILE *fd;
+    unsigned r, offset, end;
+    int ok;
+
+    if (! cache_path[0] || cache_valid)
+        return;
+    snprintf (tmp, sizeof (tmp), "%s.%u", cache_path, (unsigned) getpid ());
+    fd = fopen (tmp, "wb");
+    if (! fd) {
+        perror (tmp);
+        return;
+    }
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, "P32C", 4);
+    h.version = CACHE_VERSION;
+    h.key_lo = cache_key;
+    h.key_hi = cache_key >> 32;
+    h.src_bytes = cache_src_bytes;
+    h.total_bytes = total_bytes;
+    h.used = region[CACHE_FLASH].used | region[CACHE_BOOT].used << 1;
+    ok = (fwrite (&h, sizeof (h), 1, fd) == 1);
+
+    /* Extents: runs of blocks with any data. */
+    for (r=CACHE_FLASH; r<=CACHE_BOOT && ok; r++) {
+        const unsigned char *data = region[r].data;
+
+        for (offset=0; offset<region[r].nbytes && ok; offset=end) {
+            if (! block_used (data + offset, CACHE_BLOCK)) {
+                end = offset + CACHE_BLOCK;
+                continue;
+            }
+            end = offset + CACHE_BLOCK;
+            while (end < region[r].nbytes && block_used (data + end, CACHE_BLOCK))
+                end += CACHE_BLOCK;
+
+            memset (&s, 0, sizeof (s));
+            s.tag = SECT_EXTENT;
+            s.region = r;
+            s.offset = offset;
+            s.length = end - offset;
+            s.nbytes = ALIGN4 (s.length);
+            ok = write_section (fd, &s, data + offset);
+        }
+    }
+    if (fclose (fd) != 0)
+        ok = 0;
+
+    /* Replace the old file; another process may have done it already. */
+    if (ok) {
+        unlink (cache_path);
+        if (rename (tmp, cache_path) == 0)
+            cache_valid = 1;
+    }
+    unlink (tmp);
+}
+
+int cache_get_dirty (int r, unsigned row_bytes, unsigned devcfg_offset,
+    unsigned nbytes, unsigned char *dirty, const unsigned short **crc)
+{
+    unsigned pos = sizeof (cache_header_t);
+    unsigned nrows = nbytes / row_bytes;
+    cache_section_t *s;
+
+    if (! cache_base)
+        return 0;
+    while ((s = next_section (&pos)) != 0) {
+        if (s->tag != SECT_DIRTY || s->region != (unsigned) r ||
+            s->row_bytes != row_bytes || s->devcfg_offset != devcfg_offset ||
+            s->length != nrows ||
+            s->nbytes != ALIGN4 (nrows) + ALIGN4 (nrows * 2))
+            continue;
+        memcpy (dirty, s + 1, nrows);
+        *crc = (const unsigned short*) ((unsigned char*) (s + 1) + ALIGN4 (nrows));
+        return 1;
+    }
+    return 0;
+}
+
+void cache_put_dirty (int r, unsigned row_bytes, unsigned devcfg_offset,
+    unsigned nbytes, const unsigned char *dirty, const unsigned char *data)
+{
+    unsigned nrows = nbytes / row_bytes;
+    unsigned i, size = ALIGN4 (nrows) + ALIGN4 (nrows * 2);
+    unsigned char *payload;
+    unsigned short *crc;
+    cache_section_t s;
+    FILE *fd;
+
+    if (! cache_valid)
+        return;
+    payload = calloc (1, size);
+    if (! payload) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-1);
+    }
+    memcpy (payload, dirty, nrows);
+    crc = (unsigned short*) (payload + ALIGN4 (nrows));
+    for (i=0; i<nrows; i++) {
+        if (dirty [i])
+            crc [i] = cache_crc (0xffff, data + i * row_bytes, row_bytes);
+    }
+
+    memset (&s, 0, sizeof (s));
+    s.tag = SECT_DIRTY;
+    s.region = r;
+    s.length = nrows;
+    s.row_bytes = row_bytes;
+    s.devcfg_offset = devcfg_offset;
+    s.nbytes = size;
+
+    /* The section is written with one call, so that concurrent
+     * writers do not mix their data. */
+    fd = fopen (cache_path, "ab");
+    if (fd) {
+        unsigned char *buf = malloc (sizeof (s) + size);
+
+        if (buf) {
+            memcpy (buf, &s, sizeof (s));
+            memcpy (buf + sizeof (s), payload, size);
+            fwrite (buf, sizeof (s) + size, 1, fd);
+            free (buf);
+        }
+        fclose (fd);
+    }
+    free (payload);
+}
@@ -0,0 +1,60 @@
+/*
+ * Cache of parsed code files.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#define CACHE_FLASH     0
+#define CACHE_BOOT      1
+
+/*
+ * Memory image, as filled by the file parser.
+ */
+typedef struct {
+    unsigned char   *data;              /* Contents, 0xff when not loaded */
+    unsigned        nbytes;             /* Size of the buffer */
+    unsigned        used;               /* Has data from the file */
+} cache_region_t;
+
+/*
+ * Load the image of the file from the cache.
+ * Return 0 on cache miss; the key is kept for cache_save().
+ */
+int cache_open (const char *dir, char *filename,
+    cache_region_t *region, int *total_bytes);
+
+/*
+ * Store the parsed image, after a miss in cache_open().
+ */
+void cache_save (cache_region_t *region, int total_bytes);
+
+/*
+ * Get the dirty map and row CRCs of a memory region, for a family
+ * with the given row size and devcfg offset.
+ * Return 0 when not cached yet.
+ */
+int cache_get_dirty (int r, unsigned row_bytes, unsigned devcfg_offset,
+    unsigned nbytes, unsigned char *dirty, const unsigned short **crc);
+
+/*
+ * Add the dirty map of a memory region to the cache,
+ * with CRCs of the dirty rows.
+ */
+void cache_put_dirty (int r, unsigned row_bytes, unsigned devcfg_offset,
+    unsigned nbytes, const unsigned char *dirty, const unsigned char *data);
+
+/*
+ * Map a whole file into memory, read only.
+ * Return 0 when the file cannot be mapped.
+ */
+unsigned char *map_file (const char *filename, unsigned *nbytes);
+void unmap_file (unsigned char *base, unsigned nbytes);
+
+unsigned cache_crc (unsigned crc, const unsigned char *data, unsigned nbytes);
+
+#endif
@@ -39,6 +39,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <wchar.h>
@@ -67,11 +68,21 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Input reports received from the device are kept in a ring of
+   preallocated slots. The libusb callback is the only producer and
+   hid_read_timeout() the only consumer, so the ring needs no lock:
+   each side owns one index and publishes it with release semantics.
+   The size must be a power of two. */
+#define NUM_SLOTS 64
+
+/* Interrupt IN transfers kept in flight at the same time, so that
+   the device can complete the next report while the callback of
+   the previous one is still running. */
+#define NUM_TRANSFERS 4
+
 struct input_report {
-	uint8_t *data;
 	size_t len;
-	struct input_report *next;
+	uint8_t *data;
 };
 
 
@@ -97,20 +108,31 @@ struct hid_device_ {
 
 	/* Read thread objects */
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Used only to sleep on condition */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
-	struct libusb_transfer *transfer;
-
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	int waiting; /* The reader sleeps on condition */
+	struct libusb_transfer *transfers[NUM_TRANSFERS];
+	int transfers_active;
+
+	/* Events are handled by hid_read_timeout() instead of read_thread() */
+	int low_latency;
+
+	/* Ring of received input reports. */
+	struct input_report slots[NUM_SLOTS];
+	uint8_t *slot_data;
+	unsigned head; /* Next slot to fill, written by read_callback() */
+	unsigned tail; /* Next slot to return, advanced by the reader,
+	                  or by read_callback() dropping the oldest */
+	unsigned dropped;
 };
 
 static libusb_context *usb_context = NULL;
 
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static void read_callback(struct libusb_transfer *transfer);
 
 static hid_device *new_hid_device(void)
 {
@@ -642,45 +664,42 @@ static void read_callback(struct libusb_transfer *transfer)
 	int res;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
+		unsigned head = dev->head;
+		unsigned tail = __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE);
+		struct input_report *rpt;
+
+		/* When the ring is full, the user never reads anything
+		   from the device: pop the oldest report, so that the
+		   latest ones are kept. The reader may take it at the
+		   same time, then its tail update fails and it retries. */
+		while (head - tail >= NUM_SLOTS) {
+			if (__atomic_compare_exchange_n(&dev->tail, &tail, tail + 1,
+			    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				dev->dropped++;
+				LOG("Input ring full, %u reports dropped\n", dev->dropped);
+				break;
+			}
+		}
+		rpt = &dev->slots[head % NUM_SLOTS];
 		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
 		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
 
-		pthread_mutex_lock(&dev->mutex);
-
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
+		/* Publish the slot, then wake the reader if it
+		   went to sleep on an empty ring. */
+		__atomic_store_n(&dev->head, head + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&dev->waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&dev->mutex);
 			pthread_cond_signal(&dev->condition);
+			pthread_mutex_unlock(&dev->mutex);
 		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}
-		}
-		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		dev->transfers_active--;
 		dev->shutdown_thread = 1;
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		dev->transfers_active--;
 		dev->shutdown_thread = 1;
 		return;
 	}
@@ -691,36 +710,93 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 
+	/* Being cancelled: a report which arrived meanwhile
+	   must not re-arm the transfer, let it drain. */
+	if (dev->shutdown_thread) {
+		dev->transfers_active--;
+		return;
+	}
+
 	/* Re-submit the transfer object. */
 	res = libusb_submit_transfer(transfer);
 	if (res != 0) {
 		LOG("Unable to submit URB. libusb error code: %d\n", res);
+		dev->transfers_active--;
 		dev->shutdown_thread = 1;
 	}
 }
 
+/* Allocate the ring and the transfer objects. */
+static void alloc_transfers(hid_device *dev)
+{
+	const size_t length = dev->input_ep_max_packet_size;
+	int i;
+
+	dev->slot_data = malloc(NUM_SLOTS * length);
+	for (i = 0; i < NUM_SLOTS; i++)
+		dev->slots[i].data = dev->slot_data + i * length;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		dev->transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_interrupt_transfer(dev->transfers[i],
+			dev->device_handle,
+			dev->input_endpoint,
+			malloc(length),
+			length,
+			read_callback,
+			dev,
+			5000/*timeout*/);
+	}
+}
+
+/* Submit all the transfers. Further submissions are made
+   from inside read_callback(). */
+static void submit_transfers(hid_device *dev)
+{
+	int i;
+
+	dev->shutdown_thread = 0;
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (libusb_submit_transfer(dev->transfers[i]) == 0)
+			dev->transfers_active++;
+	}
+}
+
+/* Cancel the transfers and wait for their completion.
+   Must be called from the thread which handles the events. */
+static void cancel_transfers(hid_device *dev)
+{
+	int i;
+
+	/* No more submissions from read_callback(). The cancel
+	   calls fail for the transfers which are not pending,
+	   but that's OK. */
+	dev->shutdown_thread = 1;
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
+
+	while (dev->transfers_active > 0) {
+		if (libusb_handle_events(usb_context) < 0)
+			break;
+	}
+}
+
+static void free_transfers(hid_device *dev)
+{
+	int i;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		free(dev->transfers[i]->buffer);
+		libusb_free_transfer(dev->transfers[i]);
+	}
+	free(dev->slot_data);
+}
 
 static void *read_thread(void *param)
 {
 	hid_device *dev = param;
-	unsigned char *buf;
-	const size_t length = dev->input_ep_max_packet_size;
 
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	submit_transfers(dev);
 
 	// Notify the main thread that the read thread is up and running.
 	pthread_barrier_wait(&dev->barrier);
@@ -743,12 +819,8 @@ static void *read_thread(void *param)
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	if (libusb_cancel_transfer(dev->transfer) == 0) {
-		/* The transfer was cancelled, so wait for its completion. */
-		libusb_handle_events(usb_context);
-	}
+	/* Cancel any transfer that may be pending. */
+	cancel_transfers(dev);
 
 	/* Now that the read thread is stopping, Wake any threads which are
 	   waiting on data (in hid_read_timeout()). Do this under a mutex to
@@ -759,13 +831,13 @@ static void *read_thread(void *param)
 	pthread_cond_broadcast(&dev->condition);
 	pthread_mutex_unlock(&dev->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+	/* The transfer buffers and objects are cleaned up in hid_close().
+	   They are not cleaned up here because this thread could end
+	   either due to a disconnect or due to a user call to hid_close().
+	   In both cases the objects can be safely cleaned up after the
+	   call to pthread_join() (in hid_close()), but since hid_close()
+	   calls libusb_cancel_transfer(), on these objects, they can not
+	   be cleaned up here. */
 
 	return NULL;
 }
@@ -875,6 +947,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
+						alloc_transfers(dev);
 						pthread_create(&dev->thread, NULL, read_thread, dev);
 
 						// Wait here for the read thread to be initialized.
@@ -950,28 +1023,103 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
+int HID_API_EXPORT hid_write_many(hid_device *dev, const unsigned char *data, size_t length, int count)
+{
+	int n;
+
+	/* The interrupt transfers are synchronous: just send them in a row. */
+	for (n = 0; n < count; n++) {
+		if (hid_write(dev, data + n*length, length) < 0)
+			return (n > 0) ? n : -1;
+	}
+	return n;
+}
+
 /* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
+   Return the oldest report of the ring, or -1 when it is empty.
+   This should be called only by the reader. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
-	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
-	return len;
+	unsigned tail, head;
+	struct input_report *rpt;
+	size_t len;
+
+	for (;;) {
+		/* Sequentially consistent with the waiting flag:
+		   a report published after the flag was raised
+		   is either seen here or wakes us up. */
+		tail = __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&dev->head, __ATOMIC_SEQ_CST);
+		if (head == tail)
+			return -1;
+
+		/* Copy the data out of the slot into the return buffer,
+		   and give the slot back to read_callback(). When the
+		   callback has dropped this report meanwhile, the copy
+		   may be torn: take the next one. */
+		rpt = &dev->slots[tail % NUM_SLOTS];
+		len = (length < rpt->len)? length: rpt->len;
+		if (len > 0)
+			memcpy(data, rpt->data, len);
+		if (__atomic_compare_exchange_n(&dev->tail, &tail, tail + 1,
+		    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return len;
+	}
 }
 
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
+	__atomic_store_n(&dev->waiting, 0, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&dev->mutex);
 }
 
+/* Low latency mode: there is no read thread, the caller of
+   hid_read_timeout() handles the libusb events itself, so a report
+   is returned straight from the callback context. */
+static int read_events(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	struct timeval tv, start, now;
+	int bytes_read, res;
+	long elapsed;
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		bytes_read = return_data(dev, data, length);
+		if (bytes_read >= 0)
+			return bytes_read;
+		if (dev->shutdown_thread)
+			return -1;
+
+		if (milliseconds < 0) {
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+		}
+		else {
+			gettimeofday(&now, NULL);
+			elapsed = (now.tv_sec - start.tv_sec) * 1000L +
+				(now.tv_usec - start.tv_usec) / 1000;
+			if (elapsed >= milliseconds && milliseconds > 0)
+				return 0;
+			tv.tv_sec = (milliseconds - elapsed) / 1000;
+			tv.tv_usec = (milliseconds - elapsed) % 1000 * 1000;
+		}
+		res = libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+		if (res < 0 &&
+		    res != LIBUSB_ERROR_BUSY &&
+		    res != LIBUSB_ERROR_TIMEOUT &&
+		    res != LIBUSB_ERROR_OVERFLOW &&
+		    res != LIBUSB_ERROR_INTERRUPTED) {
+			LOG("read_events(): libusb reports error # %d\n", res);
+			return -1;
+		}
+		if (milliseconds == 0) {
+			/* Purely non-blocking: one pass of the events. */
+			bytes_read = return_data(dev, data, length);
+			return (bytes_read < 0) ? 0 : bytes_read;
+		}
+	}
+}
 
 int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
 {
@@ -984,33 +1132,42 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	return transferred;
 #endif
 
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	bytes_read = return_data(dev, data, length);
+	if (bytes_read >= 0)
+		return bytes_read;
+
+	if (dev->low_latency)
+		return read_events(dev, data, length, milliseconds);
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
+	}
+
+	if (milliseconds == 0) {
+		/* Purely non-blocking */
+		return 0;
 	}
 
+	/* Go to sleep until read_callback() publishes a report.
+	   The waiting flag is raised before the ring is checked again,
+	   so that the callback either sees the flag or we see the report. */
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+	__atomic_store_n(&dev->waiting, 1, __ATOMIC_SEQ_CST);
+
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			pthread_cond_wait(&dev->condition, &dev->mutex);
-		}
-		if (dev->input_reports) {
+		for (;;) {
 			bytes_read = return_data(dev, data, length);
+			if (bytes_read >= 0 || dev->shutdown_thread)
+				break;
+			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
 	}
-	else if (milliseconds > 0) {
+	else {
 		/* Non-blocking, but called with timeout. */
 		int res;
 		struct timespec ts;
@@ -1022,42 +1179,54 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		for (;;) {
+			bytes_read = return_data(dev, data, length);
+			if (bytes_read >= 0 || dev->shutdown_thread)
+				break;
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
-
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
+			if (res == ETIMEDOUT) {
 				/* Timed out. */
-				bytes_read = 0;
+				bytes_read = return_data(dev, data, length);
+				if (bytes_read < 0)
+					bytes_read = 0;
 				break;
 			}
-			else {
+			else if (res != 0) {
 				/* Error. */
 				bytes_read = -1;
 				break;
 			}
+
+			/* If we're here, there was a wake up for a new
+			   report, a spurious one or the read thread was
+			   shutdown. Run the loop again. */
 		}
 	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
-	}
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(1);
 
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char *data, size_t length, int count, int milliseconds)
+{
+	int n, res;
+
+	if (count <= 0)
+		return 0;
+
+	/* Wait for the first report, then take the rest of the ring. */
+	res = hid_read_timeout(dev, data, length, milliseconds);
+	if (res <= 0)
+		return res;
+
+	for (n = 1; n < count; n++) {
+		if (return_data(dev, data + n*length, length) < 0)
+			break;
+	}
+	return n;
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
@@ -1070,6 +1239,31 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0;
 }
 
+int HID_API_EXPORT hid_set_low_latency(hid_device *dev, int enable)
+{
+	if (!enable == !dev->low_latency)
+		return 0;
+
+	if (enable) {
+		/* Stop the read thread; it cancels the transfers on exit. */
+		dev->shutdown_thread = 1;
+		libusb_cancel_transfer(dev->transfers[0]);
+		pthread_join(dev->thread, NULL);
+
+		dev->low_latency = 1;
+		submit_transfers(dev);
+		if (dev->transfers_active == 0)
+			return -1;
+	}
+	else {
+		cancel_transfers(dev);
+		dev->low_latency = 0;
+		pthread_create(&dev->thread, NULL, read_thread, dev);
+		pthread_barrier_wait(&dev->barrier);
+	}
+	return 0;
+}
+
 
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
@@ -1137,16 +1331,21 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	if (dev->low_latency) {
+		/* No read thread: cancel the transfers here. */
+		cancel_transfers(dev);
+	}
+	else {
+		/* Cause read_thread() to stop. */
+		dev->shutdown_thread = 1;
+		libusb_cancel_transfer(dev->transfers[0]);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
+	}
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Clean up the Transfer objects allocated in hid_open_path(). */
+	free_transfers(dev);
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1154,13 +1353,6 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
 	free_hid_device(dev);
 }
 
@@ -44,6 +44,14 @@
 
 #include "hidapi.h"
 
+/* Define HAVE_LIBURING (and link with -luring) to submit the bursts
+   of hid_write_many() with a single io_uring_enter() call. Without it
+   the reports are written one by one. */
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#define URING_DEPTH 32
+#endif
+
 /* Definitions from linux/hidraw.h. Since these are new, some distros
    may not have header files which contain them. */
 #ifndef HIDIOCSFEATURE
@@ -57,6 +65,10 @@ struct hid_device_ {
 	int device_handle;
 	int blocking;
 	int uses_numbered_reports;
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	int ring_state; /* 0 - not yet, 1 - ready, -1 - unavailable */
+#endif
 };
 
 
@@ -423,7 +435,10 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	}
 
 	// OPEN HERE //
-	dev->device_handle = open(path, O_RDWR);
+	/* The node is always non-blocking: blocking reads wait in poll(),
+	   so that hid_read_many() can drain the queue until EAGAIN
+	   without changing the file flags. */
+	dev->device_handle = open(path, O_RDWR | O_NONBLOCK);
 
 	// If we have a good handle, return it.
 	if (dev->device_handle > 0) {
@@ -471,11 +486,93 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	return bytes_written;
 }
 
+#ifdef HAVE_LIBURING
+/* Write up to URING_DEPTH reports with one system call. The writes
+   are linked, so they reach the device in order and a failure
+   cancels the rest of the burst. */
+static int write_uring(hid_device *dev, const unsigned char *data, size_t length, int count)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int i, written = 0, failed = 0;
+
+	for (i = 0; i < count; i++) {
+		sqe = io_uring_get_sqe(&dev->ring);
+		io_uring_prep_write(sqe, dev->device_handle, data + i*length, length, 0);
+		if (i < count - 1)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+	if (io_uring_submit_and_wait(&dev->ring, count) < 0)
+		return -1;
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+	for (i = 0; i < count; i++) {
+		if (io_uring_wait_cqe(&dev->ring, &cqe) < 0)
+			return -1;
+		if (cqe->res < 0)
+			failed = 1;
+		else if (!failed)
+			written++;
+		io_uring_cqe_seen(&dev->ring, cqe);
+	}
+	return written;
+}
+#endif
+
+int HID_API_EXPORT hid_write_many(hid_device *dev, const unsigned char *data, size_t length, int count)
+{
+	int n;
+
+#ifdef HAVE_LIBURING
+	if (dev->ring_state == 0)
+		dev->ring_state = (io_uring_queue_init(URING_DEPTH, &dev->ring, 0) == 0) ? 1 : -1;
+
+	if (dev->ring_state > 0) {
+		int done = 0, res;
+
+		while (done < count) {
+			n = count - done;
+			if (n > URING_DEPTH)
+				n = URING_DEPTH;
+			res = write_uring(dev, data + done*length, length, n);
+			if (res < 0)
+				return (done > 0) ? done : -1;
+			done += res;
+			if (res < n)
+				break;
+		}
+		return done;
+	}
+#endif
+	for (n = 0; n < count; n++) {
+		if (write(dev->device_handle, data + n*length, length) < 0)
+			return (n > 0) ? n : -1;
+	}
+	return n;
+}
+
+
+/* Read one report without waiting. Return 0 when none is queued. */
+static int read_report(hid_device *dev, unsigned char *data, size_t length)
 {
 	int bytes_read;
 
+	bytes_read = read(dev->device_handle, data, length);
+	if (bytes_read < 0 && errno == EAGAIN)
+		bytes_read = 0;
+
+	if (bytes_read >= 0 &&
+	    kernel_version < KERNEL_VERSION(2,6,34) &&
+	    dev->uses_numbered_reports) {
+		/* Work around a kernel bug. Chop off the first byte. */
+		memmove(data, data+1, bytes_read);
+		bytes_read--;
+	}
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
 	if (milliseconds != 0) {
 		/* milliseconds is -1 or > 0. In both cases, we want to
 		   call poll() and wait for data to arrive. -1 means
@@ -492,19 +589,28 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			return ret;
 	}
 
-	bytes_read = read(dev->device_handle, data, length);
-	if (bytes_read < 0 && errno == EAGAIN)
-		bytes_read = 0;
+	return read_report(dev, data, length);
+}
 
-	if (bytes_read >= 0 &&
-	    kernel_version < KERNEL_VERSION(2,6,34) &&
-	    dev->uses_numbered_reports) {
-		/* Work around a kernel bug. Chop off the first byte. */
-		memmove(data, data+1, bytes_read);
-		bytes_read--;
-	}
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char *data, size_t length, int count, int milliseconds)
+{
+	int n, res;
 
-	return bytes_read;
+	if (count <= 0)
+		return 0;
+
+	/* Wait for the first report, as hid_read_timeout() does. */
+	res = hid_read_timeout(dev, data, length, milliseconds);
+	if (res <= 0)
+		return res;
+
+	/* Then take everything already queued, in the same wake-up. */
+	for (n = 1; n < count; n++) {
+		res = read_report(dev, data + n*length, length);
+		if (res <= 0)
+			break;
+	}
+	return n;
 }
 
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
@@ -514,28 +620,19 @@ int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
-	int flags, res;
+	/* The node is opened non-blocking, hid_read() polls
+	   when the handle is blocking. */
+	dev->blocking = !nonblock;
+	return 0; /* Success */
+}
 
-	flags = fcntl(dev->device_handle, F_GETFL, 0);
-	if (flags >= 0) {
-		if (nonblock)
-			res = fcntl(dev->device_handle, F_SETFL, flags | O_NONBLOCK);
-		else
-			res = fcntl(dev->device_handle, F_SETFL, flags & ~O_NONBLOCK);
-	}
-	else
-		return -1;
 
-	if (res < 0) {
-		return -1;
-	}
-	else {
-		dev->blocking = !nonblock;
-		return 0; /* Success */
-	}
+int HID_API_EXPORT hid_set_low_latency(hid_device *dev, int enable)
+{
+	/* Reads go straight to the hidraw node, there is no reader thread. */
+	return -1;
 }
 
-
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int res;
@@ -564,6 +661,10 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
+#ifdef HAVE_LIBURING
+	if (dev->ring_state > 0)
+		io_uring_queue_exit(&dev->ring);
+#endif
 	close(dev->device_handle);
 	free(dev);
 }
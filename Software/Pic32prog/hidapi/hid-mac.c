@@ -968,6 +968,36 @@ int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char *data, size_t length, int count, int milliseconds)
+{
+	int n, res;
+
+	if (count <= 0)
+		return 0;
+
+	/* Wait for the first report, then take the queued ones. */
+	res = hid_read_timeout(dev, data, length, milliseconds);
+	if (res <= 0)
+		return res;
+
+	for (n = 1; n < count; n++) {
+		if (hid_read_timeout(dev, data + n*length, length, 0) <= 0)
+			break;
+	}
+	return n;
+}
+
+int HID_API_EXPORT hid_write_many(hid_device *dev, const unsigned char *data, size_t length, int count)
+{
+	int n;
+
+	for (n = 0; n < count; n++) {
+		if (hid_write(dev, data + n*length, length) < 0)
+			return (n > 0) ? n : -1;
+	}
+	return n;
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	/* All Nonblocking operation is handled by the library. */
@@ -976,6 +1006,12 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0;
 }
 
+int HID_API_EXPORT hid_set_low_latency(hid_device *dev, int enable)
+{
+	/* Reports are delivered by the run loop of the reader thread. */
+	return -1;
+}
+
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	return set_report(dev, kIOHIDReportTypeFeature, data, length);
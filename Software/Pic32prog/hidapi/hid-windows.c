@@ -164,3 +164,34 @@ int hid_read_timeout (hid_device *device, unsigned char *data, size_t nbytes, in
     memcpy (data, buf + 1, bytes_read - 1);
     return bytes_read - 1;
 }
+
+HID_API_EXPORT HID_API_CALL
+int hid_read_many (hid_device *device, unsigned char *data, size_t nbytes, int count, int milliseconds)
+{
+    // ReadFile() cannot tell whether more reports are queued
+    // without waiting, so return them one at a time.
+    if (count <= 0)
+        return 0;
+    if (hid_read (device, data, nbytes) <= 0)
+        return -1;
+    return 1;
+}
+
+HID_API_EXPORT HID_API_CALL
+int hid_write_many (hid_device *device, const unsigned char *data, size_t nbytes, int count)
+{
+    int n;
+
+    for (n = 0; n < count; n++) {
+        if (hid_write (device, data + n*nbytes, nbytes) <= 0)
+            return (n > 0) ? n : -1;
+    }
+    return n;
+}
+
+HID_API_EXPORT HID_API_CALL
+int hid_set_low_latency (hid_device *device, int enable)
+{
+    // Reads are done by ReadFile() in the calling thread.
+    return -1;
+}
@@ -200,6 +200,24 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
 
+		/** @brief Write a burst of Output reports.
+
+			The reports are sent back to back, in order, with as few
+			system calls as the backend allows. Report i is taken
+			from data + i * length.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The reports to send.
+			@param length The size of one report, as for hid_write().
+			@param count The number of reports.
+
+			@returns
+				This function returns the number of reports written,
+				and -1 when none could be written.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_write_many(hid_device *device, const unsigned char *data, size_t length, int count);
+
 		/** @brief Read an Input report from a HID device with timeout.
 
 			Input reports are returned
@@ -239,6 +257,25 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *device, unsigned char *data, size_t length);
 
+		/** @brief Read several Input reports in one wake-up.
+
+			Waits for the first report like hid_read_timeout(), then
+			takes all the reports already queued, without waiting
+			again. Report i is stored at data + i * length.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer of count * length bytes.
+			@param length The size of one report.
+			@param count The maximum number of reports to read.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports read,
+				0 on timeout and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_many(hid_device *device, unsigned char *data, size_t length, int count, int milliseconds);
+
 		/** @brief Set the device handle to be non-blocking.
 
 			In non-blocking mode calls to hid_read() will return
@@ -259,6 +296,25 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *device, int nonblock);
 
+		/** @brief Handle the input reports in the thread which reads them.
+
+			In low latency mode there is no separate reader thread:
+			hid_read() and hid_read_timeout() run the USB event loop
+			themselves, so a report is returned without a thread
+			switch. Use it only when the device is read from a
+			single thread. Backends without a reader thread return -1.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param enable
+			 - 1 to enable low latency mode
+			 - 0 to go back to the reader thread.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_set_low_latency(hid_device *device, int enable);
+
 		/** @brief Send a Feature report to the device.
 
 			Feature reports are sent over the Control endpoint as a
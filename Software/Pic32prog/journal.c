@@ -0,0 +1,218 @@
+/*
+ * Journal of a programming session, for resuming after a failure.
+ *
+ * The journal is a text file next to the code file, one line per event:
+ *      pic32prog journal <cpuid> <key> <row bytes>
+ *      E                               - chip erased
+ *      P <region> <offset> <nbytes>    - rows programmed
+ *      V <region> <offset> <nbytes>    - rows verified
+ *      X <region> <offset> <nbytes>    - page erased
+ * Every line is flushed before the next operation starts,
+ * so the journal is valid whenever the programmer dies.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "localize.h"
+
+#define NREGIONS        2
+
+static FILE *fd;
+static char *path;
+static unsigned row_size;
+static unsigned nrows [NREGIONS];
+static unsigned char *state [NREGIONS];
+static int erased;
+static int torn;                        /* Last line was not complete */
+
+unsigned journal_key (unsigned key, const unsigned char *data, unsigned nbytes)
+{
+    /* FNV-1a */
+    if (key == 0)
+        key = 2166136261u;
+    while (nbytes--) {
+        key ^= *data++;
+        key *= 16777619u;
+    }
+    return key;
+}
+
+static void set_state (int r, unsigned offset, unsigned nbytes,
+    int set, int clear)
+{
+    unsigned i;
+
+    if (r < 0 || r >= NREGIONS)
+        return;
+    for (i = offset / row_size; i < (offset + nbytes) / row_size; i++) {
+        if (i >= nrows[r])
+            break;
+        state[r][i] = (state[r][i] | set) & ~clear;
+    }
+}
+
+/*
+ * Load the journal of an interrupted session.
+ */
+static int load (unsigned cpuid, unsigned key, unsigned row_bytes)
+{
+    FILE *in;
+    char line [80], op;
+    unsigned jcpuid, jkey, jrow, offset, nbytes;
+    int r;
+
+    in = fopen (path, "r");
+    if (! in)
+        return 0;
+    if (! fgets (line, sizeof (line), in) ||
+        sscanf (line, "pic32prog journal %x %x %x", &jcpuid, &jkey, &jrow) != 3 ||
+        jcpuid != cpuid || jkey != key || jrow != row_bytes) {
+        fprintf (stderr, _("%s: journal of another file or device\n"), path);
+        fclose (in);
+        return 0;
+    }
+    while (fgets (line, sizeof (line), in)) {
+        torn = (strchr (line, '\n') == 0);
+        if (torn)
+            break;
+        if (line[0] == 'E') {
+            erased = 1;
+            continue;
+        }
+        if (sscanf (line, "%c %d %x %x", &op, &r, &offset, &nbytes) != 4)
+            continue;
+        switch (op) {
+        case 'P':
+            set_state (r, offset, nbytes, JOURNAL_PROGRAMMED, 0);
+            break;
+        case 'V':
+            set_state (r, offset, nbytes, JOURNAL_VERIFIED, 0);
+            break;
+        case 'X':
+            set_state (r, offset, nbytes, 0, JOURNAL_PROGRAMMED | JOURNAL_VERIFIED);
+            break;
+        }
+    }
+    fclose (in);
+    return 1;
+}
+
+int journal_open (const char *filename, unsigned cpuid, unsigned key,
+    unsigned row_bytes, unsigned flash_bytes, unsigned boot_bytes, int resume)
+{
+    int r;
+
+    if (strcmp (filename, "-") == 0)
+        filename = "pic32prog";
+    path = malloc (strlen (filename) + 9);
+    if (! path) {
+        fprintf (stderr, _("Out of memory\n"));
+        exit (-1);
+    }
+    strcpy (path, filename);
+    strcat (path, ".journal");
+
+    row_size = row_bytes;
+    nrows [0] = flash_bytes / row_bytes;
+    nrows [1] = boot_bytes / row_bytes;
+    for (r=0; r<NREGIONS; r++) {
+        state[r] = calloc (nrows[r] + 1, 1);
+        if (! state[r]) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+    }
+    erased = 0;
+    torn = 0;
+    if (resume && ! load (cpuid, key, row_bytes)) {
+        journal_close (0);
+        return 0;
+    }
+
+    fd = fopen (path, resume ? "a" : "w");
+    if (! fd) {
+        perror (path);
+        exit (1);
+    }
+    if (! resume)
+        fprintf (fd, "pic32prog journal %08x %08x %x\n", cpuid, key, row_bytes);
+    else if (torn)
+        fputc ('\n', fd);
+    fflush (fd);
+    return 1;
+}
+
+static void put (char op, int r, unsigned offset, unsigned nbytes)
+{
+    if (! fd)
+        return;
+    fprintf (fd, "%c %d %x %x\n", op, r, offset, nbytes);
+    if (fflush (fd) != 0) {
+        perror (path);
+        exit (1);
+    }
+}
+
+void journal_mark (int r, unsigned offset, unsigned nbytes, int st)
+{
+    if (! fd)
+        return;
+    set_state (r, offset, nbytes, st, 0);
+    put (st == JOURNAL_VERIFIED ? 'V' : 'P', r, offset, nbytes);
+}
+
+void journal_forget (int r, unsigned offset, unsigned nbytes)
+{
+    if (! fd)
+        return;
+    set_state (r, offset, nbytes, 0, JOURNAL_PROGRAMMED | JOURNAL_VERIFIED);
+    put ('X', r, offset, nbytes);
+}
+
+void journal_erased ()
+{
+    if (! fd)
+        return;
+    erased = 1;
+    fprintf (fd, "E\n");
+    fflush (fd);
+}
+
+int journal_state (int r, unsigned offset)
+{
+    if (! fd || r < 0 || r >= NREGIONS || offset / row_size >= nrows[r])
+        return 0;
+    return state [r] [offset / row_size];
+}
+
+int journal_is_erased ()
+{
+    return fd && erased;
+}
+
+void journal_close (int done)
+{
+    int r;
+
+    if (fd) {
+        fclose (fd);
+        fd = 0;
+        if (done)
+            unlink (path);
+        else
+            fprintf (stderr, _("Session journal kept in %s, use --resume to continue.\n"), path);
+    }
+    for (r=0; r<NREGIONS; r++) {
+        free (state[r]);
+        state[r] = 0;
+    }
+    free (path);
+    path = 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Journal of a programming session, for resuming after a failure.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+/*
+ * State of a row.
+ */
+#define JOURNAL_PROGRAMMED  1
+#define JOURNAL_VERIFIED    2
+
+/*
+ * Hash of the image data, to match the journal with the file.
+ */
+unsigned journal_key (unsigned key, const unsigned char *data, unsigned nbytes);
+
+/*
+ * Start the journal of programming the file. When resume is set,
+ * load the journal left by an interrupted session instead.
+ * Regions are indexed by CACHE_FLASH and CACHE_BOOT.
+ * Return 0 when there is no journal to resume for this file and device.
+ */
+int journal_open (const char *filename, unsigned cpuid, unsigned key,
+    unsigned row_bytes, unsigned flash_bytes, unsigned boot_bytes, int resume);
+
+/*
+ * Record the state of rows, or the erase of the whole chip.
+ */
+void journal_mark (int r, unsigned offset, unsigned nbytes, int state);
+void journal_erased (void);
+
+/*
+ * Forget the rows of an erased page.
+ */
+void journal_forget (int r, unsigned offset, unsigned nbytes);
+
+/*
+ * Get the state of a row.
+ */
+int journal_state (int r, unsigned offset);
+int journal_is_erased (void);
+
+/*
+ * Close the journal. When the session is complete, remove it.
+ */
+void journal_close (int done);
+
+#endif
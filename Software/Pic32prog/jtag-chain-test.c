@@ -0,0 +1,315 @@
+/*
+ * Test of the JTAG daisy chain scans on a simulated chain:
+ * discovery, single TAP scans, and a row programmed by broadcast
+ * into several PIC32s, with faults injected in one of them.
+ *
+ * Usage: chain-test [ntaps]
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jtag-chain.h"
+#include "pic32.h"
+
+/*
+ * TAP controller states.
+ */
+enum {
+    TLR, RTI, SELDR, CAPDR, SHDR, EX1DR, PAUSEDR, EX2DR, UPDR,
+    SELIR, CAPIR, SHIR, EX1IR, PAUSEIR, EX2IR, UPIR,
+};
+
+static const unsigned char tap_next [16][2] = {
+    /* TMS=0    TMS=1 */
+    { RTI,      TLR   },    /* TLR */
+    { RTI,      SELDR },    /* RTI */
+    { CAPDR,    SELIR },    /* SELDR */
+    { SHDR,     EX1DR },    /* CAPDR */
+    { SHDR,     EX1DR },    /* SHDR */
+    { PAUSEDR,  UPDR  },    /* EX1DR */
+    { PAUSEDR,  EX2DR },    /* PAUSEDR */
+    { SHDR,     UPDR  },    /* EX2DR */
+    { RTI,      SELDR },    /* UPDR */
+    { CAPIR,    TLR   },    /* SELIR */
+    { SHIR,     EX1IR },    /* CAPIR */
+    { SHIR,     EX1IR },    /* SHIR */
+    { PAUSEIR,  UPIR  },    /* EX1IR */
+    { PAUSEIR,  EX2IR },    /* PAUSEIR */
+    { SHIR,     UPIR  },    /* EX2IR */
+    { RTI,      SELDR },    /* UPIR */
+};
+
+#define SIM_PIC32_ID    0x04a07053
+#define SIM_ROW_WORDS   32
+#define SIM_IRLEN       5
+
+/*
+ * A TAP with IDCODE and BYPASS; a PIC32 has the EJTAG Control, Data
+ * and Fast Data registers, and a PE which takes the row program
+ * command. The PE reads words through Fast Data, and posts the
+ * response for the probe to read through Data.
+ */
+typedef struct {
+    unsigned        idcode;         /* 0 - no IDCODE register */
+    unsigned        irlen;
+    int             pic32;
+    unsigned        fault;          /* Bits flipped in the PE response */
+    int             no_pracc;       /* PE never takes fast data */
+
+    int             state;
+    unsigned        ir, ir_shift;
+    unsigned long long dr_shift;
+    unsigned        dr_len;
+    int             pracc;          /* PrAcc at Capture-DR */
+
+    unsigned        pe_header;      /* Command and count of the PE */
+    unsigned        pe_left;        /* Words still expected */
+    unsigned        pe_response;
+    int             pe_posted;      /* Response waits for the probe */
+    unsigned        row_addr;
+    unsigned        row [SIM_ROW_WORDS];
+    unsigned        nrow;
+} sim_tap_t;
+
+typedef struct {
+    int             ntaps;
+    sim_tap_t       tap [CHAIN_MAX_TAPS];
+} sim_chain_t;
+
+/*
+ * The PE got a fast data word.
+ */
+static void pe_word (sim_tap_t *p, unsigned word)
+{
+    if (p->pe_left == 0) {
+        p->pe_header = word;
+        p->pe_left = (word & 0xffff) + 1;
+        p->nrow = 0;
+        return;
+    }
+    if (p->nrow == 0 && p->pe_left == (p->pe_header & 0xffff) + 1)
+        p->row_addr = word;
+    else if (p->nrow < SIM_ROW_WORDS)
+        p->row [p->nrow++] = word;
+    if (--p->pe_left == 0) {
+        p->pe_response = (p->pe_header & 0xffff0000) ^ p->fault;
+        p->pe_posted = 1;
+    }
+}
+
+static int pe_wants_data (sim_tap_t *p)
+{
+    return ! p->no_pracc && ! p->pe_posted;
+}
+
+/*
+ * Rising edge of TCK: act on the current state, then move.
+ */
+static void sim_clock (sim_tap_t *p, int tms, int tdi)
+{
+    switch (p->state) {
+    case TLR:
+        p->ir = p->idcode ? ETAP_IDCODE : (1u << p->irlen) - 1;
+        break;
+    case CAPDR:
+        p->dr_len = 1;
+        p->dr_shift = 0;
+        if (p->idcode && p->ir == ETAP_IDCODE) {
+            p->dr_shift = p->idcode;
+            p->dr_len = 32;
+        } else if (p->pic32 && p->ir == ETAP_FASTDATA) {
+            p->pracc = pe_wants_data (p);
+            p->dr_shift = p->pracc;
+            p->dr_len = 33;
+        } else if (p->pic32 && p->ir == ETAP_CONTROL) {
+            p->pracc = p->pe_posted;
+            p->dr_shift = CONTROL_PROBEN | CONTROL_PROBTRAP |
+                (p->pracc ? CONTROL_PRACC : 0);
+            p->dr_len = 32;
+        } else if (p->pic32 && p->ir == ETAP_DATA) {
+            p->dr_shift = p->pe_response;
+            p->dr_len = 32;
+        }
+        break;
+    case SHDR:
+        p->dr_shift = p->dr_shift >> 1 |
+            (unsigned long long) tdi << (p->dr_len - 1);
+        break;
+    case UPDR:
+        if (p->pic32 && p->ir == ETAP_FASTDATA && p->pracc)
+            pe_word (p, p->dr_shift >> 1);
+        if (p->pic32 && p->ir == ETAP_CONTROL && p->pracc &&
+            ! (p->dr_shift & CONTROL_PRACC))
+            p->pe_posted = 0;
+        break;
+    case CAPIR:
+        p->ir_shift = 1;
+        break;
+    case SHIR:
+        p->ir_shift = p->ir_shift >> 1 | tdi << (p->irlen - 1);
+        break;
+    case UPIR:
+        p->ir = p->ir_shift;
+        break;
+    }
+    p->state = tap_next [p->state][tms];
+}
+
+static int sim_tdo (sim_tap_t *p)
+{
+    if (p->state == SHDR)
+        return p->dr_shift & 1;
+    if (p->state == SHIR)
+        return p->ir_shift & 1;
+    return 1;                       /* Not driven, pulled up */
+}
+
+static int sim_shift (void *arg, unsigned nbits,
+    const unsigned char *tms, const unsigned char *tdi, unsigned char *tdo)
+{
+    sim_chain_t *sim = arg;
+    int out [CHAIN_MAX_TAPS], ms, di, t;
+    unsigned n;
+
+    for (n=0; n<nbits; n++) {
+        ms = tms [n/8] >> (n & 7) & 1;
+        di = tdi [n/8] >> (n & 7) & 1;
+
+        /* TDO of all TAPs before the edge. */
+        for (t=0; t<sim->ntaps; t++)
+            out[t] = sim_tdo (&sim->tap[t]);
+        if (tdo) {
+            if (out[0])
+                tdo [n/8] |= 1 << (n & 7);
+            else
+                tdo [n/8] &= ~(1 << (n & 7));
+        }
+        for (t=0; t<sim->ntaps; t++)
+            sim_clock (&sim->tap[t], ms, (t == sim->ntaps-1) ? di : out[t+1]);
+    }
+    return 1;
+}
+
+static int check (int ok, const char *what)
+{
+    printf ("    %-32s %s\n", what, ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+/*
+ * Program a row into the broadcast TAPs, as the adapter does.
+ * Return the mask of the TAPs which failed.
+ */
+static unsigned program_row (chain_t *c, unsigned addr, const unsigned *data,
+    unsigned *response)
+{
+    unsigned header [2], fail;
+
+    header[0] = PE_ROW_PROGRAM << 16 | SIM_ROW_WORDS;
+    header[1] = addr;
+    if (! chain_broadcast_command (c, ETAP_FASTDATA))
+        return c->broadcast;
+    fail = chain_broadcast_fastdata (c, header, 2);
+    fail |= chain_broadcast_fastdata (c, data, SIM_ROW_WORDS);
+    fail |= chain_broadcast_response (c, PE_ROW_PROGRAM << 16, response);
+    return fail;
+}
+
+static int row_written (sim_tap_t *p, unsigned addr, const unsigned *data)
+{
+    return p->row_addr == addr && p->nrow == SIM_ROW_WORDS &&
+        memcmp (p->row, data, sizeof (p->row)) == 0;
+}
+
+int main (int argc, char **argv)
+{
+    static sim_chain_t sim;
+    chain_t c;
+    unsigned data [SIM_ROW_WORDS], response [CHAIN_MAX_TAPS], fail, i;
+    unsigned long long value;
+    int ntaps, t, other, faulty, first, ok, errors = 0;
+
+    ntaps = (argc > 1) ? atoi (argv[1]) : 4;
+    if (ntaps < 1 || ntaps >= CHAIN_MAX_TAPS) {
+        fprintf (stderr, "chain: from 1 to %d simulated TAPs\n",
+            CHAIN_MAX_TAPS - 1);
+        return 1;
+    }
+
+    /* PIC32 TAPs, and another TAP without IDCODE in the middle. */
+    sim.ntaps = ntaps + 1;
+    other = ntaps / 2;
+    faulty = sim.ntaps - 1;
+    first = (other == 0) ? 1 : 0;
+    for (t=0; t<sim.ntaps; t++) {
+        sim.tap[t].state = TLR;
+        if (t == other) {
+            sim.tap[t].irlen = 4;
+            continue;
+        }
+        sim.tap[t].idcode = SIM_PIC32_ID;
+        sim.tap[t].irlen = SIM_IRLEN;
+        sim.tap[t].pic32 = 1;
+    }
+    printf ("Simulated chain: %d PIC32 TAPs, other TAP %d, faults in TAP %d\n",
+        ntaps, other, faulty);
+
+    /* Discovery. */
+    ok = (chain_discover (&c, sim_shift, &sim) == sim.ntaps);
+    for (t=0; ok && t<sim.ntaps; t++)
+        if (c.idcode[t] != sim.tap[t].idcode || c.irlen[t] != sim.tap[t].irlen)
+            ok = 0;
+    errors += check (ok, "discovery");
+    if (! ok)
+        return 1;
+
+    /* IDCODE of each TAP, the others in BYPASS. */
+    ok = 1;
+    for (t=0; t<sim.ntaps; t++) {
+        if (! sim.tap[t].idcode)
+            continue;
+        if (! chain_command (&c, t, ETAP_IDCODE) ||
+            ! chain_xfer_data (&c, t, 32, 0, &value) ||
+            value != sim.tap[t].idcode)
+            ok = 0;
+        chain_command (&c, t, (1 << SIM_IRLEN) - 1);
+    }
+    errors += check (ok, "IDCODE through BYPASS");
+
+    /* A row to all the PIC32 TAPs at once. */
+    for (i=0; i<SIM_ROW_WORDS; i++)
+        data[i] = 0x9e3779b9 * (i + 1);
+    ok = (chain_broadcast_select (&c, first) == ntaps);
+    fail = program_row (&c, 0x1d000200, data, response);
+    for (t=0; t<sim.ntaps; t++)
+        if (sim.tap[t].pic32 && ! row_written (&sim.tap[t], 0x1d000200, data))
+            ok = 0;
+    errors += check (ok && fail == 0, "broadcast row program");
+
+    /* Wrong PE response of one device. */
+    sim.tap[faulty].fault = 0x100;
+    fail = program_row (&c, 0x1d000400, data, response);
+    errors += check (fail == 1u << faulty &&
+        response[faulty] == ((PE_ROW_PROGRAM << 16) ^ 0x100),
+        "wrong response detected");
+    sim.tap[faulty].fault = 0;
+
+    /* One device does not take the data. */
+    sim.tap[faulty].no_pracc = 1;
+    fail = program_row (&c, 0x1d000600, data, response);
+    ok = (fail == 1u << faulty);
+    for (t=0; t<sim.ntaps; t++)
+        if (sim.tap[t].pic32 && t != faulty &&
+            ! row_written (&sim.tap[t], 0x1d000600, data))
+            ok = 0;
+    errors += check (ok, "missing PrAcc detected");
+
+    chain_print (&c);
+    printf ("Chain test %s\n", errors ? "FAILED" : "passed");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * JTAG daisy chain: discovery, bypass-aware scans and broadcast
+ * of fast data to identical devices.
+ *
+ * All scans start and end in Run-Test/Idle. The vectors are built
+ * here and clocked by the adapter, or by the simulated chain
+ * of jtag-chain-test.c.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jtag-chain.h"
+#include "pic32.h"
+
+#define SCAN_BYTES      (CHAIN_MAX_BITS / 8)
+#define MCHP_VENDOR     0x053       /* Manufacturer field of IDCODE */
+#define MCHP_IRLEN      5
+#define PE_READY_TRIES  150         /* PrAcc polls, as the adapter firmware */
+
+/*
+ * Vectors of one or more scans, built bit by bit.
+ */
+typedef struct {
+    unsigned        nbits;
+    unsigned char   tms [SCAN_BYTES];
+    unsigned char   tdi [SCAN_BYTES];
+    unsigned char   tdo [SCAN_BYTES];
+} scan_t;
+
+static void scan_bit (scan_t *s, int tms, int tdi)
+{
+    unsigned n = s->nbits++;
+
+    if (n >= CHAIN_MAX_BITS) {
+        fprintf (stderr, "chain: scan longer than %d bits\n", CHAIN_MAX_BITS);
+        exit (-1);
+    }
+    if (tms)
+        s->tms [n/8] |= 1 << (n & 7);
+    if (tdi)
+        s->tdi [n/8] |= 1 << (n & 7);
+}
+
+static int scan_tdo (scan_t *s, unsigned n)
+{
+    return (s->tdo [n/8] >> (n & 7)) & 1;
+}
+
+static unsigned long long scan_tdo_bits (scan_t *s, unsigned n, unsigned nbits)
+{
+    unsigned long long value = 0;
+    unsigned i;
+
+    for (i=0; i<nbits; i++)
+        value |= (unsigned long long) scan_tdo (s, n + i) << i;
+    return value;
+}
+
+/*
+ * Test-Logic-Reset, then Run-Test/Idle.
+ */
+static void scan_reset (scan_t *s)
+{
+    int i;
+
+    for (i=0; i<5; i++)
+        scan_bit (s, 1, 0);
+    scan_bit (s, 0, 0);
+}
+
+/*
+ * From Run-Test/Idle to Shift-IR (1100) or Shift-DR (100).
+ */
+static void scan_ir_begin (scan_t *s)
+{
+    scan_bit (s, 1, 0);
+    scan_bit (s, 1, 0);
+    scan_bit (s, 0, 0);
+    scan_bit (s, 0, 0);
+}
+
+static void scan_dr_begin (scan_t *s)
+{
+    scan_bit (s, 1, 0);
+    scan_bit (s, 0, 0);
+    scan_bit (s, 0, 0);
+}
+
+/*
+ * Leave the shift state on the last data bit, then Update
+ * and back to Run-Test/Idle.
+ */
+static void scan_end (scan_t *s)
+{
+    unsigned n = s->nbits - 1;
+
+    s->tms [n/8] |= 1 << (n & 7);
+    scan_bit (s, 1, 0);
+    scan_bit (s, 0, 0);
+}
+
+static int chain_shift (chain_t *c, scan_t *s)
+{
+    if (! c->shift (c->arg, s->nbits, s->tms, s->tdi, s->tdo)) {
+        fprintf (stderr, "chain: shift of %u bits failed\n", s->nbits);
+        return 0;
+    }
+    return 1;
+}
+
+int chain_discover (chain_t *c, chain_shift_t *shift, void *arg)
+{
+    scan_t s;
+    unsigned n, first, idcode, known, nunknown, pos;
+    int t, unknown = 0;
+
+    memset (c, 0, sizeof (*c));
+    c->shift = shift;
+    c->arg = arg;
+
+    /* After reset every TAP has IDCODE selected, or BYPASS when
+     * it has none. IDCODE always starts with 1, BYPASS captures 0.
+     * The ones shifted in mark the end of the chain. */
+    memset (&s, 0, sizeof (s));
+    scan_reset (&s);
+    scan_dr_begin (&s);
+    first = s.nbits;
+    for (n=0; n<32*(CHAIN_MAX_TAPS+1); n++)
+        scan_bit (&s, 0, 1);
+    scan_end (&s);
+    if (! chain_shift (c, &s))
+        return -1;
+    for (n=0; ; n += idcode ? 32 : 1) {
+        idcode = 0;
+        if (scan_tdo (&s, first + n)) {
+            idcode = scan_tdo_bits (&s, first + n, 32);
+            if (idcode == 0xffffffff)
+                break;
+        }
+        if (c->ntaps == CHAIN_MAX_TAPS) {
+            fprintf (stderr, "chain: more than %d TAPs\n", CHAIN_MAX_TAPS);
+            return -1;
+        }
+        c->idcode [c->ntaps++] = idcode;
+    }
+    if (c->ntaps == 0) {
+        fprintf (stderr, "chain: no TAPs found\n");
+        return -1;
+    }
+
+    /* Total IR length: zeros, then ones until they come out.
+     * This leaves all the TAPs in BYPASS. */
+    memset (&s, 0, sizeof (s));
+    scan_ir_begin (&s);
+    first = s.nbits;
+    for (n=0; n<2*CHAIN_MAX_IR; n++)
+        scan_bit (&s, 0, n >= CHAIN_MAX_IR);
+    scan_end (&s);
+    if (! chain_shift (c, &s))
+        return -1;
+    for (n=CHAIN_MAX_IR; n<2*CHAIN_MAX_IR; n++)
+        if (scan_tdo (&s, first + n))
+            break;
+    c->ir_total = n - CHAIN_MAX_IR;
+    if (n == 2*CHAIN_MAX_IR || c->ir_total < 2 * (unsigned) c->ntaps) {
+        fprintf (stderr, "chain: bad IR length\n");
+        return -1;
+    }
+
+    /* Split it between the TAPs. */
+    known = 0;
+    nunknown = 0;
+    for (t=0; t<c->ntaps; t++) {
+        if ((c->idcode[t] & 0xfff) == MCHP_VENDOR) {
+            c->irlen[t] = MCHP_IRLEN;
+            known += MCHP_IRLEN;
+        } else {
+            unknown = t;
+            nunknown++;
+        }
+    }
+    if (nunknown > 1 || known + 2*nunknown > c->ir_total ||
+        (nunknown == 0 && known != c->ir_total)) {
+        fprintf (stderr, "chain: cannot split %u IR bits between %d TAPs\n",
+            c->ir_total, c->ntaps);
+        return -1;
+    }
+    if (nunknown)
+        c->irlen[unknown] = c->ir_total - known;
+
+    /* Every IR must capture ...01. */
+    pos = first;
+    for (t=0; t<c->ntaps; t++) {
+        if (! scan_tdo (&s, pos) || scan_tdo (&s, pos + 1)) {
+            fprintf (stderr, "chain: bad IR capture of TAP %d\n", t);
+            return -1;
+        }
+        pos += c->irlen[t];
+    }
+    return c->ntaps;
+}
+
+void chain_print (chain_t *c)
+{
+    int t;
+
+    printf ("JTAG chain: %d TAP%s, %u IR bits\n", c->ntaps,
+        c->ntaps == 1 ? "" : "s", c->ir_total);
+    for (t=0; t<c->ntaps; t++) {
+        if (c->idcode[t])
+            printf ("    TAP %d: IDCODE %08x, IR %u bits%s\n", t, c->idcode[t],
+                c->irlen[t], (c->broadcast >> t & 1) ? ", broadcast" : "");
+        else
+            printf ("    TAP %d: no IDCODE, IR %u bits\n", t, c->irlen[t]);
+    }
+}
+
+void chain_position (chain_t *c, int tap, unsigned *ir_pre,
+    unsigned *ir_post, unsigned *dr_pre, unsigned *dr_post)
+{
+    int t;
+
+    *ir_pre = 0;
+    *ir_post = 0;
+    for (t=0; t<c->ntaps; t++) {
+        if (t < tap)
+            *ir_pre += c->irlen[t];
+        else if (t > tap)
+            *ir_post += c->irlen[t];
+    }
+    *dr_pre = tap;
+    *dr_post = c->ntaps - 1 - tap;
+}
+
+/*
+ * Same command to the selected TAPs, BYPASS to the others.
+ */
+static int chain_ir_scan (chain_t *c, unsigned mask, unsigned cmd)
+{
+    scan_t s;
+    unsigned i;
+    int t;
+
+    memset (&s, 0, sizeof (s));
+    scan_ir_begin (&s);
+    for (t=0; t<c->ntaps; t++)
+        for (i=0; i<c->irlen[t]; i++)
+            scan_bit (&s, 0, (mask >> t & 1) ? (cmd >> i & 1) : 1);
+    scan_end (&s);
+    return chain_shift (c, &s);
+}
+
+/*
+ * One data scan: nbits of value for every TAP in mask, one BYPASS
+ * bit for the others. The offset of the first bit of each TAP from
+ * the start of the scan is stored in pos.
+ * Return the length of the scan.
+ */
+static unsigned data_scan (chain_t *c, scan_t *s, unsigned mask,
+    unsigned nbits, unsigned long long value, unsigned *pos)
+{
+    unsigned start = s->nbits, i;
+    int t;
+
+    scan_dr_begin (s);
+    for (t=0; t<c->ntaps; t++) {
+        if (! (mask >> t & 1)) {
+            scan_bit (s, 0, 0);
+            continue;
+        }
+        pos[t] = s->nbits - start;
+        for (i=0; i<nbits; i++)
+            scan_bit (s, 0, value >> i & 1);
+    }
+    scan_end (s);
+    return s->nbits - start;
+}
+
+int chain_command (chain_t *c, int tap, unsigned cmd)
+{
+    return chain_ir_scan (c, 1 << tap, cmd);
+}
+
+int chain_xfer_data (chain_t *c, int tap, unsigned nbits,
+    unsigned long long data, unsigned long long *result)
+{
+    scan_t s;
+    unsigned pos [CHAIN_MAX_TAPS];
+
+    memset (&s, 0, sizeof (s));
+    data_scan (c, &s, 1 << tap, nbits, data, pos);
+    if (! chain_shift (c, &s))
+        return 0;
+    if (result)
+        *result = scan_tdo_bits (&s, pos[tap], nbits);
+    return 1;
+}
+
+int chain_broadcast_select (chain_t *c, int tap)
+{
+    int t, n = 0;
+
+    c->broadcast = 0;
+    if (! c->idcode[tap])
+        return 0;
+    for (t=0; t<c->ntaps; t++) {
+        if (c->idcode[t] == c->idcode[tap]) {
+            c->broadcast |= 1 << t;
+            n++;
+        }
+    }
+    return n;
+}
+
+int chain_broadcast_command (chain_t *c, unsigned cmd)
+{
+    return chain_ir_scan (c, c->broadcast, cmd);
+}
+
+/*
+ * Fast data scans carry PrAcc, then 32 data bits. The PrAcc
+ * shifted in is ignored by the target.
+ */
+unsigned chain_broadcast_fastdata (chain_t *c, const unsigned *words,
+    unsigned nwords)
+{
+    scan_t s;
+    unsigned pracc [CHAIN_MAX_TAPS], fail = 0, len, n, k;
+    int t;
+
+    /* As many scans per shift as fit. */
+    while (nwords > 0) {
+        memset (&s, 0, sizeof (s));
+        len = data_scan (c, &s, c->broadcast, 33,
+            (unsigned long long) words[0] << 1, pracc);
+        for (n=1; n<nwords && s.nbits + len <= CHAIN_MAX_BITS; n++)
+            data_scan (c, &s, c->broadcast, 33,
+                (unsigned long long) words[n] << 1, pracc);
+        if (! chain_shift (c, &s))
+            return c->broadcast;
+
+        for (k=0; k<n; k++)
+            for (t=0; t<c->ntaps; t++)
+                if ((c->broadcast >> t & 1) && ! scan_tdo (&s, k*len + pracc[t]))
+                    fail |= 1 << t;
+        words += n;
+        nwords -= n;
+    }
+    return fail;
+}
+
+/*
+ * Same 32-bit data scan to the TAPs of mask, which have
+ * the register selected; the captured values go to value.
+ */
+static int chain_scan_each (chain_t *c, unsigned mask, unsigned data,
+    unsigned *value)
+{
+    scan_t s;
+    unsigned pos [CHAIN_MAX_TAPS];
+    int t;
+
+    memset (&s, 0, sizeof (s));
+    data_scan (c, &s, mask, 32, data, pos);
+    if (! chain_shift (c, &s))
+        return 0;
+    for (t=0; t<c->ntaps; t++)
+        if (mask >> t & 1)
+            value[t] = scan_tdo_bits (&s, pos[t], 32);
+    return 1;
+}
+
+/*
+ * The PE response is read as the adapter firmware does it:
+ * wait for PrAcc in the EJTAG Control register, read the Data
+ * register, then clear PrAcc to complete the access.
+ */
+unsigned chain_broadcast_response (chain_t *c, unsigned expected,
+    unsigned *response)
+{
+    unsigned control [CHAIN_MAX_TAPS], value [CHAIN_MAX_TAPS];
+    unsigned ready = 0, fail, i;
+    int t;
+
+    if (! chain_broadcast_command (c, ETAP_CONTROL))
+        return c->broadcast;
+    for (i=0; i<PE_READY_TRIES && ready != c->broadcast; i++) {
+        if (! chain_scan_each (c, c->broadcast,
+            CONTROL_PRACC | CONTROL_PROBEN | CONTROL_PROBTRAP, control))
+            return c->broadcast;
+        for (t=0; t<c->ntaps; t++)
+            if ((c->broadcast >> t & 1) && (control[t] & CONTROL_PRACC))
+                ready |= 1 << t;
+    }
+    fail = c->broadcast & ~ready;
+    if (! ready)
+        return fail;
+    if (! chain_ir_scan (c, ready, ETAP_DATA) ||
+        ! chain_scan_each (c, ready, 0, value) ||
+        ! chain_ir_scan (c, ready, ETAP_CONTROL) ||
+        ! chain_scan_each (c, ready, CONTROL_PROBEN | CONTROL_PROBTRAP, control))
+        return c->broadcast;
+
+    for (t=0; t<c->ntaps; t++) {
+        if (! (ready >> t & 1))
+            continue;
+        if (response)
+            response[t] = value[t];
+        if (value[t] != expected)
+            fail |= 1 << t;
+    }
+    return fail;
+}
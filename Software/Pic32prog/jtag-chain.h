@@ -0,0 +1,91 @@
+/*
+ * JTAG daisy chain: discovery, bypass-aware scans and broadcast
+ * of fast data to identical devices.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _JTAG_CHAIN_H
+#define _JTAG_CHAIN_H
+
+#define CHAIN_MAX_TAPS      16
+#define CHAIN_MAX_IR        (CHAIN_MAX_TAPS * 8)    /* Total IR bits */
+#define CHAIN_MAX_BITS      4096                    /* Longest shift */
+
+/*
+ * Clock nbits TMS/TDI pairs, one bit per clock, LSB first.
+ * TDO of every clock is stored in tdo, when not null.
+ * Return 0 on failure.
+ */
+typedef int chain_shift_t (void *arg, unsigned nbits,
+    const unsigned char *tms, const unsigned char *tdi, unsigned char *tdo);
+
+/*
+ * TAPs are numbered from TDO: TAP 0 is read out first.
+ */
+typedef struct {
+    chain_shift_t   *shift;
+    void            *arg;
+    int             ntaps;
+    unsigned        idcode [CHAIN_MAX_TAPS];    /* 0 when in BYPASS after reset */
+    unsigned        irlen [CHAIN_MAX_TAPS];
+    unsigned        ir_total;
+    unsigned        broadcast;                  /* Mask of TAPs in broadcast */
+} chain_t;
+
+/*
+ * Find the TAPs of the chain: IDCODEs, then IR lengths.
+ * Microchip TAPs have a 5-bit IR; one other TAP of unknown
+ * IR length is allowed. Return the number of TAPs, or -1.
+ */
+int chain_discover (chain_t *c, chain_shift_t *shift, void *arg);
+
+void chain_print (chain_t *c);
+
+/*
+ * Padding of a single TAP for the adapter firmware: IR bits of
+ * the TAPs before (nearer TDO) and after it, and BYPASS bits.
+ */
+void chain_position (chain_t *c, int tap, unsigned *ir_pre,
+    unsigned *ir_post, unsigned *dr_pre, unsigned *dr_post);
+
+/*
+ * Send a command to one TAP, all others get BYPASS.
+ * Shift data through the register of one TAP and return
+ * the captured bits; the other TAPs must be in BYPASS.
+ */
+int chain_command (chain_t *c, int tap, unsigned cmd);
+int chain_xfer_data (chain_t *c, int tap, unsigned nbits,
+    unsigned long long data, unsigned long long *result);
+
+/*
+ * Select all the TAPs with the IDCODE of the given TAP for broadcast.
+ * Return the number of selected TAPs.
+ */
+int chain_broadcast_select (chain_t *c, int tap);
+
+/*
+ * Send the same command to all the broadcast TAPs.
+ */
+int chain_broadcast_command (chain_t *c, unsigned cmd);
+
+/*
+ * Shift the same fast data words into all the broadcast TAPs,
+ * one scan per word. The TAPs must have ETAP_FASTDATA selected.
+ * Return the mask of TAPs whose PrAcc was not set for some word.
+ */
+unsigned chain_broadcast_fastdata (chain_t *c, const unsigned *words,
+    unsigned nwords);
+
+/*
+ * Read the PE response of every broadcast TAP through the EJTAG
+ * Control and Data registers, and compare with the expected value.
+ * Return the mask of TAPs with a different response or no PrAcc;
+ * the responses are stored per TAP.
+ */
+unsigned chain_broadcast_response (chain_t *c, unsigned expected,
+    unsigned *response);
+
+#endif
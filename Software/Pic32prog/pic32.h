@@ -104,6 +104,7 @@ extern const unsigned pic32_pemz[];
 #define PE_PROGRAM_CLUSTER      0x9     /* Program N bytes */
 #define PE_GET_DEVICEID         0xA     /* Return the hardware ID of device */
 #define PE_CHANGE_CFG           0xB     /* Change PE settings */
+#define PE_QUAD_WORD_PGRM       0xD     /* Program 4 words (PIC32MZ) */
 
 /*-------------------------------------------------------------------
  * MX3/4/5/6/7 family.
@@ -19,11 +19,16 @@
 #include <time.h>
 #include <libgen.h>
 #include <locale.h>
+#include <pthread.h>
 
 #include "target.h"
 #include "serial.h"
 #include "localize.h"
 #include "adapter.h"
+#include "cache.h"
+#include "readback.h"
+#include "verify.h"
+#include "journal.h"
 
 #ifndef VERSION
 #define VERSION         "2.0."SVNVERSION
@@ -45,6 +50,7 @@ unsigned char boot_data [BOOT_BYTES];
 unsigned char flash_data [FLASH_BYTES];
 unsigned char boot_dirty [BOOT_BYTES / MINBLOCKSZ];
 unsigned char flash_dirty [FLASH_BYTES / MINBLOCKSZ];
+unsigned char todo [FLASH_BYTES / MINBLOCKSZ];  /* Dirty blocks not done yet */
 unsigned blocksz;               /* Size of flash memory block */
 unsigned boot_used;
 unsigned flash_used;
@@ -62,6 +68,17 @@ unsigned progress_count;
 int verify_only;
 int erase_only = 0;
 int skip_verify = 0;
+int explain;                    /* Print the plan */
+int adapter_stats;              /* Print the adapter counters at exit */
+int skip_blank;                 /* Omit 0xFF runs from HEX/SREC dumps */
+int compare;                    /* Verify by readback, map all mismatches */
+int pipeline;                   /* Parse and program concurrently */
+int resume;                     /* Continue an interrupted session */
+int chip_erase;                 /* Always erase the whole chip */
+const char *cache_dir;          /* Directory of parsed image cache */
+const char *stream_dir;         /* Directory of compiled report streams */
+int chain_tap = -1;             /* PIC32 of a JTAG chain, -1 = first, or CHAIN_ALL */
+const unsigned short *row_crc [2]; /* Cached CRCs of flash and boot rows */
 int debug_level;
 int power_on;
 target_t *target;
@@ -92,41 +109,196 @@ unsigned mseconds_elapsed (void *arg)
     return mseconds;
 }
 
+/*
+ * Images of a multi-image job. Every byte remembers the image
+ * which stored it, to catch images overlapping with different data.
+ */
+#define MAXIMAGES       255
+
+static char *image_name [MAXIMAGES];
+static int nimages;
+static int image_number;                /* Image being read, from 1 */
+static unsigned char *flash_owner;      /* Allocated for a job only */
+static unsigned char *boot_owner;
+
+/*
+ * Take a byte for the current image.
+ * Return 0 when an earlier image has the same data there.
+ */
+static int claim (unsigned char *owner, unsigned char *data,
+    unsigned offset, unsigned byte, unsigned address)
+{
+    if (owner [offset] && owner [offset] != image_number) {
+        if (data [offset] != byte) {
+            fprintf (stderr, _("%s: overlaps %s at address %08X\n"),
+                image_name [image_number - 1], image_name [owner [offset] - 1],
+                address);
+            exit (1);
+        }
+        return 0;
+    }
+    owner [offset] = image_number;
+    return 1;
+}
+
 void store_data (unsigned address, unsigned byte)
 {
+    unsigned char *data, *owner;
     unsigned offset;
 
     if (address >= BOOTV_BASE && address < BOOTV_BASE + BOOT_BYTES) {
         /* Boot code, virtual. */
         offset = address - BOOTV_BASE;
-        boot_data [offset] = byte;
+        data = boot_data;
+        owner = boot_owner;
         boot_used = 1;
 
     } else if (address >= BOOTP_BASE && address < BOOTP_BASE + BOOT_BYTES) {
         /* Boot code, physical. */
         offset = address - BOOTP_BASE;
-        boot_data [offset] = byte;
+        data = boot_data;
+        owner = boot_owner;
         boot_used = 1;
 
     } else if (address >= FLASHV_BASE && address < FLASHV_BASE + FLASH_BYTES) {
         /* Main flash memory, virtual. */
         offset = address - FLASHV_BASE;
-        flash_data [offset] = byte;
+        data = flash_data;
+        owner = flash_owner;
         flash_used = 1;
 
     } else if (address >= FLASHP_BASE && address < FLASHP_BASE + FLASH_BYTES) {
         /* Main flash memory, physical. */
         offset = address - FLASHP_BASE;
-        flash_data [offset] = byte;
+        data = flash_data;
+        owner = flash_owner;
         flash_used = 1;
     } else {
         /* Ignore incorrect data. */
         //fprintf (stderr, _("%08X: address out of flash memory\n"), address);
         return;
     }
+    if (owner && ! claim (owner, data, offset, byte, address))
+        return;
+    data [offset] = byte;
     total_bytes++;
 }
 
+/*
+ * Open the input file, "-" means standard input.
+ */
+static FILE *open_input (char *filename)
+{
+    FILE *fd;
+
+    if (strcmp (filename, "-") == 0)
+        return stdin;
+    fd = fopen (filename, "r");
+    if (! fd) {
+        perror (filename);
+        exit (1);
+    }
+    return fd;
+}
+
+static void close_input (FILE *fd)
+{
+    if (fd != stdin)
+        fclose (fd);
+}
+
+/*
+ * Check the first character of the file without consuming it,
+ * so that standard input can be tried with another format.
+ */
+static int probe_input (FILE *fd, int first)
+{
+    int c;
+
+    do {
+        c = getc (fd);
+    } while (c == '\n' || c == '\r');
+    if (c == EOF || c != first) {
+        if (c != EOF)
+            ungetc (c, fd);
+        close_input (fd);
+        return 0;
+    }
+    ungetc (c, fd);
+    return 1;
+}
+
+/*
+ * Pipelined mode: the file is parsed by a separate thread, while
+ * the device is being opened, erased and the PE loaded.
+ * For every memory region the parser keeps a frontier: the blocks
+ * below it are assumed final, and the programming stage takes them
+ * in address order. A record falling into a block already taken
+ * means the file is not sorted by address: the block is marked,
+ * and its page is erased and programmed again when the whole file
+ * is parsed.
+ */
+#define REGION_FLASH    0
+#define REGION_BOOT     1
+
+static pthread_t pipe_thread;
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_cond = PTHREAD_COND_INITIALIZER;
+static unsigned pipe_frontier [2];      /* Parsed up to this offset */
+static unsigned pipe_taken [2];         /* Handed to programming */
+static int pipe_done;                   /* Parser finished */
+static int pipe_status;                 /* Parser result */
+static unsigned char pipe_redo [FLASH_BYTES / MINBLOCKSZ]; /* Changed after taken */
+static char *pipe_filename;
+
+/*
+ * Called by the parser at the start of every data record.
+ */
+static void pipeline_mark (unsigned address, unsigned nbytes)
+{
+    unsigned offset, end;
+    int region;
+
+    if (address >= BOOTV_BASE && address < BOOTV_BASE + BOOT_BYTES) {
+        region = REGION_BOOT;
+        offset = address - BOOTV_BASE;
+    } else if (address >= BOOTP_BASE && address < BOOTP_BASE + BOOT_BYTES) {
+        region = REGION_BOOT;
+        offset = address - BOOTP_BASE;
+    } else if (address >= FLASHV_BASE && address < FLASHV_BASE + FLASH_BYTES) {
+        region = REGION_FLASH;
+        offset = address - FLASHV_BASE;
+    } else if (address >= FLASHP_BASE && address < FLASHP_BASE + FLASH_BYTES) {
+        region = REGION_FLASH;
+        offset = address - FLASHP_BASE;
+    } else
+        return;
+
+    pthread_mutex_lock (&pipe_lock);
+    offset -= offset % MINBLOCKSZ;
+    if (region == REGION_FLASH) {
+        for (end=offset; end<offset+nbytes && end<pipe_taken [region]; end+=MINBLOCKSZ)
+            pipe_redo [end / MINBLOCKSZ] = 1;
+    }
+    if (offset != pipe_frontier [region]) {
+        pipe_frontier [region] = offset;
+        pthread_cond_signal (&pipe_cond);
+    }
+    pthread_mutex_unlock (&pipe_lock);
+}
+
+/*
+ * Wait until the parser is done with the region below the end offset.
+ */
+static void pipeline_take (int region, unsigned end)
+{
+    pthread_mutex_lock (&pipe_lock);
+    while (! pipe_done && pipe_frontier [region] < end)
+        pthread_cond_wait (&pipe_cond, &pipe_lock);
+    pipe_taken [region] = end;
+    pthread_mutex_unlock (&pipe_lock);
+}
+
 /*
  * Read the S record file.
  */
@@ -138,16 +310,14 @@ int read_srec (char *filename)
     unsigned address;
     int bytes;
 
-    fd = fopen (filename, "r");
-    if (! fd) {
-        perror (filename);
-        exit (1);
-    }
+    fd = open_input (filename);
+    if (! probe_input (fd, 'S'))
+        return 0;
     while (fgets ((char*) buf, sizeof(buf), fd)) {
         if (buf[0] == '\n')
             continue;
         if (buf[0] != 'S') {
-            fclose (fd);
+            close_input (fd);
             return 0;
         }
         if (buf[1] == '7' || buf[1] == '8' || buf[1] == '9')
@@ -183,6 +353,9 @@ int read_srec (char *filename)
             data += 2;
             bytes -= 2;
 
+            if (pipeline)
+                pipeline_mark (address, bytes);
+
             while (bytes-- > 0) {
                 store_data (address++, HEX (data));
                 data += 2;
@@ -190,7 +363,7 @@ int read_srec (char *filename)
             break;
         }
     }
-    fclose (fd);
+    close_input (fd);
     return 1;
 }
 
@@ -204,17 +377,15 @@ int read_hex (char *filename)
     unsigned address, high;
     int bytes, i;
 
-    fd = fopen (filename, "r");
-    if (! fd) {
-        perror (filename);
-        exit (1);
-    }
+    fd = open_input (filename);
+    if (! probe_input (fd, ':'))
+        return 0;
     high = 0;
     while (fgets ((char*) buf, sizeof(buf), fd)) {
         if (buf[0] == '\n')
             continue;
         if (buf[0] != ':') {
-            fclose (fd);
+            close_input (fd);
             return 0;
         }
         if (! isxdigit (buf[1]) || ! isxdigit (buf[2]) ||
@@ -235,7 +406,7 @@ int read_hex (char *filename)
 	}
 
 	bytes = HEX (buf+1);
-	if (strlen ((char*) buf) < bytes * 2 + 11) {
+	if (strlen ((char*) buf) < (size_t) (bytes * 2 + 11)) {
             fprintf (stderr, _("%s: too short hex line\n"), filename);
             exit (1);
         }
@@ -271,172 +442,1276 @@ int read_hex (char *filename)
                 filename, record_type);
             exit (1);
         }
-        //printf ("%08x: %u bytes\n", address, bytes);
-        for (i=0; i<bytes; i++) {
-            store_data (address++, data [i]);
+        //printf ("%08x: %u bytes\n", address, bytes);
+        if (pipeline)
+            pipeline_mark (address, bytes);
+        for (i=0; i<bytes; i++) {
+            store_data (address++, data [i]);
+        }
+    }
+    close_input (fd);
+    return 1;
+}
+
+/*
+ * ELF32 file header and program header.
+ */
+typedef struct {
+    unsigned char   e_ident [16];
+    unsigned short  e_type;
+    unsigned short  e_machine;
+    unsigned        e_version;
+    unsigned        e_entry;
+    unsigned        e_phoff;
+    unsigned        e_shoff;
+    unsigned        e_flags;
+    unsigned short  e_ehsize;
+    unsigned short  e_phentsize;
+    unsigned short  e_phnum;
+    unsigned short  e_shentsize;
+    unsigned short  e_shnum;
+    unsigned short  e_shstrndx;
+} elf_ehdr_t;
+
+typedef struct {
+    unsigned        p_type;
+    unsigned        p_offset;
+    unsigned        p_vaddr;
+    unsigned        p_paddr;
+    unsigned        p_filesz;
+    unsigned        p_memsz;
+    unsigned        p_flags;
+    unsigned        p_align;
+} elf_phdr_t;
+
+#define ELFCLASS32      1
+#define ELFDATA2LSB     1
+#define EM_MIPS         8
+#define PT_LOAD         1
+
+/*
+ * Copy a segment to the memory window, containing it.
+ * Return 0 if the segment does not fit in one window.
+ */
+static int store_segment (unsigned address, const unsigned char *data,
+    unsigned nbytes)
+{
+    if (flash_owner) {
+        /* Byte by byte, checking for overlaps. */
+        return 0;
+    }
+    if (address >= BOOTV_BASE && address + nbytes <= BOOTV_BASE + BOOT_BYTES) {
+        memcpy (boot_data + address - BOOTV_BASE, data, nbytes);
+        boot_used = 1;
+    } else if (address >= BOOTP_BASE && address + nbytes <= BOOTP_BASE + BOOT_BYTES) {
+        memcpy (boot_data + address - BOOTP_BASE, data, nbytes);
+        boot_used = 1;
+    } else if (address >= FLASHV_BASE && address + nbytes <= FLASHV_BASE + FLASH_BYTES) {
+        memcpy (flash_data + address - FLASHV_BASE, data, nbytes);
+        flash_used = 1;
+    } else if (address >= FLASHP_BASE && address + nbytes <= FLASHP_BASE + FLASH_BYTES) {
+        memcpy (flash_data + address - FLASHP_BASE, data, nbytes);
+        flash_used = 1;
+    } else
+        return 0;
+    total_bytes += nbytes;
+    return 1;
+}
+
+/*
+ * Read ELF file: copy PT_LOAD segments by physical address.
+ */
+int read_elf (char *filename)
+{
+    unsigned char *base;
+    unsigned nbytes, i, k;
+    elf_ehdr_t *eh;
+    elf_phdr_t *ph;
+
+    if (strcmp (filename, "-") == 0)
+        return 0;
+    base = map_file (filename, &nbytes);
+    if (! base)
+        return 0;
+    eh = (elf_ehdr_t*) base;
+    if (nbytes < sizeof (elf_ehdr_t) ||
+        memcmp (eh->e_ident, "\177ELF", 4) != 0) {
+        unmap_file (base, nbytes);
+        return 0;
+    }
+    if (eh->e_ident[4] != ELFCLASS32 || eh->e_ident[5] != ELFDATA2LSB ||
+        eh->e_machine != EM_MIPS) {
+        fprintf (stderr, _("%s: not a 32-bit little-endian MIPS ELF file\n"),
+            filename);
+        exit (1);
+    }
+    if (eh->e_phentsize != sizeof (elf_phdr_t) ||
+        eh->e_phoff > nbytes ||
+        eh->e_phnum > (nbytes - eh->e_phoff) / sizeof (elf_phdr_t)) {
+        fprintf (stderr, _("%s: bad ELF program header\n"), filename);
+        exit (1);
+    }
+    ph = (elf_phdr_t*) (base + eh->e_phoff);
+    for (i=0; i<eh->e_phnum; i++, ph++) {
+        if (ph->p_type != PT_LOAD || ph->p_filesz == 0)
+            continue;
+        if (ph->p_offset > nbytes || ph->p_filesz > nbytes - ph->p_offset) {
+            fprintf (stderr, _("%s: ELF segment out of file\n"), filename);
+            exit (1);
+        }
+        if (pipeline)
+            pipeline_mark (ph->p_paddr, ph->p_filesz);
+        if (! store_segment (ph->p_paddr, base + ph->p_offset, ph->p_filesz)) {
+            /* Crosses the window border, or out of flash memory. */
+            for (k=0; k<ph->p_filesz; k++)
+                store_data (ph->p_paddr + k, base [ph->p_offset + k]);
+        }
+    }
+    unmap_file (base, nbytes);
+    return 1;
+}
+
+/*
+ * Read a code file of any format.
+ */
+static void read_image (char *filename)
+{
+    if (! read_elf (filename) &&
+        ! read_srec (filename) &&
+        ! read_hex (filename)) {
+        fprintf (stderr, _("%s: bad file format\n"), filename);
+        exit (1);
+    }
+}
+
+static void add_image (char *filename)
+{
+    if (nimages >= MAXIMAGES) {
+        fprintf (stderr, _("Too many images\n"));
+        exit (1);
+    }
+    image_name [nimages++] = filename;
+}
+
+/*
+ * Read a job manifest: names of image files, one per line.
+ * Blank lines and lines starting with # are skipped. Relative
+ * names are taken from the directory of the manifest.
+ */
+static void read_manifest (char *filename)
+{
+    char line [1024], *name, *end, *dir, *path;
+    FILE *fd;
+
+    fd = fopen (filename, "r");
+    if (! fd) {
+        perror (filename);
+        exit (1);
+    }
+    path = strdup (filename);
+    dir = path ? dirname (path) : ".";
+    while (fgets (line, sizeof (line), fd)) {
+        for (name=line; *name == ' ' || *name == '\t'; name++)
+            continue;
+        end = name + strlen (name);
+        while (end > name && (end[-1] == '\n' || end[-1] == '\r' ||
+            end[-1] == ' ' || end[-1] == '\t'))
+            *--end = 0;
+        if (*name == 0 || *name == '#')
+            continue;
+        if (*name == '/' || strcmp (dir, ".") == 0 ||
+            (name[0] && name[1] == ':'))
+            end = strdup (name);
+        else {
+            end = malloc (strlen (dir) + strlen (name) + 2);
+            if (end)
+                sprintf (end, "%s/%s", dir, name);
+        }
+        if (! end) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+        add_image (end);
+    }
+    fclose (fd);
+}
+
+/*
+ * Merge the images of a job into one: files given on the command
+ * line, or listed in @manifest files. Images may overlap only
+ * with the same data, like configuration words present in both
+ * a bootloader and an application.
+ */
+static void read_job (int argc, char **argv)
+{
+    int i, nbytes;
+
+    for (i=0; i<argc; i++) {
+        if (argv[i][0] == '@')
+            read_manifest (argv[i] + 1);
+        else
+            add_image (argv[i]);
+    }
+    if (nimages == 0) {
+        fprintf (stderr, _("%s: no image files\n"), argv[0] + 1);
+        exit (1);
+    }
+    flash_owner = calloc (FLASH_BYTES, 1);
+    boot_owner = calloc (BOOT_BYTES, 1);
+    if (! flash_owner || ! boot_owner) {
+        fprintf (stderr, _("Out of memory\n"));
+        exit (-1);
+    }
+    for (i=0; i<nimages; i++) {
+        image_number = i + 1;
+        nbytes = total_bytes;
+        read_image (image_name [i]);
+        printf (_("        Image: %s, %d bytes\n"), image_name [i],
+            total_bytes - nbytes);
+    }
+    free (flash_owner);
+    free (boot_owner);
+    flash_owner = boot_owner = 0;
+}
+
+/*
+ * Parser thread of pipelined mode.
+ */
+static void *pipeline_parse (void *arg)
+{
+    (void) arg;
+    pipe_status = read_elf (pipe_filename) || read_srec (pipe_filename) ||
+        read_hex (pipe_filename);
+
+    pthread_mutex_lock (&pipe_lock);
+    pipe_done = 1;
+    pthread_cond_broadcast (&pipe_cond);
+    pthread_mutex_unlock (&pipe_lock);
+    return 0;
+}
+
+static void pipeline_start (char *filename)
+{
+    pipe_filename = filename;
+    if (pthread_create (&pipe_thread, 0, pipeline_parse, 0) != 0) {
+        perror ("pthread_create");
+        exit (1);
+    }
+}
+
+/*
+ * Wait for the parser to finish.
+ */
+static void pipeline_finish ()
+{
+    pthread_join (pipe_thread, 0);
+    if (! pipe_status) {
+        fprintf (stderr, _("%s: bad file format\n"), pipe_filename);
+        exit (1);
+    }
+}
+
+/*
+ * Guess the number of rows before the file is parsed:
+ * both formats take about 44 characters per 16 bytes of data.
+ */
+static unsigned pipeline_estimate (char *filename)
+{
+    struct stat st;
+
+    if (strcmp (filename, "-") == 0 || stat (filename, &st) < 0)
+        return flash_bytes / blocksz / 2;
+    return st.st_size * 16 / 44 / blocksz + 1;
+}
+
+void print_symbols (char symbol, int cnt)
+{
+    while (cnt-- > 0)
+        putchar (symbol);
+}
+
+void progress (unsigned step)
+{
+    ++progress_count;
+    if (progress_count % step == 0) {
+        putchar ('#');
+        fflush (stdout);
+    }
+}
+
+void quit (void)
+{
+    journal_close (0);
+    if (target != 0) {
+        if (adapter_stats)
+            target_print_stats (target);
+        target_close (target, power_on);
+        free (target);
+        target = 0;
+    }
+}
+
+void interrupted (int signum)
+{
+    fprintf (stderr, _("\nInterrupted.\n"));
+    quit();
+    _exit (-1);
+}
+
+/*
+ * Check that the boot block, containing devcfg registers,
+ * has some useful data.
+ */
+static int is_flash_block_dirty (unsigned offset)
+{
+    unsigned i;
+
+    for (i=0; i<blocksz; i++, offset++) {
+        if (flash_data [offset] != 0xff)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Check that the boot block, containing devcfg registers,
+ * has some other data.
+ */
+static int is_boot_block_dirty (unsigned offset)
+{
+    unsigned i;
+
+    for (i=0; i<blocksz; i++, offset++) {
+        /* Skip devcfg registers. */
+        if (offset >= devcfg_offset && offset < devcfg_offset+16)
+            continue;
+        if (boot_data [offset] != 0xff)
+            return 1;
+    }
+    return 0;
+}
+
+void do_probe ()
+{
+    /* Open and detect the device. */
+    atexit (quit);
+    target = target_open (target_port, target_speed);
+    if (! target) {
+        fprintf (stderr, _("Error detecting device -- check cable!\n"));
+        exit (1);
+    }
+
+    if ((target->adapter->flags & AD_PROBE) == 0) {
+        fprintf (stderr, _("Error: Target probe not supported.\n"));
+        exit (1);
+    }
+
+    boot_bytes = target_boot_bytes (target);
+    printf (_("    Processor: %s (id %08X)\n"), target_cpu_name (target),
+        target_idcode (target));
+    printf (_(" Flash memory: %d kbytes\n"), target_flash_bytes (target) / 1024);
+    if (boot_bytes > 0)
+        printf (_("  Boot memory: %d kbytes\n"), boot_bytes / 1024);
+    target_print_devcfg (target);
+}
+
+/*
+ * Patches: data overlaid on the image for every unit,
+ * like serial numbers or MAC addresses.
+ */
+#define MAXPATCH        16
+
+typedef struct {
+    unsigned        addr;               /* Target address */
+    unsigned        nbytes;
+    unsigned char   *data;
+    const char      *counter;           /* Serial number file, or 0 */
+    unsigned        serial;             /* Value from the counter file */
+} patch_t;
+
+patch_t patch [MAXPATCH];
+int npatches;
+
+/*
+ * Convert a string of hex digits into bytes, in memory order.
+ */
+static unsigned char *parse_hex_bytes (const char *str, unsigned *nbytes)
+{
+    unsigned char *data;
+    unsigned n, i;
+
+    n = strlen (str);
+    while (n > 0 && isspace ((unsigned char) str[n-1]))
+        n--;
+    if (n == 0 || (n & 1))
+        return 0;
+    data = malloc (n / 2);
+    if (! data) {
+        fprintf (stderr, _("Out of memory\n"));
+        exit (-1);
+    }
+    for (i=0; i<n; i++) {
+        if (! isxdigit ((unsigned char) str[i])) {
+            free (data);
+            return 0;
+        }
+    }
+    for (i=0; i<n/2; i++)
+        data [i] = HEX (str + i + i);
+    *nbytes = n / 2;
+    return data;
+}
+
+/*
+ * Add a patch, given as addr=value. The value is one of:
+ *      @file   - contents of binary file;
+ *      +file   - serial number: 32-bit counter, kept as decimal
+ *                text in the file, incremented after programming;
+ *      -       - line of hex digits from standard input;
+ *      hex     - hex digits.
+ */
+static void add_patch (const char *spec)
+{
+    patch_t *p = &patch [npatches];
+    char *value, line [256];
+    FILE *fd;
+    long n;
+
+    if (npatches >= MAXPATCH) {
+        fprintf (stderr, _("Too many patches\n"));
+        exit (1);
+    }
+    p->addr = strtoul (spec, &value, 0);
+    if (*value != '=') {
+        fprintf (stderr, _("%s: bad patch, expected addr=value\n"), spec);
+        exit (1);
+    }
+    value++;
+
+    switch (*value) {
+    case '@':
+        fd = fopen (value + 1, "rb");
+        if (! fd) {
+            perror (value + 1);
+            exit (1);
+        }
+        fseek (fd, 0, SEEK_END);
+        n = ftell (fd);
+        fseek (fd, 0, SEEK_SET);
+        p->data = malloc (n > 0 ? n : 1);
+        if (! p->data) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+        if (n <= 0 || fread (p->data, 1, n, fd) != (size_t) n) {
+            fprintf (stderr, _("%s: cannot read patch data\n"), value + 1);
+            exit (1);
+        }
+        fclose (fd);
+        p->nbytes = n;
+        break;
+    case '+':
+        p->counter = value + 1;
+        fd = fopen (p->counter, "r");
+        if (! fd) {
+            perror (p->counter);
+            exit (1);
+        }
+        if (! fgets (line, sizeof (line), fd)) {
+            fprintf (stderr, _("%s: cannot read serial number\n"), p->counter);
+            exit (1);
+        }
+        fclose (fd);
+        p->serial = strtoul (line, 0, 0);
+        p->data = malloc (4);
+        if (! p->data) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+        p->data[0] = p->serial;
+        p->data[1] = p->serial >> 8;
+        p->data[2] = p->serial >> 16;
+        p->data[3] = p->serial >> 24;
+        p->nbytes = 4;
+        break;
+    case '-':
+        if (! fgets (line, sizeof (line), stdin)) {
+            fprintf (stderr, _("No patch data on standard input\n"));
+            exit (1);
+        }
+        p->data = parse_hex_bytes (line, &p->nbytes);
+        break;
+    default:
+        p->data = parse_hex_bytes (value, &p->nbytes);
+        break;
+    }
+    if (! p->data) {
+        fprintf (stderr, _("%s: bad patch data\n"), spec);
+        exit (1);
+    }
+    npatches++;
+}
+
+/*
+ * Translate virtual to physical address.
+ */
+static unsigned phys_addr (unsigned addr)
+{
+    if (addr >= 0x80000000 && addr < 0xC0000000)
+        return addr & 0x1fffffff;
+    return addr;
+}
+
+/*
+ * Overlay the patches on the parsed image.
+ */
+static void apply_patches ()
+{
+    int i;
+    unsigned k, start, end;
+
+    for (i=0; i<npatches; i++) {
+        start = phys_addr (patch[i].addr);
+        end = start + patch[i].nbytes;
+        if (! (start >= FLASHP_BASE && end <= FLASHP_BASE + FLASH_BYTES) &&
+            ! (start >= BOOTP_BASE && end <= BOOTP_BASE + BOOT_BYTES)) {
+            fprintf (stderr, _("%08X: patch out of flash memory\n"), patch[i].addr);
+            exit (1);
+        }
+        for (k=0; k<patch[i].nbytes; k++)
+            store_data (start + k, patch[i].data[k]);
+    }
+}
+
+/*
+ * Does the patch overlap a block at the physical address?
+ */
+static int patch_overlaps (patch_t *p, unsigned addr, unsigned nbytes)
+{
+    unsigned start = phys_addr (p->addr);
+
+    return start < addr + nbytes && start + p->nbytes > addr;
+}
+
+/*
+ * Is the block at the physical address changed by a patch?
+ */
+static int is_patched (unsigned addr, unsigned nbytes)
+{
+    int i;
+
+    for (i=0; i<npatches; i++) {
+        if (patch_overlaps (&patch[i], addr, nbytes))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Mark the patched blocks dirty, in case the map was cached.
+ * Return the number of blocks added.
+ */
+static unsigned mark_patched (unsigned base, unsigned nbytes, unsigned char *dirty)
+{
+    unsigned addr, nblocks = 0;
+
+    for (addr=0; addr<nbytes; addr+=blocksz) {
+        if (! dirty [addr / blocksz] && is_patched (base + addr, blocksz)) {
+            dirty [addr / blocksz] = 1;
+            nblocks++;
+        }
+    }
+    return nblocks;
+}
+
+/*
+ * Are all the rows of the patch programmed, according to the journal?
+ */
+static int patch_programmed (patch_t *p)
+{
+    unsigned start = phys_addr (p->addr);
+    unsigned addr;
+
+    for (addr = start - start % blocksz; addr < start + p->nbytes; addr += blocksz) {
+        if (addr >= BOOTP_BASE) {
+            if (! (journal_state (CACHE_BOOT, addr - BOOTP_BASE) & JOURNAL_PROGRAMMED))
+                return 0;
+        } else {
+            if (! (journal_state (CACHE_FLASH, addr - FLASHP_BASE) & JOURNAL_PROGRAMMED))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Update the serial number files, after the unit is programmed.
+ * With check_journal set, skip the patches whose rows
+ * the session journal does not show as programmed.
+ */
+static void commit_patches (int check_journal)
+{
+    FILE *fd;
+    int i;
+
+    for (i=0; i<npatches; i++) {
+        if (! patch[i].counter)
+            continue;
+        if (check_journal && ! patch_programmed (&patch[i]))
+            continue;
+        fd = fopen (patch[i].counter, "w");
+        if (! fd) {
+            perror (patch[i].counter);
+            exit (1);
+        }
+        fprintf (fd, "%u\n", patch[i].serial + 1);
+        fclose (fd);
+    }
+}
+
+/*
+ * Find the image data for a device address.
+ */
+static unsigned char *block_data (unsigned addr, unsigned *offset)
+{
+    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
+        *offset = addr - BOOTV_BASE;
+        return boot_data;
+    }
+    if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
+        *offset = addr - BOOTP_BASE;
+        return boot_data;
+    }
+    if (addr >= FLASHV_BASE && addr < FLASHV_BASE + flash_bytes) {
+        *offset = addr - FLASHV_BASE;
+        return flash_data;
+    }
+    *offset = addr - FLASHP_BASE;
+    return flash_data;
+}
+
+/*
+ * Write flash memory.
+ */
+void program_block (target_t *mc, unsigned addr, unsigned nbytes)
+{
+    unsigned char *data;
+    unsigned offset;
+
+    data = block_data (addr, &offset);
+    target_program_block (mc, addr, nbytes/4, (unsigned*) (data + offset));
+    journal_mark (data == boot_data ? CACHE_BOOT : CACHE_FLASH, offset,
+        nbytes, JOURNAL_PROGRAMMED);
+}
+
+int verify_block (target_t *mc, unsigned addr, unsigned nbytes)
+{
+    unsigned char *data;
+    unsigned offset;
+    const unsigned short *crc;
+
+    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
+        data = boot_data;
+        offset = addr - BOOTV_BASE;
+    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
+        data = boot_data;
+        offset = addr - BOOTP_BASE;
+    } else if (addr >= FLASHV_BASE && addr < FLASHV_BASE + flash_bytes) {
+        data = flash_data;
+        offset = addr - FLASHV_BASE;
+    } else {
+        data = flash_data;
+        offset = addr - FLASHP_BASE;
+    }
+    crc = row_crc [data == boot_data ? CACHE_BOOT : CACHE_FLASH];
+    if (crc && nbytes == blocksz && ! is_patched (phys_addr (addr), nbytes)) {
+        /* CRC of the row is known from the cache. */
+        target_verify_crc (mc, addr, nbytes/4, (unsigned*) (data + offset),
+            crc [offset / blocksz]);
+    } else
+        target_verify_block (mc, addr, nbytes/4, (unsigned*) (data + offset));
+    journal_mark (data == boot_data ? CACHE_BOOT : CACHE_FLASH, offset,
+        nbytes, JOURNAL_VERIFIED);
+    return 1;
+}
+
+/*
+ * Read memory back and compare with the image,
+ * adding the mismatches to the map.
+ */
+#define COMPARE_WORDS   1024
+
+static void compare_block (target_t *mc, unsigned addr, unsigned nbytes,
+    mismatch_map_t *map)
+{
+    unsigned char *data;
+    unsigned offset, n, block [COMPARE_WORDS];
+
+    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
+        data = boot_data;
+        offset = addr - BOOTV_BASE;
+    } else {
+        data = flash_data;
+        offset = addr - FLASHV_BASE;
+    }
+    while (nbytes > 0) {
+        n = nbytes / 4;
+        if (n > COMPARE_WORDS)
+            n = COMPARE_WORDS;
+        target_read_block (mc, addr, n, block);
+        mismatch_compare (map, phys_addr (addr),
+            (unsigned*) (data + offset), block, n);
+        addr += n*4;
+        offset += n*4;
+        nbytes -= n*4;
+    }
+}
+
+/*
+ * Find a run of dirty blocks, starting at *addr.
+ * Runs are cut to one block unless merge is set.
+ * Return the run length in bytes, 0 when no dirty blocks left.
+ */
+static unsigned next_run (unsigned *addr, unsigned nbytes,
+    unsigned char *dirty, int merge, unsigned *nblocks)
+{
+    unsigned end;
+
+    while (*addr < nbytes && ! dirty [*addr / blocksz])
+        *addr += blocksz;
+    if (*addr >= nbytes)
+        return 0;
+    end = *addr + blocksz;
+    while (merge && end < nbytes && dirty [end / blocksz])
+        end += blocksz;
+    *nblocks = (end - *addr) / blocksz;
+    return end - *addr;
+}
+
+/*
+ * Rewrite one page of an already programmed device:
+ * read it, overlay the patches, erase and program again.
+ */
+static void patch_page (unsigned page, unsigned page_bytes, unsigned *buf)
+{
+    unsigned char *bytes = (unsigned char*) buf;
+    unsigned k, start;
+    int i, changed = 0;
+
+    if (page == ((BOOTP_BASE + devcfg_offset) & ~(page_bytes - 1))) {
+        fprintf (stderr, _("\n%08X: cannot patch the page with configuration words\n"),
+            page);
+        exit (1);
+    }
+    target_read_block (target, page, page_bytes / 4, buf);
+    for (i=0; i<npatches; i++) {
+        if (! patch_overlaps (&patch[i], page, page_bytes))
+            continue;
+        start = phys_addr (patch[i].addr);
+        for (k=0; k<patch[i].nbytes; k++) {
+            if (start + k >= page && start + k < page + page_bytes &&
+                bytes [start + k - page] != patch[i].data[k]) {
+                bytes [start + k - page] = patch[i].data[k];
+                changed = 1;
+            }
+        }
+    }
+    if (! changed) {
+        /* Already there. */
+        printf ("=");
+        fflush (stdout);
+        return;
+    }
+
+    /* Bits can only be cleared by programming: erase the page,
+     * then write all its rows back. */
+    target_erase_page (target, page);
+    target_program_block (target, page, page_bytes / 4, buf);
+    target_verify_block (target, page, page_bytes / 4, buf);
+    printf ("#");
+    fflush (stdout);
+}
+
+/*
+ * Patch an already programmed device, page by page.
+ */
+void do_patch ()
+{
+    unsigned page_bytes, page, start, end, *buf, done [MAXPATCH * 4];
+    int i, k, ndone = 0;
+
+    atexit (quit);
+    target = target_open (target_port, target_speed);
+    if (! target) {
+        fprintf (stderr, _("Error detecting device -- check cable!\n"));
+        exit (1);
+    }
+
+    if ((target->adapter->flags & AD_WRITE) == 0) {
+        fprintf (stderr, _("Error: Target write not supported.\n"));
+        exit (1);
+    }
+
+    flash_bytes = target_flash_bytes (target);
+    boot_bytes = target_boot_bytes (target);
+    blocksz = target_block_size (target);
+    devcfg_offset = target_devcfg_offset (target);
+    page_bytes = target_page_size (target);
+    printf (_("    Processor: %s\n"), target_cpu_name (target));
+
+    /* Check addresses. */
+    for (i=0; i<npatches; i++) {
+        start = phys_addr (patch[i].addr);
+        end = start + patch[i].nbytes;
+        if (! (start >= FLASHP_BASE && end <= FLASHP_BASE + flash_bytes) &&
+            ! (start >= BOOTP_BASE && end <= BOOTP_BASE + boot_bytes)) {
+            fprintf (stderr, _("%08X: patch out of flash memory\n"), patch[i].addr);
+            exit (1);
+        }
+    }
+
+    buf = malloc (page_bytes);
+    if (! buf) {
+        fprintf (stderr, _("Out of memory\n"));
+        exit (-1);
+    }
+    target_plan (target, npatches * page_bytes / blocksz, npatches, 0);
+    if (explain)
+        target_explain (target);
+    if (target->plan.use_executive)
+        target_use_executive (target);
+
+    printf (_("        Patch: "));
+    fflush (stdout);
+    for (i=0; i<npatches; i++) {
+        start = phys_addr (patch[i].addr);
+        end = start + patch[i].nbytes;
+        for (page = start & ~(page_bytes - 1); page < end; page += page_bytes) {
+            for (k=0; k<ndone; k++)
+                if (done [k] == page)
+                    break;
+            if (k < ndone)
+                continue;
+            if (ndone < MAXPATCH * 4)
+                done [ndone++] = page;
+            patch_page (page, page_bytes, buf);
+        }
+    }
+    printf (_(" done\n"));
+    free (buf);
+    commit_patches (0);
+}
+
+void do_erase()
+{
+    atexit (quit);
+    target = target_open (target_port, target_speed);
+    if (! target) {
+        fprintf (stderr, _("Error detecting device -- check cable!\n"));
+        exit (1);
+    }
+
+    if ((target->adapter->flags & AD_ERASE) == 0) {
+        fprintf (stderr, _("Error: Target erase not supported.\n"));
+        exit(1);
+    }
+
+    target_erase (target);
+}
+
+/*
+ * Describe the memory image for the cache.
+ */
+static void image_regions (cache_region_t *region)
+{
+    region[CACHE_FLASH].data = flash_data;
+    region[CACHE_FLASH].nbytes = FLASH_BYTES;
+    region[CACHE_FLASH].used = flash_used;
+    region[CACHE_BOOT].data = boot_data;
+    region[CACHE_BOOT].nbytes = BOOT_BYTES;
+    region[CACHE_BOOT].used = boot_used;
+}
+
+/*
+ * Get the parsed image from the cache.
+ */
+static int load_image (char *filename)
+{
+    cache_region_t region [2];
+
+    if (! cache_dir)
+        return 0;
+    image_regions (region);
+    if (! cache_open (cache_dir, filename, region, &total_bytes))
+        return 0;
+    flash_used = region[CACHE_FLASH].used;
+    boot_used = region[CACHE_BOOT].used;
+    return 1;
+}
+
+/*
+ * Store the parsed image into the cache.
+ */
+static void save_image ()
+{
+    cache_region_t region [2];
+
+    image_regions (region);
+    cache_save (region, total_bytes);
+}
+
+/*
+ * Check DEVCFGx values.
+ */
+static void check_devcfg ()
+{
+    if (boot_used) {
+        if (devcfg0 == 0xffffffff) {
+            fprintf (stderr, _("DEVCFG values are missing -- check your HEX file!\n"));
+            exit (1);
+        }
+        if (devcfg_offset == 0xffc0) {
+            /* For MZ family, clear the bit DEVSIGN0[31]. */
+            boot_data[0xFFEF] &= 0x7f;
         }
     }
-    fclose (fd);
-    return 1;
 }
 
-void print_symbols (char symbol, int cnt)
+/*
+ * Compute dirty bits for every block of a memory area.
+ * Count dirty blocks and runs of contiguous dirty blocks.
+ */
+static unsigned compute_dirty (int r, unsigned nbytes, unsigned char *dirty,
+    int (*is_dirty) (unsigned), unsigned *nruns)
 {
-    while (cnt-- > 0)
-        putchar (symbol);
+    unsigned addr, nblocks = 0;
+
+    if (! cache_get_dirty (r, blocksz, devcfg_offset, nbytes, dirty, &row_crc [r])) {
+        for (addr=0; addr<nbytes; addr+=blocksz)
+            dirty [addr / blocksz] = is_dirty (addr);
+        cache_put_dirty (r, blocksz, devcfg_offset, nbytes, dirty,
+            r == CACHE_BOOT ? boot_data : flash_data);
+    }
+    for (addr=0; addr<nbytes; addr+=blocksz) {
+        nblocks += dirty [addr / blocksz];
+        if (dirty [addr / blocksz] &&
+            (addr == 0 || ! dirty [addr / blocksz - 1]))
+            ++*nruns;
+    }
+    return nblocks;
 }
 
-void progress (unsigned step)
+/*
+ * Program flash blocks in address order, as soon as
+ * the parser is done with them.
+ */
+static void program_parsed_blocks (unsigned progress_step)
 {
-    ++progress_count;
-    if (progress_count % step == 0) {
-        putchar ('#');
-        fflush (stdout);
+    unsigned addr;
+
+    if (! target->adapter->erase_page) {
+        /* Records out of order could not be fixed: take the whole file. */
+        pipeline_take (REGION_FLASH, flash_bytes);
+    }
+    for (addr=0; addr<flash_bytes; addr+=blocksz) {
+        pipeline_take (REGION_FLASH, addr + blocksz);
+        flash_dirty [addr / blocksz] = is_flash_block_dirty (addr);
+        if (flash_dirty [addr / blocksz]) {
+            program_block (target, addr + FLASHV_BASE, blocksz);
+            progress (progress_step);
+        }
     }
 }
 
-void quit (void)
+/*
+ * Program again the flash pages, which got data from the file
+ * after they were programmed: erase the page, write its rows.
+ */
+static void pipeline_redo ()
 {
-    if (target != 0) {
-        target_close (target, power_on);
-        free (target);
-        target = 0;
+    unsigned page_bytes = target_page_size (target);
+    unsigned page, addr;
+
+    for (page=0; page<flash_bytes; page+=page_bytes) {
+        for (addr=page; addr<page+page_bytes; addr+=MINBLOCKSZ)
+            if (pipe_redo [addr / MINBLOCKSZ])
+                break;
+        if (addr >= page+page_bytes)
+            continue;
+        printf (_("      Rewrite: page at %08X, records not sorted by address\n"),
+            FLASHV_BASE + page);
+        target_erase_page (target, FLASHV_BASE + page);
+        for (addr=page; addr<page+page_bytes; addr+=blocksz) {
+            flash_dirty [addr / blocksz] = is_flash_block_dirty (addr);
+            if (flash_dirty [addr / blocksz])
+                program_block (target, addr + FLASHV_BASE, blocksz);
+        }
     }
 }
 
-void interrupted (int signum)
+/*
+ * Select the dirty blocks, which are not done yet
+ * according to the session journal.
+ */
+static void pending (int r, unsigned nbytes, const unsigned char *dirty, int state)
 {
-    fprintf (stderr, _("\nInterrupted.\n"));
-    quit();
-    _exit (-1);
+    unsigned addr;
+
+    for (addr=0; addr<nbytes; addr+=blocksz)
+        todo [addr / blocksz] = dirty [addr / blocksz] &&
+            ! (journal_state (r, addr) & state);
 }
 
 /*
- * Check that the boot block, containing devcfg registers,
- * has some useful data.
+ * Find the first row from r and offset, which was not confirmed
+ * as programmed in the interrupted session. Rows are taken in the
+ * order of programming: flash, then boot memory.
  */
-static int is_flash_block_dirty (unsigned offset)
+static int find_unconfirmed (int *r, unsigned *offset)
 {
-    int i;
-
-    for (i=0; i<blocksz; i++, offset++) {
-        if (flash_data [offset] != 0xff)
+    unsigned addr = *offset;
+
+    if (*r == CACHE_FLASH) {
+        for (; addr<flash_bytes; addr+=blocksz) {
+            if (flash_dirty [addr / blocksz] &&
+                ! (journal_state (CACHE_FLASH, addr) & JOURNAL_PROGRAMMED)) {
+                *offset = addr;
+                return 1;
+            }
+        }
+        addr = 0;
+    }
+    if (! boot_used)
+        return 0;
+    for (; addr<boot_bytes; addr+=blocksz) {
+        if ((boot_dirty [addr / blocksz] || addr == devcfg_offset - devcfg_offset % blocksz) &&
+            ! (journal_state (CACHE_BOOT, addr) & JOURNAL_PROGRAMMED)) {
+            *r = CACHE_BOOT;
+            *offset = addr;
             return 1;
+        }
     }
     return 0;
 }
 
 /*
- * Check that the boot block, containing devcfg registers,
- * has some other data.
+ * Continue an interrupted session. A replayed stream has up to
+ * STREAM_INFLIGHT rows in flight, which can be programmed, fully
+ * or partially, without being confirmed. Check that many rows
+ * from the first unconfirmed one; when a row is not blank, erase
+ * its page and program the whole page again.
  */
-static int is_boot_block_dirty (unsigned offset)
+static void resume_session ()
 {
-    int i;
+    unsigned page_bytes = target_page_size (target);
+    unsigned offset = 0, page, base, n;
+    int r = CACHE_FLASH;
 
-    for (i=0; i<blocksz; i++, offset++) {
-        /* Skip devcfg registers. */
-        if (offset >= devcfg_offset && offset < devcfg_offset+16)
-            continue;
-        if (boot_data [offset] != 0xff)
-            return 1;
+    if (! find_unconfirmed (&r, &offset)) {
+        printf (_("       Resume: all rows are programmed\n"));
+        return;
+    }
+    base = (r == CACHE_BOOT) ? BOOTV_BASE : FLASHV_BASE;
+    printf (_("       Resume: from address %08X\n"), base + offset);
+
+    for (n=0; n<STREAM_INFLIGHT; n++) {
+        base = (r == CACHE_BOOT) ? BOOTV_BASE : FLASHV_BASE;
+        if (! target_blank_check_block (target, base + offset, blocksz / 4)) {
+            page = offset - offset % page_bytes;
+            printf (_("       Resume: erase page at %08X\n"), base + page);
+            target_erase_page (target, base + page);
+            journal_forget (r, page, page_bytes);
+        }
+        offset += blocksz;
+        if (! find_unconfirmed (&r, &offset))
+            break;
     }
+}
+
+/*
+ * Is any block of the page to be programmed?
+ */
+static int page_touched (unsigned char *dirty, unsigned offset, unsigned page_bytes)
+{
+    unsigned addr;
+
+    for (addr=offset; addr<offset+page_bytes; addr+=blocksz)
+        if (dirty [addr / blocksz])
+            return 1;
     return 0;
 }
 
-void do_probe ()
+/*
+ * Pages of a region touched by the image: the pages of the blocks
+ * to program, and the page of the configuration words when devcfg
+ * is set. Runs of contiguous pages are merged, and erased when
+ * erase is set. Return the number of pages, and add the runs to nruns.
+ */
+static unsigned image_pages (unsigned base, unsigned nbytes,
+    unsigned char *dirty, int devcfg, int erase, unsigned *nruns)
 {
-    /* Open and detect the device. */
-    atexit (quit);
-    target = target_open (target_port, target_speed);
-    if (! target) {
-        fprintf (stderr, _("Error detecting device -- check cable!\n"));
-        exit (1);
+    unsigned page_bytes = target_page_size (target);
+    unsigned page, start = 0, run = 0, npages = 0;
+
+    for (page=0; page<=nbytes; page+=page_bytes) {
+        if (page < nbytes && (page_touched (dirty, page, page_bytes) ||
+            (devcfg && devcfg_offset >= page && devcfg_offset < page + page_bytes))) {
+            if (run == 0)
+                start = page;
+            run++;
+            continue;
+        }
+        if (run == 0)
+            continue;
+        if (erase)
+            target_erase_pages (target, base + start, run);
+        npages += run;
+        ++*nruns;
+        run = 0;
     }
+    return npages;
+}
 
-    if ((target->adapter->flags & AD_PROBE) == 0) {
-        fprintf (stderr, _("Error: Target probe not supported.\n"));
-        exit (1);
-    }
+/*
+ * Erase only the pages to be programmed, with the PE when
+ * the plan uses it.
+ */
+static void erase_image_pages ()
+{
+    unsigned npages, nruns = 0;
 
-    boot_bytes = target_boot_bytes (target);
-    printf (_("    Processor: %s (id %08X)\n"), target_cpu_name (target),
-        target_idcode (target));
-    printf (_(" Flash memory: %d kbytes\n"), target_flash_bytes (target) / 1024);
-    if (boot_bytes > 0)
-        printf (_("  Boot memory: %d kbytes\n"), boot_bytes / 1024);
-    target_print_devcfg (target);
+    if (target->plan.use_executive)
+        target_use_executive (target);
+    printf (_("        Erase: "));
+    fflush (stdout);
+    npages = image_pages (FLASHV_BASE, flash_bytes, flash_dirty, 0, 1, &nruns);
+    npages += image_pages (BOOTV_BASE, boot_bytes, boot_dirty, boot_used, 1, &nruns);
+    printf (_("%u pages in %u runs\n"), npages, nruns);
 }
 
 /*
- * Write flash memory.
+ * Hash of the image, to match the session journal.
  */
-void program_block (target_t *mc, unsigned addr)
+static unsigned image_key ()
 {
-    unsigned char *data;
-    unsigned offset;
+    unsigned key;
 
-    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_BASE;
-    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTP_BASE;
-    } else if (addr >= FLASHV_BASE && addr < FLASHV_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_BASE;
-    } else {
-        data = flash_data;
-        offset = addr - FLASHP_BASE;
-    }
-    target_program_block (mc, addr, blocksz/4, (unsigned*) (data + offset));
+    key = journal_key (0, flash_data, flash_bytes);
+    return journal_key (key, boot_data, boot_bytes);
 }
 
-int verify_block (target_t *mc, unsigned addr)
+/*
+ * Key of the compiled stream: the image, and what the reports
+ * depend on besides it.
+ */
+static unsigned long long stream_key ()
 {
-    unsigned char *data;
-    unsigned offset;
+    adapter_t *adapter = target->adapter;
+    unsigned key;
+
+    key = journal_key (0, (unsigned char*) adapter->family_name,
+        strlen (adapter->family_name));
+    key = journal_key (key, (unsigned char*) &blocksz, sizeof (blocksz));
+    key = journal_key (key, (unsigned char*) &adapter->stream_protocol,
+        sizeof (adapter->stream_protocol));
+    key = journal_key (key, flash_dirty, flash_bytes / blocksz);
+    key = journal_key (key, boot_dirty, boot_bytes / blocksz);
+    return (unsigned long long) key << 32 | image_key ();
+}
 
-    if (addr >= BOOTV_BASE && addr < BOOTV_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_BASE;
-    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTP_BASE;
-    } else if (addr >= FLASHV_BASE && addr < FLASHV_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_BASE;
-    } else {
-        data = flash_data;
-        offset = addr - FLASHP_BASE;
+/*
+ * Encode the dirty blocks of a region, in the order of the live loops.
+ */
+static void stream_region (stream_t *s, int r, unsigned base,
+    unsigned nbytes, unsigned char *dirty)
+{
+    unsigned char *data;
+    unsigned addr, offset, n, nblocks;
+
+    pending (r, nbytes, dirty, JOURNAL_PROGRAMMED);
+    addr = 0;
+    while ((n = next_run (&addr, nbytes, todo, 0, &nblocks)) != 0) {
+        data = block_data (base + addr, &offset);
+        target_encode_block (target, s, base + addr, n/4,
+            (unsigned*) (data + offset));
+        addr += n;
     }
-    target_verify_block (mc, addr, blocksz/4, (unsigned*) (data + offset));
-    return 1;
 }
 
-void do_erase()
+static unsigned stream_step;
+
+/*
+ * The PE has confirmed a row of the stream.
+ */
+static void stream_row_done (unsigned addr, unsigned nbytes)
 {
-    atexit (quit);
-    target = target_open (target_port, target_speed);
-    if (! target) {
-        fprintf (stderr, _("Error detecting device -- check cable!\n"));
-        exit (1);
-    }
+    if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes)
+        journal_mark (CACHE_BOOT, addr - BOOTP_BASE, nbytes, JOURNAL_PROGRAMMED);
+    else
+        journal_mark (CACHE_FLASH, addr - FLASHP_BASE, nbytes, JOURNAL_PROGRAMMED);
+    progress (stream_step);
+}
 
-    if ((target->adapter->flags & AD_ERASE) == 0) {
-        fprintf (stderr, _("Error: Target erase not supported.\n"));
-        exit(1);
+/*
+ * Program flash and boot memory by replaying a stream of adapter
+ * reports. The stream is compiled on the first run with this image
+ * and kept in the stream directory for the next devices.
+ */
+static void program_stream ()
+{
+    stream_t stream;
+    char path [1024];
+    unsigned long long key;
+    unsigned len;
+
+    memset (&stream, 0, sizeof (stream));
+    key = stream_key ();
+#ifdef _WIN32
+    mkdir (stream_dir);
+#else
+    mkdir (stream_dir, 0777);
+#endif
+    snprintf (path, sizeof (path), "%s/%08x%08x.p32s", stream_dir,
+        (unsigned) (key >> 32), (unsigned) key);
+
+    if (! stream_load (&stream, path, key)) {
+        if (flash_used)
+            stream_region (&stream, CACHE_FLASH, FLASHV_BASE, flash_bytes, flash_dirty);
+        if (boot_used)
+            stream_region (&stream, CACHE_BOOT, BOOTV_BASE, boot_bytes, boot_dirty);
+        stream_save (&stream, path, key);
+        printf (_("       Stream: compiled %u reports\n"), stream.nreports);
+    } else
+        printf (_("       Stream: %u reports\n"), stream.nreports);
+
+    for (stream_step=1; ; stream_step<<=1) {
+        if (stream.nrows / stream_step < 64) {
+            len = stream.nrows / stream_step;
+            if (len < 1)
+                len = 1;
+            break;
+        }
     }
-
-    target_erase (target);
+    printf (_("Program image: "));
+    print_symbols ('.', len);
+    print_symbols ('\b', len);
+    fflush (stdout);
+    target_replay (target, &stream, stream_row_done);
+    printf (_("# done\n"));
+    stream_free (&stream);
 }
 
 void do_program (char *filename)
 {
-    unsigned addr;
-    int progress_len, progress_step, boot_progress_len;
+    unsigned addr, nflash, nboot, nruns, n, nblocks, npages;
+    int progress_len, progress_step, boot_progress_len, streamed;
+    mismatch_map_t map;
     void *t0;
 
+    /* Parse the file while the device is being prepared. */
+    if (pipeline)
+        pipeline_start (filename);
+
     /* Open and detect the device. */
     atexit (quit);
     target = target_open (target_port, target_speed);
@@ -458,107 +1733,187 @@ void do_program (char *filename)
     printf (_(" Flash memory: %d kbytes\n"), flash_bytes / 1024);
     if (boot_bytes > 0)
         printf (_("  Boot memory: %d kbytes\n"), boot_bytes / 1024);
-    printf (_("         Data: %d bytes\n"), total_bytes);
 
-    /* Verify DEVCFGx values. */
-    if (boot_used) {
-        if (devcfg0 == 0xffffffff) {
-            fprintf (stderr, _("DEVCFG values are missing -- check your HEX file!\n"));
-            exit (1);
-        }
-        if (devcfg_offset == 0xffc0) {
-            /* For MZ family, clear the bit DEVSIGN0[31]. */
-            boot_data[0xFFEF] &= 0x7f;
+    nflash = nboot = nruns = 0;
+    if (pipeline) {
+        /* Plan from the file size, the data is not there yet. */
+        nflash = pipeline_estimate (filename);
+        nruns = 1;
+        target_plan (target, nflash, nruns, 1);
+        target->plan.cluster = 0;
+    } else {
+        printf (_("         Data: %d bytes\n"), total_bytes);
+        check_devcfg ();
+
+        if (flash_used)
+            nflash = compute_dirty (CACHE_FLASH, flash_bytes, flash_dirty,
+                is_flash_block_dirty, &nruns);
+        if (boot_used)
+            nboot = compute_dirty (CACHE_BOOT, boot_bytes, boot_dirty,
+                is_boot_block_dirty, &nruns);
+        if (npatches) {
+            n = mark_patched (FLASHP_BASE, flash_bytes, flash_dirty);
+            nflash += n;
+            nruns += n;
+            if (boot_used) {
+                n = mark_patched (BOOTP_BASE, boot_bytes, boot_dirty);
+                nboot += n;
+                nruns += n;
+            }
         }
-    }
 
-    if (! verify_only) {
-        /* Erase flash. */
-        target_erase (target);
+        /* Choose the strategy from the link parameters and the job size. */
+        target_plan (target, nflash + nboot, nruns, boot_used);
+        if (! chip_erase && ! verify_only) {
+            n = 0;
+            npages = image_pages (FLASHV_BASE, flash_bytes, flash_dirty, 0, 0, &n);
+            npages += image_pages (BOOTV_BASE, boot_bytes, boot_dirty, boot_used, 0, &n);
+            target_plan_erase (target, npages, n);
+        }
     }
-    target_use_executive (target);
-
-    /* Compute dirty bits for every block. */
-    if (flash_used) {
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            flash_dirty [addr / blocksz] = is_flash_block_dirty (addr);
+    if (compare)
+        target->plan.verify = VERIFY_READBACK;
+    if (explain)
+        target_explain (target);
+
+    if (! verify_only && ! pipeline) {
+        /* Keep track of the session, to resume after a failure. */
+        if (! journal_open (filename, target->cpuid, image_key (), blocksz,
+                            flash_bytes, boot_bytes, resume)) {
+            fprintf (stderr, _("%s: no interrupted session to resume\n"), filename);
+            exit (1);
         }
     }
-    if (boot_used) {
-        for (addr=0; addr<boot_bytes; addr+=blocksz) {
-            boot_dirty [addr / blocksz] = is_boot_block_dirty (addr);
+    if (! verify_only) {
+        /* Erase flash, unless the part is found blank. */
+        if (journal_is_erased ())
+            printf (_("        Erase: done in the interrupted session\n"));
+        else {
+            if (target->plan.page_erase)
+                erase_image_pages ();
+            else if (target->plan.blank_check && target_blank_check (target))
+                printf (_("        Erase: not needed, device is blank\n"));
+            else if (target->plan.msec_pages != NO_COST)
+                erase_image_pages ();   /* Not blank: keep the rest of the flash */
+            else
+                target_erase (target);
+            journal_erased ();
         }
     }
+    if (target->plan.use_executive)
+        target_use_executive (target);
+    if (resume && ! verify_only)
+        resume_session ();
 
     /* Compute length of progress indicator for flash memory. */
     for (progress_step=1; ; progress_step<<=1) {
-        progress_len = 0;
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            if (flash_dirty [addr / blocksz])
-                progress_len++;
-        }
-        if (progress_len / progress_step < 64) {
-            progress_len /= progress_step;
+        if (nflash / progress_step < 64) {
+            progress_len = nflash / progress_step;
             if (progress_len < 1)
                 progress_len = 1;
             break;
         }
     }
 
-    /* Compute length of progress indicator for boot memory. */
-    boot_progress_len = 1;
-    for (addr=0; addr<boot_bytes; addr+=blocksz) {
-        if (boot_dirty [addr / blocksz])
-            boot_progress_len++;
-    }
-
     progress_count = 0;
     t0 = fix_time ();
-    if (! verify_only) {
-        if (flash_used) {
-            printf (_("Program flash: "));
-            print_symbols ('.', progress_len);
-            print_symbols ('\b', progress_len);
-            fflush (stdout);
-            for (addr=0; addr<flash_bytes; addr+=blocksz) {
-                if (flash_dirty [addr / blocksz]) {
-                    program_block (target, addr + FLASHV_BASE);
+
+    /* Replay the compiled reports, when the rows are all written by the PE. */
+    streamed = stream_dir && ! verify_only && ! pipeline && ! resume &&
+        target->plan.use_executive && ! target->plan.cluster &&
+        target->adapter->replay && target->adapter->stream_protocol;
+    if (streamed) {
+        program_stream ();
+        progress_count = 0;
+    }
+    if (! verify_only && ! streamed && (flash_used || pipeline)) {
+        printf (_("Program flash: "));
+        print_symbols ('.', progress_len);
+        print_symbols ('\b', progress_len);
+        fflush (stdout);
+        if (pipeline) {
+            program_parsed_blocks (progress_step);
+        } else {
+            pending (CACHE_FLASH, flash_bytes, flash_dirty, JOURNAL_PROGRAMMED);
+            addr = 0;
+            while ((n = next_run (&addr, flash_bytes, todo,
+                                  target->plan.cluster, &nblocks)) != 0) {
+                program_block (target, addr + FLASHV_BASE, n);
+                while (nblocks--)
                     progress (progress_step);
-                }
+                addr += n;
             }
-            printf (_("# done\n"));
         }
-        if (boot_used) {
+        printf (_("# done\n"));
+    }
+    if (pipeline) {
+        /* The rest of the job needs the whole file. */
+        pipeline_finish ();
+        if (! verify_only)
+            pipeline_redo ();
+        save_image ();
+        printf (_("         Data: %d bytes\n"), total_bytes);
+        check_devcfg ();
+        nruns = 0;
+        if (verify_only)
+            compute_dirty (CACHE_FLASH, flash_bytes, flash_dirty,
+                is_flash_block_dirty, &nruns);
+        else
+            cache_put_dirty (CACHE_FLASH, blocksz, devcfg_offset, flash_bytes,
+                flash_dirty, flash_data);
+        if (boot_used)
+            nboot = compute_dirty (CACHE_BOOT, boot_bytes, boot_dirty,
+                is_boot_block_dirty, &nruns);
+    }
+
+    /* Compute length of progress indicator for boot memory. */
+    boot_progress_len = nboot + 1;
+
+    if (! verify_only && boot_used) {
+        if (! streamed) {
             printf (_(" Program boot: "));
             print_symbols ('.', boot_progress_len);
             print_symbols ('\b', boot_progress_len);
             fflush (stdout);
-            for (addr=0; addr<boot_bytes; addr+=blocksz) {
-                if (boot_dirty [addr / blocksz]) {
-                    program_block (target, addr + BOOTV_BASE);
+            pending (CACHE_BOOT, boot_bytes, boot_dirty, JOURNAL_PROGRAMMED);
+            addr = 0;
+            while ((n = next_run (&addr, boot_bytes, todo,
+                                  target->plan.cluster, &nblocks)) != 0) {
+                program_block (target, addr + BOOTV_BASE, n);
+                while (nblocks--)
                     progress (1);
-                }
+                addr += n;
             }
             printf (_("# done      \n"));
-            if (! boot_dirty [devcfg_offset / blocksz]) {
-                /* Write chip configuration. */
+        }
+        if (! boot_dirty [devcfg_offset / blocksz]) {
+            /* Write chip configuration. */
+            if (! (journal_state (CACHE_BOOT, devcfg_offset) & JOURNAL_PROGRAMMED)) {
                 target_program_devcfg (target,
                     devcfg0, devcfg1, devcfg2, devcfg3);
-                boot_dirty [devcfg_offset / blocksz] = 1;
+                journal_mark (CACHE_BOOT, devcfg_offset - devcfg_offset % blocksz,
+                    blocksz, JOURNAL_PROGRAMMED);
             }
+            boot_dirty [devcfg_offset / blocksz] = 1;
         }
     }
+    memset (&map, 0, sizeof (map));
     if (flash_used && !skip_verify) {
         printf (_(" Verify flash: "));
         print_symbols ('.', progress_len);
         print_symbols ('\b', progress_len);
         fflush (stdout);
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            if (flash_dirty [addr / blocksz]) {
+        pending (CACHE_FLASH, flash_bytes, flash_dirty, JOURNAL_VERIFIED);
+        addr = 0;
+        while ((n = next_run (&addr, flash_bytes, todo,
+                              target->plan.verify != VERIFY_BLOCK, &nblocks)) != 0) {
+            while (nblocks--)
                 progress (progress_step);
-                if (! verify_block (target, addr + FLASHV_BASE))
-                    exit (0);
-            }
+            if (compare)
+                compare_block (target, addr + FLASHV_BASE, n, &map);
+            else if (! verify_block (target, addr + FLASHV_BASE, n))
+                exit (0);
+            addr += n;
         }
         printf (_(" done\n"));
     }
@@ -567,36 +1922,44 @@ void do_program (char *filename)
         print_symbols ('.', boot_progress_len);
         print_symbols ('\b', boot_progress_len);
         fflush (stdout);
-        for (addr=0; addr<boot_bytes; addr+=blocksz) {
-            if (boot_dirty [addr / blocksz]) {
+        pending (CACHE_BOOT, boot_bytes, boot_dirty, JOURNAL_VERIFIED);
+        addr = 0;
+        while ((n = next_run (&addr, boot_bytes, todo,
+                              target->plan.verify != VERIFY_BLOCK, &nblocks)) != 0) {
+            while (nblocks--)
                 progress (1);
-                if (! verify_block (target, addr + BOOTV_BASE))
-                    exit (0);
-            }
+            if (compare)
+                compare_block (target, addr + BOOTV_BASE, n, &map);
+            else if (! verify_block (target, addr + BOOTV_BASE, n))
+                exit (0);
+            addr += n;
         }
         printf (_(" done       \n"));
     }
+    if (compare && ! mismatch_report (&map)) {
+        mismatch_free (&map);
+        exit (1);
+    }
+    mismatch_free (&map);
     if (boot_used || flash_used)
         printf (_(" Program rate: %ld bytes per second\n"),
             total_bytes * 1000L / mseconds_elapsed (t0));
+    if (! verify_only)
+        commit_patches (1);
+    journal_close (1);
 }
 
 void do_read (char *filename, unsigned base, unsigned nbytes)
 {
-    FILE *fd;
-    unsigned len, addr, data [256], progress_step;
+    unsigned len, addr, i, n, progress_step, *data;
+    unsigned device_msec, sink_msec;
+    unsigned long written;
     void *t0;
 
-    fd = fopen (filename, "wb");
-    if (! fd) {
-        perror (filename);
-        exit (1);
-    }
+    /* The file is written by a separate thread. */
+    readback_open (filename, base, skip_blank);
     printf (_("       Memory: total %d bytes\n"), nbytes);
 
-    /* Use 1kbyte blocks. */
-    blocksz = 1024;
-
     /* Open and detect the device. */
     atexit (quit);
     target = target_open (target_port, target_speed);
@@ -610,7 +1973,16 @@ void do_read (char *filename, unsigned base, unsigned nbytes)
         exit (1);
     }
 
-    target_use_executive (target);
+    target_plan_read (target, nbytes / 4);
+    if (explain)
+        target_explain (target);
+    if (target->plan.use_executive)
+        target_use_executive (target);
+    /* Read by whole chunks when the adapter streams, else 1kbyte blocks. */
+    if (target->adapter->flags & AD_READ_STREAM)
+        blocksz = READBACK_CHUNK;
+    else
+        blocksz = 1024;
     for (progress_step=1; ; progress_step<<=1) {
         len = 1 + nbytes / progress_step / blocksz;
         if (len < 64)
@@ -623,18 +1995,27 @@ void do_read (char *filename, unsigned base, unsigned nbytes)
 
     progress_count = 0;
     t0 = fix_time ();
-    for (addr=base; addr-base<nbytes; addr+=blocksz) {
-        progress (progress_step);
-        target_read_block (target, addr, blocksz/4, data);
-        if (fwrite (data, 1, blocksz, fd) != blocksz) {
-            fprintf (stderr, "%s: write error!\n", filename);
-            exit (1);
+    for (addr=base; addr-base<nbytes; addr+=n) {
+        n = nbytes - (addr - base);
+        if (n > READBACK_CHUNK)
+            n = READBACK_CHUNK;
+        data = readback_buffer ();
+        for (i=0; i<n; i+=blocksz) {
+            progress (progress_step);
+            target_read_block (target, addr + i,
+                (n - i < blocksz ? n - i : blocksz) / 4, data + i/4);
         }
+        readback_put (n);
     }
+    device_msec = mseconds_elapsed (t0);
+    sink_msec = readback_close (&written);
+    if (sink_msec < 1)
+        sink_msec = 1;
     printf (_("# done\n"));
-    printf (_("         Rate: %ld bytes per second\n"),
-        nbytes * 1000L / mseconds_elapsed (t0));
-    fclose (fd);
+    printf (_("  Device rate: %ld bytes per second\n"),
+        nbytes * 1000L / device_msec);
+    printf (_("    Sink rate: %ld bytes per second\n"),
+        (long) (written * 1000L / sink_msec));
 }
 
 /*
@@ -683,6 +2064,25 @@ static void gpl_show_warranty (void)
     printf("\n");
 }
 
+/*
+ * Directory of the parsed image cache, when not given.
+ */
+const char *default_cache_dir ()
+{
+    static char path [1024];
+    const char *tmp = getenv ("PIC32PROG_CACHE");
+
+    if (tmp)
+        return tmp;
+    tmp = getenv ("TEMP");
+    if (! tmp)
+        tmp = getenv ("TMPDIR");
+    if (! tmp)
+        tmp = "/tmp";
+    snprintf (path, sizeof (path), "%s/pic32prog-cache", tmp);
+    return path;
+}
+
 int main (int argc, char **argv)
 {
     int ch, read_mode = 0;
@@ -693,6 +2093,17 @@ int main (int argc, char **argv)
         { "copying",     0, 0, 'C' },
         { "version",     0, 0, 'V' },
         { "skip-verify", 0, 0, 'S' },
+        { "explain",     0, 0, 'X' },
+        { "pipeline",    0, 0, 'P' },
+        { "cache",       2, 0, 'K' },
+        { "patch",       1, 0, 'T' },
+        { "skip-blank",  0, 0, 'F' },
+        { "compare",     0, 0, 'M' },
+        { "resume",      0, 0, 'R' },
+        { "adapter-stats", 0, 0, 'A' },
+        { "chain",       1, 0, 'J' },
+        { "chip-erase",  0, 0, 'E' },
+        { "stream",      2, 0, 'U' },
         { NULL,          0, 0, 0 },
     };
 
@@ -759,6 +2170,42 @@ int main (int argc, char **argv)
         case 'S':
             ++skip_verify;
             continue;
+        case 'X':
+            ++explain;
+            continue;
+        case 'P':
+            ++pipeline;
+            continue;
+        case 'K':
+            cache_dir = optarg ? optarg : default_cache_dir ();
+            continue;
+        case 'T':
+            add_patch (optarg);
+            continue;
+        case 'F':
+            ++skip_blank;
+            continue;
+        case 'M':
+            ++compare;
+            continue;
+        case 'R':
+            ++resume;
+            continue;
+        case 'A':
+            ++adapter_stats;
+            continue;
+        case 'E':
+            ++chip_erase;
+            continue;
+        case 'U':
+            stream_dir = optarg ? optarg : default_cache_dir ();
+            continue;
+        case 'J':
+            if (strcmp (optarg, "all") == 0)
+                chain_tap = CHAIN_ALL;
+            else
+                chain_tap = strtoul (optarg, 0, 0);
+            continue;
         }
 usage:
         printf ("%s.\n\n", copyright);
@@ -771,12 +2218,21 @@ usage:
         printf ("\nWrite flash memory:\n");
         printf ("       pic32prog [-v] file.srec\n");
         printf ("       pic32prog [-v] file.hex\n");
+        printf ("       pic32prog [-v] file.elf\n");
+        printf ("       pic32prog [-v] file... | @job.txt\n");
         printf ("\nRead memory:\n");
         printf ("       pic32prog -r file.bin address length\n");
+        printf ("       pic32prog -r file.hex address length\n");
+        printf ("\nPatch programmed device:\n");
+        printf ("       pic32prog --patch addr=value...\n");
         printf ("\nArgs:\n");
         printf ("       file.srec           Code file in SREC format\n");
         printf ("       file.hex            Code file in Intel HEX format\n");
+        printf ("       file.elf            Code file in ELF format\n");
         printf ("       file.bin            Code file in binary format\n");
+        printf ("       -                   Read the code file from standard input\n");
+        printf ("       file...             Several code files, programmed as one image\n");
+        printf ("       @job.txt            File with the names of code files, one per line\n");
         printf ("       -v                  Verify only\n");
         printf ("       -r                  Read mode\n");
         printf ("       -d device           Use serial device\n");
@@ -790,6 +2246,23 @@ usage:
         printf ("       -C, --copying       Print copying information\n");
         printf ("       -W, --warranty      Print warranty information\n");
         printf ("       -S, --skip-verify   Skip the write verification step\n");
+        printf ("       --explain           Print the chosen programming plan\n");
+        printf ("       --pipeline          Program while the file is being read\n");
+        printf ("       --cache[=dir]       Cache the parsed code files, so unchanged\n");
+        printf ("                           files are not parsed again; dir also\n");
+        printf ("                           replaces the default directory of the\n");
+        printf ("                           calibrated adapter clock\n");
+        printf ("       --skip-blank        Omit 0xFF runs when reading to HEX or SREC\n");
+        printf ("       --compare           Verify by reading back, report all mismatches\n");
+        printf ("       --resume            Continue an interrupted programming session\n");
+        printf ("       --chip-erase        Erase the whole chip, not only the pages written\n");
+        printf ("       --stream[=dir]      Compile the image to adapter reports once,\n");
+        printf ("                           replay them for every device\n");
+        printf ("       --adapter-stats     Print the adapter firmware counters at exit\n");
+        printf ("       --chain=tap         Program this TAP of a JTAG daisy chain\n");
+        printf ("       --chain=all         Program all the identical PIC32s of the chain at once\n");
+        printf ("       --patch addr=value  Overlay data: hex digits, @file with binary data,\n");
+        printf ("                           +file with serial number, - for stdin\n");
         printf ("\n");
         return 0;
     }
@@ -804,27 +2277,55 @@ usage:
     case 0:
         if (erase_only > 0) {
             do_erase();
+        } else if (npatches > 0) {
+            do_patch ();
         } else {
             do_probe ();
         }
         break;
-    case 1:
-        if (! read_srec (argv[0]) &&
-            ! read_hex (argv[0])) {
-            fprintf (stderr, _("%s: bad file format\n"), argv[0]);
-            exit (1);
+    default:
+        if (read_mode && argc == 3) {
+            base = strtoul (argv[1], 0, 0);
+            nbytes = strtoul (argv[2], 0, 0);
+            do_read (argv[0], base, nbytes);
+            break;
+        }
+        if (argc > 1 || argv[0][0] == '@') {
+            if (read_mode)
+                goto usage;
+
+            /* One image from several files: one erase, one PE
+             * session, one programming and one verify pass.
+             * The journal is named after the first argument. */
+            pipeline = 0;
+            read_job (argc, argv);
+            if (npatches > 0)
+                apply_patches ();
+            do_program (argv[0][0] == '@' ? argv[0] + 1 : argv[0]);
+            break;
+        }
+        if (resume) {
+            /* The journal is matched with the whole image. */
+            pipeline = 0;
+        }
+        if (load_image (argv[0])) {
+            /* Nothing to parse. */
+            pipeline = 0;
+        } else if (! pipeline) {
+            read_image (argv[0]);
+            save_image ();
+        }
+        if (npatches > 0) {
+            /* Patches need the whole image. */
+            if (pipeline) {
+                pipeline = 0;
+                read_image (argv[0]);
+                save_image ();
+            }
+            apply_patches ();
         }
         do_program (argv[0]);
         break;
-    case 3:
-        if (! read_mode)
-            goto usage;
-        base = strtoul (argv[1], 0, 0);
-        nbytes = strtoul (argv[2], 0, 0);
-        do_read (argv[0], base, nbytes);
-        break;
-    default:
-        goto usage;
     }
     quit ();
     return 0;
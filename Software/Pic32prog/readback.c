@@ -0,0 +1,292 @@
+/*
+ * Output of memory read from the device.
+ *
+ * The device is read by the main thread into a ring of large buffers,
+ * while a writer thread formats them and writes the file, so that
+ * neither the formatting nor the disk slow down the reading.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "readback.h"
+#include "localize.h"
+
+#define NBUFS           4               /* Buffers in the ring */
+#define LINE_BYTES      16              /* Data bytes per HEX/SREC record */
+
+#define FORMAT_BIN      0
+#define FORMAT_HEX      1
+#define FORMAT_SREC     2
+
+static unsigned *ring [NBUFS];
+static unsigned ring_len [NBUFS];       /* Bytes in the buffer */
+static unsigned head;                   /* Next buffer to fill */
+static unsigned tail;                   /* Next buffer to write */
+static unsigned count;                  /* Buffers queued */
+static int closing;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_freed = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+
+static FILE *out;
+static const char *out_name;
+static int format;
+static int skip_ff;
+static unsigned out_addr;               /* Address of the next byte */
+static unsigned hex_high;               /* Upper address in HEX output */
+static unsigned long nwritten;
+static unsigned long busy_usec;
+static int failed;                      /* Write error in the writer thread */
+
+/*
+ * Called by the writer thread: only note the error, the main thread
+ * stops the reading and reports it.
+ */
+static void write_error ()
+{
+    failed = 1;
+}
+
+/*
+ * Write HEX record.
+ */
+static void put_hex (unsigned type, unsigned addr, const unsigned char *data,
+    unsigned nbytes)
+{
+    unsigned char sum;
+    unsigned i;
+
+    sum = nbytes + (addr >> 8) + addr + type;
+    fprintf (out, ":%02X%04X%02X", nbytes, addr & 0xffff, type);
+    for (i=0; i<nbytes; i++) {
+        fprintf (out, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf (out, "%02X\n", (unsigned char) -sum);
+}
+
+/*
+ * Write S-record with 32-bit address.
+ */
+static void put_srec (char type, unsigned addr, const unsigned char *data,
+    unsigned nbytes)
+{
+    unsigned char sum;
+    unsigned i;
+
+    sum = (nbytes + 5) + (addr >> 24) + (addr >> 16) + (addr >> 8) + addr;
+    fprintf (out, "S%c%02X%08X", type, nbytes + 5, addr);
+    for (i=0; i<nbytes; i++) {
+        fprintf (out, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf (out, "%02X\n", (unsigned char) ~sum);
+}
+
+static int is_blank (const unsigned char *data, unsigned nbytes)
+{
+    while (nbytes--)
+        if (*data++ != 0xff)
+            return 0;
+    return 1;
+}
+
+/*
+ * Write a buffer in the chosen format.
+ */
+static void emit (const unsigned char *data, unsigned nbytes)
+{
+    unsigned n;
+
+    if (failed)
+        return;
+    if (format == FORMAT_BIN) {
+        if (fwrite (data, 1, nbytes, out) != nbytes)
+            write_error ();
+        out_addr += nbytes;
+        nwritten += nbytes;
+        return;
+    }
+    while (nbytes > 0) {
+        n = nbytes;
+        if (n > LINE_BYTES)
+            n = LINE_BYTES;
+        if (format == FORMAT_HEX && (out_addr & 0xffff) + n > 0x10000)
+            n = 0x10000 - (out_addr & 0xffff);
+
+        if (! skip_ff || ! is_blank (data, n)) {
+            if (format == FORMAT_HEX) {
+                if ((out_addr >> 16) != hex_high) {
+                    unsigned char high [2];
+
+                    hex_high = out_addr >> 16;
+                    high[0] = hex_high >> 8;
+                    high[1] = hex_high;
+                    put_hex (4, 0, high, 2);
+                }
+                put_hex (0, out_addr, data, n);
+            } else
+                put_srec ('3', out_addr, data, n);
+            nwritten += n;
+        }
+        out_addr += n;
+        data += n;
+        nbytes -= n;
+    }
+    if (ferror (out))
+        write_error ();
+}
+
+/*
+ * Writer thread: take buffers from the ring and write them.
+ */
+static void *write_ring (void *arg)
+{
+    struct timeval t0, t1;
+
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock (&ring_lock);
+        while (count == 0 && ! closing)
+            pthread_cond_wait (&ring_queued, &ring_lock);
+        if (count == 0) {
+            pthread_mutex_unlock (&ring_lock);
+            break;
+        }
+        pthread_mutex_unlock (&ring_lock);
+
+        gettimeofday (&t0, 0);
+        emit ((unsigned char*) ring [tail], ring_len [tail]);
+        gettimeofday (&t1, 0);
+        busy_usec += (t1.tv_sec - t0.tv_sec) * 1000000L +
+            t1.tv_usec - t0.tv_usec;
+
+        pthread_mutex_lock (&ring_lock);
+        tail = (tail + 1) % NBUFS;
+        count--;
+        pthread_cond_signal (&ring_freed);
+        pthread_mutex_unlock (&ring_lock);
+    }
+    return 0;
+}
+
+void readback_open (const char *filename, unsigned base, int skip_blank)
+{
+    const char *ext = strrchr (filename, '.');
+    int i;
+
+    format = FORMAT_BIN;
+    if (ext) {
+        if (strcasecmp (ext, ".hex") == 0)
+            format = FORMAT_HEX;
+        else if (strcasecmp (ext, ".srec") == 0 || strcasecmp (ext, ".mot") == 0 ||
+                 strcasecmp (ext, ".s19") == 0 || strcasecmp (ext, ".s28") == 0 ||
+                 strcasecmp (ext, ".s37") == 0)
+            format = FORMAT_SREC;
+    }
+    out = fopen (filename, format == FORMAT_BIN ? "wb" : "w");
+    if (! out) {
+        perror (filename);
+        exit (1);
+    }
+    setvbuf (out, 0, _IOFBF, READBACK_CHUNK);
+    out_name = filename;
+    out_addr = base;
+    hex_high = ~0;
+    skip_ff = skip_blank;
+    nwritten = 0;
+    busy_usec = 0;
+    head = tail = count = 0;
+    closing = 0;
+    failed = 0;
+
+    for (i=0; i<NBUFS; i++) {
+        ring[i] = malloc (READBACK_CHUNK);
+        if (! ring[i]) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+    }
+    if (pthread_create (&writer, 0, write_ring, 0) != 0) {
+        perror ("pthread_create");
+        exit (1);
+    }
+}
+
+/*
+ * Wait for the writer thread to drain the ring and exit.
+ */
+static void join_writer ()
+{
+    pthread_mutex_lock (&ring_lock);
+    closing = 1;
+    pthread_cond_signal (&ring_queued);
+    pthread_mutex_unlock (&ring_lock);
+    pthread_join (writer, 0);
+}
+
+static void report_error ()
+{
+    fprintf (stderr, "%s: write error!\n", out_name);
+    exit (1);
+}
+
+unsigned *readback_buffer ()
+{
+    unsigned *buf;
+
+    if (failed) {
+        join_writer ();
+        report_error ();
+    }
+    pthread_mutex_lock (&ring_lock);
+    while (count == NBUFS)
+        pthread_cond_wait (&ring_freed, &ring_lock);
+    buf = ring [head];
+    pthread_mutex_unlock (&ring_lock);
+    return buf;
+}
+
+void readback_put (unsigned nbytes)
+{
+    pthread_mutex_lock (&ring_lock);
+    ring_len [head] = nbytes;
+    head = (head + 1) % NBUFS;
+    count++;
+    pthread_cond_signal (&ring_queued);
+    pthread_mutex_unlock (&ring_lock);
+}
+
+unsigned readback_close (unsigned long *written)
+{
+    struct timeval t0, t1;
+    int i;
+
+    join_writer ();
+    if (failed)
+        report_error ();
+
+    gettimeofday (&t0, 0);
+    if (format == FORMAT_HEX)
+        put_hex (1, 0, 0, 0);
+    else if (format == FORMAT_SREC)
+        put_srec ('7', 0, 0, 0);
+    if (fclose (out) != 0)
+        report_error ();
+    gettimeofday (&t1, 0);
+    busy_usec += (t1.tv_sec - t0.tv_sec) * 1000000L + t1.tv_usec - t0.tv_usec;
+
+    for (i=0; i<NBUFS; i++)
+        free (ring[i]);
+    *written = nwritten;
+    return busy_usec / 1000;
+}
@@ -0,0 +1,41 @@
+/*
+ * Output of memory read from the device.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _READBACK_H
+#define _READBACK_H
+
+/*
+ * Size of one buffer of the ring, in bytes.
+ */
+#define READBACK_CHUNK  (64 * 1024)
+
+/*
+ * Start the writer thread. The format is chosen by the file
+ * extension: .hex - Intel HEX, .srec/.s19/.s28/.s37/.mot - S-records,
+ * anything else - raw binary. Runs of 0xFF bytes are omitted from
+ * HEX and SREC output when skip_blank is set.
+ */
+void readback_open (const char *filename, unsigned base, int skip_blank);
+
+/*
+ * Get a free buffer of READBACK_CHUNK bytes, waiting for the writer.
+ */
+unsigned *readback_buffer (void);
+
+/*
+ * Queue the buffer for writing.
+ */
+void readback_put (unsigned nbytes);
+
+/*
+ * Flush and close the file. Return the time spent by the writer
+ * in milliseconds, and the number of bytes written.
+ */
+unsigned readback_close (unsigned long *written);
+
+#endif
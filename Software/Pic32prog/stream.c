@@ -0,0 +1,146 @@
+/*
+ * Stream of pre-encoded adapter reports.
+ *
+ * When the same image is written to many devices, the reports sent
+ * to the adapter are the same for every device. They are compiled once
+ * and kept in a file, next to the parsed image cache. Programming
+ * a device is then a replay of the reports, with a check of the replies.
+ * A stream file is a header, the reports, and a mark per report
+ * telling how to check its reply.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "cache.h"
+#include "adapter.h"
+#include "localize.h"
+
+#define STREAM_VERSION  1
+
+typedef struct {
+    char            magic [4];          /* "P32S" */
+    unsigned        version;
+    unsigned        key_lo;             /* Image, family and adapter protocol */
+    unsigned        key_hi;
+    unsigned        nreports;
+    unsigned        nrows;
+    unsigned        row_bytes;
+} stream_header_t;
+
+unsigned char *stream_add (stream_t *s, unsigned check, unsigned expect,
+    unsigned addr)
+{
+    unsigned char *report;
+    stream_mark_t *mark;
+
+    if (s->nreports >= s->max) {
+        s->max = s->max ? s->max * 2 : 256;
+        s->reports = realloc (s->reports, s->max * STREAM_REPORT);
+        s->marks = realloc (s->marks, s->max * sizeof (stream_mark_t));
+        if (! s->reports || ! s->marks) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+    }
+    report = s->reports + s->nreports * STREAM_REPORT;
+    memset (report, 0, STREAM_REPORT);
+    mark = &s->marks [s->nreports];
+    mark->check = check;
+    mark->expect = expect;
+    mark->addr = addr;
+    s->nreports++;
+    if (check == STREAM_RESPONSE)
+        s->nrows++;
+    return report;
+}
+
+void stream_reset (stream_t *s)
+{
+    s->nreports = 0;
+    s->nrows = 0;
+}
+
+int stream_load (stream_t *s, const char *path, unsigned long long key)
+{
+    stream_header_t *h;
+
+    stream_free (s);
+    s->base = map_file (path, &s->nbytes);
+    if (! s->base)
+        return 0;
+    h = (stream_header_t*) s->base;
+    if (s->nbytes < sizeof (*h) || memcmp (h->magic, "P32S", 4) != 0 ||
+        h->version != STREAM_VERSION ||
+        h->key_lo != (unsigned) key || h->key_hi != (unsigned) (key >> 32) ||
+        h->nreports > (s->nbytes - sizeof (*h)) /
+            (STREAM_REPORT + sizeof (stream_mark_t)) ||
+        s->nbytes != sizeof (*h) +
+            h->nreports * (STREAM_REPORT + sizeof (stream_mark_t))) {
+        /* Stale or foreign file: compile again. */
+        unmap_file (s->base, s->nbytes);
+        s->base = 0;
+        return 0;
+    }
+    s->nreports = h->nreports;
+    s->nrows = h->nrows;
+    s->row_bytes = h->row_bytes;
+    s->reports = s->base + sizeof (*h);
+    s->marks = (stream_mark_t*) (s->reports + h->nreports * STREAM_REPORT);
+    if (debug_level > 0)
+        fprintf (stderr, "stream: %u reports loaded from %s\n",
+            s->nreports, path);
+    return 1;
+}
+
+void stream_save (stream_t *s, const char *path, unsigned long long key)
+{
+    char tmp [1024 + 16];
+    stream_header_t h;
+    FILE *fd;
+    int ok;
+
+    snprintf (tmp, sizeof (tmp), "%s.%u", path, (unsigned) getpid ());
+    fd = fopen (tmp, "wb");
+    if (! fd) {
+        perror (tmp);
+        return;
+    }
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, "P32S", 4);
+    h.version = STREAM_VERSION;
+    h.key_lo = key;
+    h.key_hi = key >> 32;
+    h.nreports = s->nreports;
+    h.nrows = s->nrows;
+    h.row_bytes = s->row_bytes;
+    ok = (fwrite (&h, sizeof (h), 1, fd) == 1) &&
+         (fwrite (s->reports, STREAM_REPORT, s->nreports, fd) == s->nreports) &&
+         (fwrite (s->marks, sizeof (stream_mark_t), s->nreports, fd) == s->nreports);
+    if (fclose (fd) != 0)
+        ok = 0;
+
+    /* Replace the old file; another process may have done it already. */
+    if (ok) {
+        unlink (path);
+        rename (tmp, path);
+    }
+    unlink (tmp);
+}
+
+void stream_free (stream_t *s)
+{
+    if (s->base) {
+        unmap_file (s->base, s->nbytes);
+    } else {
+        free (s->reports);
+        free (s->marks);
+    }
+    memset (s, 0, sizeof (*s));
+}
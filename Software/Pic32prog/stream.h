@@ -0,0 +1,65 @@
+/*
+ * Stream of pre-encoded adapter reports.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#define STREAM_REPORT   64              /* Bytes per report */
+#define STREAM_INFLIGHT 16              /* Most replies awaited in a replay */
+
+#define STREAM_NO_REPLY 0               /* Adapter sends no reply */
+#define STREAM_STATUS   1               /* Reply with status 1 */
+#define STREAM_RESPONSE 2               /* PE response, ends a row */
+
+/*
+ * How the reply of a report is checked.
+ */
+typedef struct {
+    unsigned        check;              /* STREAM_xxx */
+    unsigned        expect;             /* RESPONSE: PE response */
+    unsigned        addr;               /* RESPONSE: address of the row */
+} stream_mark_t;
+
+typedef struct _stream_t stream_t;
+
+struct _stream_t {
+    unsigned        nreports;
+    unsigned        nrows;              /* Rows programmed by the stream */
+    unsigned        row_bytes;
+    unsigned char   *reports;           /* STREAM_REPORT bytes each */
+    stream_mark_t   *marks;             /* One per report */
+    unsigned        max;                /* Allocated reports, 0 when mapped */
+    unsigned char   *base;              /* Mapped file */
+    unsigned        nbytes;
+};
+
+/*
+ * Append a report, return it cleared for the caller to fill.
+ */
+unsigned char *stream_add (stream_t *s, unsigned check, unsigned expect,
+    unsigned addr);
+
+/*
+ * Forget the reports, keep the buffers for reuse.
+ */
+void stream_reset (stream_t *s);
+
+/*
+ * Map a compiled stream, read only.
+ * Return 0 when there is no valid stream for this key.
+ */
+int stream_load (stream_t *s, const char *path, unsigned long long key);
+
+/*
+ * Write the stream to a file, for stream_load() later.
+ */
+void stream_save (stream_t *s, const char *path, unsigned long long key);
+
+void stream_free (stream_t *s);
+
+#endif
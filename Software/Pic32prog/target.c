@@ -14,6 +14,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "target.h"
 #include "adapter.h"
@@ -27,16 +28,16 @@ extern print_func_t print_mz;
 /*
  * PIC32 families.
  */
-                    /*-Boot-Devcfg--Row---Print------Code--------Nwords-Version-*/
+                    /*-Boot-Devcfg--Row---Print------Code--------Nwords-Version-Page-*/
 static const
 family_t family_mx1 = { "mx1",
-                        3,  0x0bf0, 128,  print_mx1, pic32_pemx1, 422,  0x0301 };
+                        3,  0x0bf0, 128,  print_mx1, pic32_pemx1, 422,  0x0301, 1024 };
 static const
 family_t family_mx3 = { "mx3",
-                        12, 0x2ff0, 512,  print_mx3, pic32_pemx3, 1044, 0x0201 };
+                        12, 0x2ff0, 512,  print_mx3, pic32_pemx3, 1044, 0x0201, 4096 };
 static const
 family_t family_mz  = { "mz",
-                        80, 0xffc0, 2048, print_mz,  pic32_pemz,  1052, 0x0502 };
+                        80, 0xffc0, 2048, print_mz,  pic32_pemz,  1052, 0x0502, 16384 };
 /*
  * This one is a special one for the bootloader. We have no idea what we're
  * programming, so set the values to the maximum out of all the others.
@@ -44,7 +45,7 @@ family_t family_mz  = { "mz",
  */
 static const
 family_t family_bl  = { "bootloader",
-                        80, 0,      1024, 0,         0,           0,    0      };
+                        80, 0,      1024, 0,         0,           0,    0,      1024 };
 
 /*
  * Table of PIC32 chip variants.
@@ -398,6 +399,18 @@ void target_close (target_t *t, int power_on)
     t->adapter->close (t->adapter, power_on);
 }
 
+/*
+ * Print the performance counters of the adapter, since it was opened.
+ */
+void target_print_stats (target_t *t)
+{
+    if (! t->adapter->print_stats) {
+        printf (_("Adapter statistics not supported\n"));
+        return;
+    }
+    t->adapter->print_stats (t->adapter);
+}
+
 const char *target_cpu_name (target_t *t)
 {
     return t->cpu_name;
@@ -428,14 +441,314 @@ unsigned target_block_size (target_t *t)
     return t->family->bytes_per_row;
 }
 
+unsigned target_page_size (target_t *t)
+{
+    return t->family->page_bytes;
+}
+
 /*
  * Use PE for reading/writing/erasing memory.
  */
 void target_use_executive (target_t *t)
 {
-    if (t->adapter->load_executive != 0 && t->family->pe_nwords != 0)
+    if (t->pe_loaded)
+        return;
+    if (t->adapter->load_executive != 0 && t->family->pe_nwords != 0) {
         t->adapter->load_executive (t->adapter, t->family->pe_code,
             t->family->pe_nwords, t->family->pe_version);
+        t->pe_loaded = 1;
+    }
+}
+
+/*
+ * Cost of operations, in adapter transactions.
+ * With PE: the PE download (loader plus the PE words),
+ * then a command, an address and a response per row besides the data.
+ * Without PE: every row is copied to target RAM with serial execution
+ * (lui/ori/sw/addiu per word) and written with an NVM unlock sequence.
+ * Fixed delays of the adapters and the target are in milliseconds.
+ */
+#define COST_PE_LOADER      (PIC32_PE_LOADER_LEN * 2)
+#define COST_PE_ROW         3
+#define COST_SLOW_WORD      4
+#define COST_SLOW_ROW       40
+#define COST_CLUSTER_WORDS  256
+#define COST_PE_MSEC        100     /* PE start delay */
+#define COST_ERASE_MSEC     200     /* Chip erase */
+#define COST_PAGE_MSEC      20      /* Page erase */
+#define COST_BLANK_KWORDS   1       /* PE blank check, per 1k words */
+#define CALIBRATE_PINGS     8
+
+/*
+ * Number of transactions to move nwords data words.
+ */
+static unsigned long xfers (target_t *t, unsigned long nwords)
+{
+    return (nwords + t->link.report_words - 1) / t->link.report_words;
+}
+
+/*
+ * Time of a number of transactions, in milliseconds.
+ */
+static unsigned long xfer_msec (target_t *t, unsigned long n)
+{
+    return (n * t->link.rtt_usec + 999) / 1000;
+}
+
+/*
+ * Devices of a panel: rows are broadcast to all of them,
+ * the other operations are paid once per device.
+ */
+static unsigned devices (target_t *t)
+{
+    return t->adapter->ndevices ? t->adapter->ndevices : 1;
+}
+
+/*
+ * Measure the round trip time of the adapter.
+ */
+void target_calibrate (target_t *t)
+{
+    struct timeval t0, t1;
+    unsigned i;
+    long usec;
+
+    t->link.report_words = t->adapter->report_words;
+    if (t->link.report_words == 0)
+        t->link.report_words = 1;
+
+    gettimeofday (&t0, 0);
+    for (i=0; i<CALIBRATE_PINGS; i++) {
+        if (t->adapter->ping)
+            t->adapter->ping (t->adapter);
+        else
+            t->adapter->get_idcode (t->adapter);
+    }
+    gettimeofday (&t1, 0);
+    usec = (t1.tv_sec - t0.tv_sec) * 1000000L + t1.tv_usec - t0.tv_usec;
+    t->link.rtt_usec = usec / CALIBRATE_PINGS;
+    if (t->link.rtt_usec < 1)
+        t->link.rtt_usec = 1;
+
+    t->link.pe_load_msec = (COST_PE_MSEC + xfer_msec (t,
+        xfers (t, COST_PE_LOADER + t->family->pe_nwords))) * devices (t);
+    if (debug_level > 0)
+        fprintf (stderr, "link: %u usec round trip, %u words per transaction\n",
+            t->link.rtt_usec, t->link.report_words);
+}
+
+/*
+ * Choose the cheapest strategy for a job writing nrows rows
+ * in nruns runs of contiguous rows (plus the configuration
+ * words when devcfg is set).
+ */
+void target_plan (target_t *t, unsigned nrows, unsigned nruns, int devcfg)
+{
+    adapter_t *a = t->adapter;
+    plan_t *p = &t->plan;
+    unsigned words_per_row = t->family->bytes_per_row / 4;
+    unsigned long nwords = (unsigned long) nrows * words_per_row;
+    unsigned long best;
+
+    if (t->link.rtt_usec == 0)
+        target_calibrate (t);
+    memset (p, 0, sizeof (*p));
+
+    /* PE or serial execution. */
+    p->msec_pe = p->msec_slow = NO_COST;
+    if (a->load_executive != 0 && t->family->pe_nwords != 0)
+        p->msec_pe = t->link.pe_load_msec + xfer_msec (t,
+            nrows * (COST_PE_ROW + xfers (t, words_per_row)) +
+            (devcfg ? COST_PE_ROW + 4 : 0));
+    if (a->flags & AD_SLOW_WRITE)
+        p->msec_slow = xfer_msec (t,
+            nrows * (COST_SLOW_ROW + xfers (t, words_per_row * COST_SLOW_WORD)) +
+            (devcfg ? COST_SLOW_ROW : 0));
+    p->use_executive = (p->msec_pe != NO_COST && p->msec_pe <= p->msec_slow);
+
+    /* Rows or clusters: a cluster is written whole, empty rows too. */
+    p->msec_row = xfer_msec (t, nrows * (COST_PE_ROW + xfers (t, words_per_row)));
+    p->msec_cluster = NO_COST;
+    if (a->program_block && p->use_executive) {
+        unsigned long nclusters = nwords / COST_CLUSTER_WORDS + nruns;
+
+        p->msec_cluster = xfer_msec (t,
+            nclusters * (COST_PE_ROW + xfers (t, COST_CLUSTER_WORDS)));
+    }
+    p->cluster = (p->msec_cluster < p->msec_row);
+
+    /* Verify: every CRC request has a fixed delay, read back costs data. */
+    p->msec_crc_block = p->msec_crc_run = p->msec_readback = NO_COST;
+    if (a->verify_data) {
+        p->msec_crc_block = devices (t) * nrows *
+            (a->crc_msec + xfer_msec (t, COST_PE_ROW));
+        p->msec_crc_run = devices (t) * nruns *
+            (a->crc_msec + xfer_msec (t, COST_PE_ROW));
+    }
+    if (a->read_data && devices (t) == 1)       /* Reads one device only */
+        p->msec_readback = xfer_msec (t, xfers (t, nwords) +
+            (p->use_executive ? nrows * COST_PE_ROW : nwords * COST_SLOW_WORD));
+    p->verify = VERIFY_BLOCK;
+    best = p->msec_crc_block;
+    if (p->msec_crc_run < best) {
+        p->verify = VERIFY_RUN;
+        best = p->msec_crc_run;
+    }
+    if (p->msec_readback < best)
+        p->verify = VERIFY_READBACK;
+
+    /* Erase or blank check. The check needs the PE and assumes
+     * a blank part; when it fails we pay the erase and a PE reload. */
+    p->msec_erase = COST_ERASE_MSEC * devices (t);
+    p->msec_blank = p->msec_pages = NO_COST;
+    if (a->blank_check && p->use_executive)
+        p->msec_blank = (xfer_msec (t, 4 * COST_PE_ROW + xfers (t, 32)) +
+            (t->flash_bytes + target_boot_bytes (t)) / 4096 *
+            COST_BLANK_KWORDS) * devices (t);
+    p->blank_check = (p->msec_blank != NO_COST &&
+        p->msec_blank + t->link.pe_load_msec < p->msec_erase);
+}
+
+/*
+ * Erase only the npages pages touched by the image, in nruns runs
+ * of contiguous pages, when it is cheaper than the chip erase or
+ * the blank check chosen by target_plan(). The rest of the flash
+ * is kept, also when a blank check finds the part not blank:
+ * the pages are erased then, not the chip.
+ */
+void target_plan_erase (target_t *t, unsigned npages, unsigned nruns)
+{
+    adapter_t *a = t->adapter;
+    plan_t *p = &t->plan;
+
+    if (! a->erase_page)
+        return;
+    if (p->use_executive && a->erase_pages)
+        p->msec_pages = npages * COST_PAGE_MSEC +
+            xfer_msec (t, nruns * COST_PE_ROW);
+    else
+        p->msec_pages = npages * (COST_PAGE_MSEC +
+            xfer_msec (t, p->use_executive ? COST_PE_ROW : COST_SLOW_ROW));
+    p->msec_pages *= devices (t);
+
+    p->page_erase = (p->msec_pages < p->msec_erase);
+    if (p->blank_check && p->msec_blank != NO_COST &&
+        p->msec_blank + t->link.pe_load_msec <= p->msec_pages)
+        p->page_erase = 0;
+    if (p->page_erase)
+        p->blank_check = 0;
+}
+
+/*
+ * Choose PE or serial execution for reading nwords words.
+ */
+void target_plan_read (target_t *t, unsigned nwords)
+{
+    adapter_t *a = t->adapter;
+    plan_t *p = &t->plan;
+
+    if (t->link.rtt_usec == 0)
+        target_calibrate (t);
+    memset (p, 0, sizeof (*p));
+
+    p->msec_pe = p->msec_slow = NO_COST;
+    if (a->load_executive != 0 && t->family->pe_nwords != 0)
+        p->msec_pe = t->link.pe_load_msec + xfer_msec (t, xfers (t, nwords));
+    if (a->flags & AD_SLOW_WRITE)
+        p->msec_slow = xfer_msec (t, xfers (t, (unsigned long) nwords * COST_SLOW_WORD));
+    p->use_executive = (p->msec_pe != NO_COST && p->msec_pe <= p->msec_slow);
+    p->msec_row = p->msec_cluster = NO_COST;
+    p->msec_crc_block = p->msec_crc_run = p->msec_readback = NO_COST;
+    p->msec_erase = p->msec_blank = p->msec_pages = NO_COST;
+}
+
+static void explain_cost (const char *name, unsigned long msec)
+{
+    if (msec == NO_COST)
+        printf ("%s n/a", name);
+    else
+        printf ("%s %lu msec", name, msec);
+}
+
+/*
+ * Print the plan and the estimates it was based on.
+ */
+void target_explain (target_t *t)
+{
+    plan_t *p = &t->plan;
+    static const char *verify_name[] = {
+        "CRC per block", "CRC per run", "read back",
+    };
+
+    printf (_("         Link: %u usec round trip, %u words per transaction\n"),
+        t->link.rtt_usec, t->link.report_words);
+    if (devices (t) > 1)
+        printf (_("        Panel: %u devices, rows by broadcast\n"), devices (t));
+    printf (_("    Execution: "));
+    explain_cost ("PE", p->msec_pe);
+    explain_cost (", serial", p->msec_slow);
+    printf (" -> %s\n", p->use_executive ? "PE" : "serial");
+    if (p->msec_row != NO_COST) {
+        printf (_("      Program: "));
+        explain_cost ("rows", p->msec_row);
+        explain_cost (", clusters", p->msec_cluster);
+        printf (" -> %s\n", p->cluster ? "clusters" : "rows");
+    }
+    if (p->msec_crc_block != NO_COST || p->msec_readback != NO_COST) {
+        printf (_("       Verify: "));
+        explain_cost ("CRC per block", p->msec_crc_block);
+        explain_cost (", CRC per run", p->msec_crc_run);
+        explain_cost (", read back", p->msec_readback);
+        printf (" -> %s\n", verify_name [p->verify]);
+    }
+    if (p->msec_erase != NO_COST) {
+        printf (_("        Erase: "));
+        explain_cost ("chip erase", p->msec_erase);
+        explain_cost (", blank check", p->msec_blank);
+        explain_cost (", pages", p->msec_pages);
+        printf (" -> %s\n", p->page_erase ? "pages" :
+            p->blank_check ? "blank check" : "chip erase");
+    }
+}
+
+/*
+ * Check that the flash is erased, using the PE.
+ * The configuration words are not all ones on an erased part
+ * (bit 31 of DEVCFG0 reads as zero on PIC32MX), so the PE row
+ * holding them is read and compared word by word.
+ * Return 1 if blank.
+ */
+int target_blank_check (target_t *t)
+{
+    adapter_t *a = t->adapter;
+    unsigned boot_bytes = target_boot_bytes (t);
+    unsigned cfg = t->family->devcfg_offset;
+    unsigned row = cfg & ~127, data [32], i;
+
+    if (! a->blank_check)
+        return 0;
+    target_use_executive (t);
+    if (! a->blank_check (a, t->flash_addr, t->flash_bytes / 4))
+        return 0;
+    if (boot_bytes == 0)
+        return 1;
+    if (cfg == 0 || row + 128 > boot_bytes)
+        return a->blank_check (a, 0x1fc00000, boot_bytes / 4);
+
+    if (row > 0 && ! a->blank_check (a, 0x1fc00000, row / 4))
+        return 0;
+    if (row + 128 < boot_bytes &&
+        ! a->blank_check (a, 0x1fc00000 + row + 128,
+            (boot_bytes - row - 128) / 4))
+        return 0;
+    target_read_block (t, 0x1fc00000 + row, 32, data);
+    for (i=0; i<32; i++) {
+        if (row + i*4 == cfg + 12)
+            data[i] |= 0x80000000;              /* DEVCFG0 */
+        if (data[i] != 0xffffffff)
+            return 0;
+    }
+    return 1;
 }
 
 /*
@@ -489,7 +802,7 @@ void target_read_block (target_t *t, unsigned addr,
     //fprintf (stderr, "target_read_block (addr = %x, nwords = %d)\n", addr, nwords);
     while (nwords > 0) {
         unsigned n = nwords;
-        if (n > 256)
+        if (n > 256 && ! (t->adapter->flags & AD_READ_STREAM))
             n = 256;
         t->adapter->read_data (t->adapter, addr, n, data);
         addr += n<<2;
@@ -505,26 +818,46 @@ void target_read_block (target_t *t, unsigned addr,
 void target_verify_block (target_t *t, unsigned addr,
     unsigned nwords, unsigned *data)
 {
-    unsigned i, word, expected, block[512];
+    unsigned i, n, word, expected, block[256];
 
     //fprintf (stderr, "%s: addr=%08x, nwords=%u, data=%08x...\n", __func__, addr, nwords, data[0]);
-    if (t->adapter->verify_data != 0) {
+    if (t->adapter->verify_data != 0 && t->plan.verify != VERIFY_READBACK) {
         t->adapter->verify_data (t->adapter, virt_to_phys (addr), nwords, data);
         return;
     }
 
-    t->adapter->read_data (t->adapter, addr, nwords, block);
-    for (i=0; i<nwords; i++) {
-        expected = data [i];
-        word = block [i];
-        if (word != expected) {
-            printf (_("\nerror at address %08X: file=%08X, mem=%08X\n"),
-                addr + i*4, expected, word);
-            exit (1);
+    while (nwords > 0) {
+        n = nwords;
+        if (n > 256)
+            n = 256;
+        target_read_block (t, addr, n, block);
+        for (i=0; i<n; i++) {
+            expected = data [i];
+            word = block [i];
+            if (word != expected) {
+                printf (_("\nerror at address %08X: file=%08X, mem=%08X\n"),
+                    addr + i*4, expected, word);
+                exit (1);
+            }
         }
+        addr += n<<2;
+        data += n;
+        nwords -= n;
     }
 }
 
+/*
+ * Verify data, with the CRC already known.
+ */
+void target_verify_crc (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data, unsigned crc)
+{
+    if (t->adapter->verify_crc != 0 && t->plan.verify != VERIFY_READBACK &&
+        t->adapter->verify_crc (t->adapter, virt_to_phys (addr), nwords, crc))
+        return;
+    target_verify_block (t, addr, nwords, data);
+}
+
 /*
  * Erase all Flash memory.
  */
@@ -534,11 +867,39 @@ int target_erase (target_t *t)
         printf (_("        Erase: "));
         fflush (stdout);
         t->adapter->erase_chip (t->adapter);
+        t->pe_loaded = 0;
         printf (_("done\n"));
     }
     return 1;
 }
 
+/*
+ * Erase one page of flash memory.
+ */
+void target_erase_page (target_t *t, unsigned addr)
+{
+    if (! t->adapter->erase_page) {
+        printf (_("\nPage erase not supported by the adapter.\n"));
+        exit (1);
+    }
+    t->adapter->erase_page (t->adapter, virt_to_phys (addr));
+}
+
+/*
+ * Erase a run of pages, with one PE command when the adapter can.
+ */
+void target_erase_pages (target_t *t, unsigned addr, unsigned npages)
+{
+    if (t->pe_loaded && t->adapter->erase_pages) {
+        t->adapter->erase_pages (t->adapter, virt_to_phys (addr), npages);
+        return;
+    }
+    while (npages-- > 0) {
+        target_erase_page (t, addr);
+        addr += t->family->page_bytes;
+    }
+}
+
 /*
  * Test block for non 0xFFFFFFFF value
  */
@@ -550,6 +911,30 @@ static int target_test_empty_block (unsigned *data, unsigned nwords)
     return 1;
 }
 
+/*
+ * Check that a block of memory is erased.
+ * Return 1 if blank.
+ */
+int target_blank_check_block (target_t *t, unsigned addr, unsigned nwords)
+{
+    unsigned n, block[256];
+
+    if (t->adapter->blank_check != 0 && t->pe_loaded)
+        return t->adapter->blank_check (t->adapter, virt_to_phys (addr), nwords);
+
+    while (nwords > 0) {
+        n = nwords;
+        if (n > 256)
+            n = 256;
+        target_read_block (t, addr, n, block);
+        if (! target_test_empty_block (block, n))
+            return 0;
+        addr += n<<2;
+        nwords -= n;
+    }
+    return 1;
+}
+
 /*
  * Write to flash memory.
  */
@@ -559,7 +944,7 @@ void target_program_block (target_t *t, unsigned addr,
     addr = virt_to_phys (addr);
     //fprintf (stderr, "target_program_block (addr = %x, nwords = %d)\n", addr, nwords);
 
-    if (! t->adapter->program_block) {
+    if (! t->adapter->program_block || ! t->plan.cluster) {
         unsigned words_per_row = t->family->bytes_per_row / 4;
         while (nwords > 0) {
             unsigned n = nwords;
@@ -583,6 +968,38 @@ void target_program_block (target_t *t, unsigned addr,
     }
 }
 
+/*
+ * Encode the rows of a block as a stream of adapter reports,
+ * the same as target_program_block() sends with PE.
+ */
+void target_encode_block (target_t *t, stream_t *s, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned words_per_row = t->family->bytes_per_row / 4;
+
+    addr = virt_to_phys (addr);
+    while (nwords > 0) {
+        unsigned n = nwords;
+        if (n > words_per_row)
+            n = words_per_row;
+        if (! target_test_empty_block (data, words_per_row))
+            t->adapter->encode_row (t->adapter, s, addr, data, words_per_row);
+        addr += n<<2;
+        data += n;
+        nwords -= n;
+    }
+}
+
+/*
+ * Write to flash memory from a compiled stream.
+ * The PE must be loaded.
+ */
+void target_replay (target_t *t, const stream_t *s,
+    void (*row_done) (unsigned addr, unsigned nbytes))
+{
+    t->adapter->replay (t->adapter, s, row_done);
+}
+
 /*
  * Program the configuration registers.
  */
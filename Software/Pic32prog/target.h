@@ -24,8 +24,41 @@ typedef struct {
     const unsigned  *pe_code;
     unsigned        pe_nwords;
     unsigned        pe_version;
+    unsigned        page_bytes;
 } family_t;
 
+/*
+ * Link parameters, measured by target_calibrate().
+ */
+typedef struct {
+    unsigned        rtt_usec;           /* Round trip of one transaction */
+    unsigned        report_words;       /* Data words per transaction */
+    unsigned        pe_load_msec;       /* Time to download the PE */
+} link_t;
+
+/*
+ * Strategy for a job, chosen by target_plan().
+ */
+#define VERIFY_BLOCK    0               /* CRC of every block */
+#define VERIFY_RUN      1               /* CRC of contiguous runs of blocks */
+#define VERIFY_READBACK 2               /* Read back and compare on host */
+
+#define NO_COST         (~0UL)          /* Option not available */
+
+typedef struct {
+    int             use_executive;      /* Load the PE */
+    int             cluster;            /* Program by cluster, not by row */
+    int             verify;             /* VERIFY_xxx */
+    int             blank_check;        /* Blank check instead of erase */
+    int             page_erase;         /* Erase only the pages of the image */
+
+    /* Estimates in milliseconds, for --explain. */
+    unsigned long   msec_pe, msec_slow;
+    unsigned long   msec_row, msec_cluster;
+    unsigned long   msec_crc_block, msec_crc_run, msec_readback;
+    unsigned long   msec_erase, msec_blank, msec_pages;
+} plan_t;
+
 typedef struct {
     adapter_t       *adapter;
     const char      *cpu_name;
@@ -34,12 +67,22 @@ typedef struct {
     unsigned        flash_addr;
     unsigned        flash_bytes;
     unsigned        boot_bytes;
+    int             pe_loaded;
+    link_t          link;
+    plan_t          plan;
 } target_t;
 
 
 target_t *target_open (const char *port, int baud_rate);
 void target_close (target_t *t, int power_on);
 void target_use_executive (target_t *t);
+void target_calibrate (target_t *t);
+void target_plan (target_t *t, unsigned nrows, unsigned nruns, int devcfg);
+void target_plan_read (target_t *t, unsigned nwords);
+void target_plan_erase (target_t *t, unsigned npages, unsigned nruns);
+void target_explain (target_t *t);
+void target_print_stats (target_t *t);
+int target_blank_check (target_t *t);
 
 unsigned target_idcode (target_t *t);
 const char *target_cpu_name (target_t *t);
@@ -47,6 +90,7 @@ unsigned target_flash_width (target_t *t);
 unsigned target_flash_bytes (target_t *t);
 unsigned target_boot_bytes (target_t *t);
 unsigned target_block_size (target_t *t);
+unsigned target_page_size (target_t *t);
 unsigned target_devcfg_offset (target_t *t);
 void target_print_devcfg (target_t *t);
 
@@ -54,11 +98,20 @@ void target_read_block (target_t *t, unsigned addr,
 	unsigned nwords, unsigned *data);
 void target_verify_block (target_t *t, unsigned addr,
 	unsigned nwords, unsigned *data);
+void target_verify_crc (target_t *t, unsigned addr,
+	unsigned nwords, unsigned *data, unsigned crc);
 
 int target_erase (target_t *t);
+void target_erase_page (target_t *t, unsigned addr);
+void target_erase_pages (target_t *t, unsigned addr, unsigned npages);
+int target_blank_check_block (target_t *t, unsigned addr, unsigned nwords);
 void target_program_block (target_t *t, unsigned addr,
 	unsigned nwords, unsigned *data);
 void target_program_devcfg (target_t *t, unsigned devcfg0,
         unsigned devcfg1, unsigned devcfg2, unsigned devcfg3);
+void target_encode_block (target_t *t, stream_t *s, unsigned addr,
+	unsigned nwords, unsigned *data);
+void target_replay (target_t *t, const stream_t *s,
+	void (*row_done) (unsigned addr, unsigned nbytes));
 
 #endif
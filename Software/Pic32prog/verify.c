@@ -0,0 +1,134 @@
+/*
+ * Compare of memory contents with the image, collecting all mismatches.
+ *
+ * The compare runs at memory speed: blocks of words are checked with
+ * SSE2 when the compiler provides it, 64 bits at a time otherwise,
+ * and only the blocks with a difference are looked at word by word.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+
+#include "verify.h"
+#include "localize.h"
+
+/*
+ * Find the first differing word at or after index i.
+ * Return nwords when the rest is equal.
+ */
+static unsigned find_mismatch (const unsigned *a, const unsigned *b,
+    unsigned i, unsigned nwords)
+{
+#ifdef __SSE2__
+    for (; i + 4 <= nwords; i += 4) {
+        __m128i va = _mm_loadu_si128 ((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128 ((const __m128i*) (b + i));
+
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (va, vb)) != 0xffff)
+            break;
+    }
+#else
+    for (; i + 2 <= nwords; i += 2) {
+        unsigned long long va, vb;
+
+        memcpy (&va, a + i, 8);
+        memcpy (&vb, b + i, 8);
+        if (va != vb)
+            break;
+    }
+#endif
+    for (; i < nwords; i++)
+        if (a[i] != b[i])
+            break;
+    return i;
+}
+
+/*
+ * Get the range for the word at the address: extend the last one
+ * when adjacent, else start a new one.
+ */
+static mismatch_t *get_range (mismatch_map_t *m, unsigned addr)
+{
+    mismatch_t *r;
+
+    if (m->nranges > 0) {
+        r = &m->range [m->nranges - 1];
+        if (r->addr + r->nwords * 4 == addr)
+            return r;
+    }
+    if (m->nranges >= m->maxranges) {
+        m->maxranges = m->maxranges ? m->maxranges * 2 : 64;
+        m->range = realloc (m->range, m->maxranges * sizeof (mismatch_t));
+        if (! m->range) {
+            fprintf (stderr, _("Out of memory\n"));
+            exit (-1);
+        }
+    }
+    r = &m->range [m->nranges++];
+    memset (r, 0, sizeof (*r));
+    r->addr = addr;
+    return r;
+}
+
+void mismatch_compare (mismatch_map_t *m, unsigned addr,
+    const unsigned *expected, const unsigned *actual, unsigned nwords)
+{
+    unsigned i, diff, s0, s1;
+    mismatch_t *r;
+
+    m->nwords += nwords;
+    for (i=0; ; i++) {
+        i = find_mismatch (expected, actual, i, nwords);
+        if (i >= nwords)
+            break;
+
+        diff = expected[i] ^ actual[i];
+        s0 = __builtin_popcount (diff & expected[i]);
+        s1 = __builtin_popcount (diff & actual[i]);
+        r = get_range (m, addr + i*4);
+        r->nwords++;
+        r->flips += s0 + s1;
+        r->stuck0 += s0;
+        r->stuck1 += s1;
+        m->bad_words++;
+        m->flips += s0 + s1;
+        m->stuck0 += s0;
+        m->stuck1 += s1;
+    }
+}
+
+int mismatch_report (mismatch_map_t *m)
+{
+    unsigned i;
+
+    if (m->bad_words == 0)
+        return 1;
+
+    printf (_("\nMismatch map:\n"));
+    printf (_("      Address     Words  Bits  1->0  0->1\n"));
+    for (i=0; i<m->nranges; i++) {
+        mismatch_t *r = &m->range[i];
+
+        printf ("    %08X-%08X %5u %5u %5u %5u\n", r->addr,
+            r->addr + r->nwords*4 - 1, r->nwords, r->flips,
+            r->stuck0, r->stuck1);
+    }
+    printf (_("        Total: %lu of %lu words in %u ranges, %lu bits flipped\n"),
+        m->bad_words, m->nwords, m->nranges, m->flips);
+    printf (_("     Stuck at: %lu bits read 0, %lu bits read 1\n"),
+        m->stuck0, m->stuck1);
+    return 0;
+}
+
+void mismatch_free (mismatch_map_t *m)
+{
+    free (m->range);
+    memset (m, 0, sizeof (*m));
+}
@@ -0,0 +1,48 @@
+/*
+ * Compare of memory contents with the image, collecting all mismatches.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+/*
+ * Range of adjacent mismatching words.
+ */
+typedef struct {
+    unsigned        addr;               /* Address of the first word */
+    unsigned        nwords;             /* Mismatching words */
+    unsigned        flips;              /* Bits differing */
+    unsigned        stuck0;             /* Expected 1, read 0 */
+    unsigned        stuck1;             /* Expected 0, read 1 */
+} mismatch_t;
+
+typedef struct {
+    mismatch_t      *range;
+    unsigned        nranges;
+    unsigned        maxranges;
+    unsigned long   nwords;             /* Words compared */
+    unsigned long   bad_words;
+    unsigned long   flips;
+    unsigned long   stuck0;
+    unsigned long   stuck1;
+} mismatch_map_t;
+
+/*
+ * Compare nwords words read from the address with the expected data,
+ * adding the mismatches to the map.
+ */
+void mismatch_compare (mismatch_map_t *m, unsigned addr,
+    const unsigned *expected, const unsigned *actual, unsigned nwords);
+
+/*
+ * Print the map. Return 1 when there were no mismatches.
+ */
+int mismatch_report (mismatch_map_t *m);
+
+void mismatch_free (mismatch_map_t *m);
+
+#endif